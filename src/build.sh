@@ -1 +1,5 @@
-gcc main.c p99/p99.h fine_fx_reverb.c fine_fx_reverb.h fine_fx_compress.c fine_log.h fine_audio_io_output_system.c fine_inline.c fine_fx.h fine_fx.c fine_definitions.h fine_audio_io_test.c fine_audio_io_init_params.c fine_audio_io_input_system.c fine_audio_io.h -lasound -lm -o hi
+gcc -O2 main.c fine_fx_reverb.c fine_fx_compress.c fine_clip_cache.c fine_audio_io_output_system.c fine_audio_io_stream.c fine_voice.c fine_grain.c fine_aec.c fine_vad.c fine_fft.c fine_render.c fine_prof.c fine_control.c fine_inline.c fine_log.c fine_rand.c fine_select.c fine_plan.c fine_mix.c fine_kernel.c fine_kernel_sse2.c fine_kernel_avx2.c fine_kernel_avx512.c fine_kernel_neon.c fine_fx.c fine_audio_io_test.c fine_audio_io_init_params.c fine_convert.c fine_audio_io_dev.c fine_wav.c fine_audio_io_input_system.c -lasound -lm -latomic -o hi
+gcc -O2 fine_bench.c fine_fx_reverb.c fine_fx_compress.c fine_fx.c fine_mix.c fine_fft.c fine_aec.c fine_vad.c fine_kernel.c fine_kernel_sse2.c fine_kernel_avx2.c fine_kernel_avx512.c fine_kernel_neon.c fine_inline.c fine_prof.c fine_log.c -lm -latomic -o bench
+gcc -O2 fine_batch.c fine_render.c fine_prof.c fine_plan.c fine_select.c fine_clip_cache.c fine_rand.c fine_fx.c fine_fx_compress.c fine_fx_reverb.c fine_mix.c fine_kernel.c fine_kernel_sse2.c fine_kernel_avx2.c fine_kernel_avx512.c fine_kernel_neon.c fine_wav.c fine_inline.c fine_log.c -lm -latomic -o batch
+gcc -O2 fine_stream_test.c fine_audio_io_stream.c fine_audio_io_dev.c fine_audio_io_init_params.c fine_convert.c fine_wav.c fine_voice.c fine_grain.c fine_render.c fine_clip_cache.c fine_plan.c fine_select.c fine_rand.c fine_aec.c fine_fft.c fine_fx.c fine_fx_compress.c fine_fx_reverb.c fine_mix.c fine_kernel.c fine_kernel_sse2.c fine_kernel_avx2.c fine_kernel_avx512.c fine_kernel_neon.c fine_prof.c fine_log.c fine_inline.c -lasound -lm -latomic -o stream_test
+gcc -O2 fine_aec_test.c fine_aec.c fine_fft.c fine_kernel.c fine_kernel_sse2.c fine_kernel_avx2.c fine_kernel_avx512.c fine_kernel_neon.c fine_prof.c fine_log.c fine_inline.c -lm -latomic -o aec_test
@@ -0,0 +1,344 @@
+#include "fine_aec.h"
+#include "fine_fft.h"
+#include "fine_kernel.h"
+#include "fine_log.h"
+#include "fine_prof.h"
+#include "p99/p99.h"
+#include <inttypes.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define AEC_MS 200 //default FINE_AEC_MS: output buffer, speaker to microphone and the room
+#define AEC_MAX_MS 1000
+#define AEC_MU 0.5f //NLMS step, normalized by the reference power of all partitions
+#define AEC_SMOOTH 0.9f //decay of the reference power per bin, per block
+#define AEC_FLOOR 30.0f //LSB, keeps the step small where the reference is next to silent
+#define AEC_GEIGEL 0.5f //double talk: a microphone sample above this times the loudest reference sample in the tail, at first
+#define AEC_GEIGEL_RISE 1.005f //per block of double talk the level rises, an echo louder than AEC_GEIGEL is learned in seconds
+#define AEC_GEIGEL_MARGIN 2.0f //over the echo, the level once the filter explains it
+#define AEC_HOLD 8 //blocks without adaptation after double talk
+#define AEC_DIVERGED 4.0f //the filter starts over when it makes a block this much louder (energy)
+#define AEC_CONSTRAIN 2 //partitions constrained per block
+#define AEC_CPU_BUDGET 0.25 //of the block duration
+#define AEC_MARGIN 2048 //frames, more than a playback write and a capture read, less than the echo path
+#define AEC_MAX_SLIP 2048 //frames the reference may drift from the capture before it is lined up again
+/* --- END DEFINITIONS FOR TUNING --- */
+
+#define AEC_FFT (2*AEC_BLOCK)
+#define AEC_BINS (AEC_BLOCK+1) //of a real signal, the others are their conjugates
+
+struct EchoRef {
+	_Atomic(uint64_t) written; //frames since the start
+	i16 ring[ECHO_REF_SZ];
+};
+
+struct Aec {
+	EchoRef *ref;
+	uint64_t pos; //next frame of ref
+	uint64_t frames; //of the microphone so far
+	_Atomic(int64_t) offset; //frame of ref when a frame of the microphone was captured, less AEC_MARGIN
+	_Atomic(bool) have_offset;
+	bool synced;
+	Fft *fft;
+	size_t parts;
+	size_t newest; //partition of xr, xi with the newest reference block
+	size_t num_adapt; //partitions adapted per block, round robin
+	size_t next_adapt;
+	size_t next_constrain;
+	float *xr, *xi; //parts*AEC_BINS, spectra of the last reference blocks
+	float *wr, *wi; //parts*AEC_BINS, the filter. Partition p filters the block p blocks before the newest
+	float *peaks; //parts, the loudest reference sample of each block
+	float power[AEC_BINS];
+	float prev_ref[AEC_BLOCK];
+	float in_ref[AEC_BLOCK];
+	float in_mic[AEC_BLOCK];
+	i16 out[AEC_BLOCK];
+	size_t fill; //of in_ref, in_mic, how much of out was given back
+	float re[AEC_FFT];
+	float im[AEC_FFT];
+	int hold;
+	float geigel; //the Geigel level in use, calibrated to the echo path. A reset keeps it, the room is as loud as before
+	double block_ns; //moving average
+	double mic_energy; //of the blocks with echo and without double talk
+	double err_energy;
+	size_t energy_blocks;
+	_Atomic(float) erle;
+};
+
+size_t fine_aec_ms_from_env(void) {
+	char const*const env = getenv("FINE_AEC_MS");
+	if(!env || !*env) return AEC_MS;
+	char *end;
+	unsigned long const ms = strtoul(env, &end, 10);
+	if(*end || ms > AEC_MAX_MS) {
+		fine_log(WARN, "FINE_AEC_MS=%s is not a number of ms up to %d, using %d", env, AEC_MAX_MS, AEC_MS);
+		return AEC_MS;
+	}
+	return ms;
+}
+
+EchoRef *fine_echo_ref_create(void) {
+	EchoRef *const r = calloc(1, sizeof *r);
+	if(!r) fine_exit("Could not allocate the echo reference");
+	return r;
+}
+
+void fine_echo_ref_destroy(EchoRef *const r) {
+	free(r);
+}
+
+void fine_echo_ref_write(EchoRef *const r, i16 const*const frames, size_t const n, unsigned const channels) {
+	uint64_t const w = atomic_load_explicit(&r->written, memory_order_relaxed);
+	for(size_t i = 0; i < n; ++i) {
+		int32_t sum = 0;
+		for(unsigned c = 0; c < channels; ++c) sum += frames[i*channels + c];
+		r->ring[(w+i) & (ECHO_REF_SZ-1)] = sum/(int32_t)channels;
+	}
+	atomic_store_explicit(&r->written, w+n, memory_order_release);
+}
+
+void fine_echo_ref_rewind(EchoRef *const r, size_t const n) {
+	uint64_t const w = atomic_load_explicit(&r->written, memory_order_relaxed);
+	atomic_store_explicit(&r->written, w - P99_MINOF(w, n), memory_order_release);
+}
+
+uint64_t fine_echo_ref_written(EchoRef const*const r) {
+	return atomic_load_explicit(&r->written, memory_order_acquire);
+}
+
+Aec *fine_aec_create(EchoRef *const ref, size_t const ms) {
+	size_t const taps = ms*SAMPLE_RATE/1000;
+	size_t const parts = P99_MAXOF((taps + AEC_BLOCK-1)/AEC_BLOCK, 1);
+	Aec *const a = calloc(1, sizeof *a);
+	if(!a) fine_exit("Could not allocate the echo canceller");
+	a->ref = ref;
+	a->parts = parts;
+	a->fft = fine_fft_create(AEC_FFT);
+	a->xr = malloc(parts*AEC_BINS*sizeof *a->xr);
+	a->xi = malloc(parts*AEC_BINS*sizeof *a->xi);
+	a->wr = malloc(parts*AEC_BINS*sizeof *a->wr);
+	a->wi = malloc(parts*AEC_BINS*sizeof *a->wi);
+	a->peaks = malloc(parts*sizeof *a->peaks);
+	if(!a->xr || !a->xi || !a->wr || !a->wi || !a->peaks) fine_exit("Could not allocate the echo canceller");
+	fine_aec_reset(a);
+	a->geigel = AEC_GEIGEL;
+	return a;
+}
+
+void fine_aec_destroy(Aec *const a) {
+	if(!a) return;
+	fine_fft_destroy(a->fft);
+	free(a->xr);
+	free(a->xi);
+	free(a->wr);
+	free(a->wi);
+	free(a->peaks);
+	free(a);
+}
+
+void fine_aec_reset(Aec *const a) {
+	size_t const sz = a->parts*AEC_BINS*sizeof(float);
+	memset(a->xr, 0, sz);
+	memset(a->xi, 0, sz);
+	memset(a->wr, 0, sz);
+	memset(a->wi, 0, sz);
+	memset(a->peaks, 0, a->parts*sizeof *a->peaks);
+	memset(a->power, 0, sizeof a->power);
+	memset(a->prev_ref, 0, sizeof a->prev_ref);
+	a->num_adapt = a->parts;
+	a->hold = 0;
+	a->mic_energy = a->err_energy = 0;
+	a->energy_blocks = 0;
+}
+
+float fine_aec_erle(Aec const*const a) {
+	return atomic_load_explicit(&a->erle, memory_order_relaxed);
+}
+
+static inline i16 to_i16(float const x) {
+	if(x >= INT16_MAX) return INT16_MAX;
+	if(x <= INT16_MIN) return INT16_MIN;
+	return lrintf(x);
+}
+
+//The bins above AEC_BLOCK of a real signal from the ones below
+static void conjugates(float *const re, float *const im) {
+	for(size_t k = 1; k < AEC_BLOCK; ++k) {
+		re[AEC_FFT-k] = re[k];
+		im[AEC_FFT-k] = -im[k];
+	}
+}
+
+//Back to AEC_BLOCK taps, the rest of the FFT is the wrap around of the circular convolution
+static void constrain(Aec *const a, size_t const p) {
+	float *const wr = a->wr + p*AEC_BINS, *const wi = a->wi + p*AEC_BINS;
+	memcpy(a->re, wr, AEC_BINS*sizeof *wr);
+	memcpy(a->im, wi, AEC_BINS*sizeof *wi);
+	conjugates(a->re, a->im);
+	fine_fft_inverse(a->fft, a->re, a->im);
+	memset(a->re+AEC_BLOCK, 0, AEC_BLOCK*sizeof *a->re);
+	memset(a->im, 0, AEC_FFT*sizeof *a->im);
+	fine_fft_forward(a->fft, a->re, a->im);
+	memcpy(wr, a->re, AEC_BINS*sizeof *wr);
+	memcpy(wi, a->im, AEC_BINS*sizeof *wi);
+}
+
+//in_mic holds the error of the block
+static void adapt(Aec *const a) {
+	memset(a->re, 0, AEC_BLOCK*sizeof *a->re);
+	memcpy(a->re+AEC_BLOCK, a->in_mic, AEC_BLOCK*sizeof *a->re);
+	memset(a->im, 0, AEC_FFT*sizeof *a->im);
+	fine_fft_forward(a->fft, a->re, a->im);
+
+	//the power of the whole tail per bin: an onset counts at once, the decay is smoothed
+	float const floor = (float)AEC_FFT*AEC_FLOOR*AEC_FLOOR*a->parts;
+	for(size_t k = 0; k < AEC_BINS; ++k) {
+		float power = 0;
+		for(size_t p = 0; p < a->parts; ++p) {
+			float const xr = a->xr[p*AEC_BINS + k], xi = a->xi[p*AEC_BINS + k];
+			power += xr*xr + xi*xi;
+		}
+		a->power[k] = P99_MAXOF(AEC_SMOOTH*a->power[k], power);
+		float const mu = AEC_MU/(a->power[k] + floor);
+		a->re[k] *= mu;
+		a->im[k] *= mu;
+	}
+	for(size_t i = 0; i < a->num_adapt; ++i) {
+		size_t const p = (a->next_adapt + i) % a->parts, x = (a->newest + p) % a->parts;
+		fine_kernels->cmac(a->wr + p*AEC_BINS, a->wi + p*AEC_BINS, a->xr + x*AEC_BINS, a->xi + x*AEC_BINS, a->re, a->im, AEC_BINS, 1);
+	}
+	a->next_adapt = (a->next_adapt + a->num_adapt) % a->parts;
+	for(size_t i = 0; i < P99_MINOF(AEC_CONSTRAIN, a->parts); ++i) {
+		constrain(a, a->next_constrain);
+		a->next_constrain = (a->next_constrain + 1) % a->parts;
+	}
+}
+
+static void block(Aec *const a) {
+	uint64_t const start = fine_prof_now();
+	size_t const parts = a->parts;
+
+	//overlap-save: the newest block after the one before it
+	a->newest = (a->newest + parts - 1) % parts;
+	memcpy(a->re, a->prev_ref, sizeof a->prev_ref);
+	memcpy(a->re+AEC_BLOCK, a->in_ref, sizeof a->in_ref);
+	memset(a->im, 0, sizeof a->im);
+	memcpy(a->prev_ref, a->in_ref, sizeof a->in_ref);
+	fine_fft_forward(a->fft, a->re, a->im);
+	memcpy(a->xr + a->newest*AEC_BINS, a->re, AEC_BINS*sizeof *a->re);
+	memcpy(a->xi + a->newest*AEC_BINS, a->im, AEC_BINS*sizeof *a->im);
+	float peak = 0;
+	for(size_t i = 0; i < AEC_BLOCK; ++i) peak = P99_MAXOF(peak, fabsf(a->in_ref[i]));
+	a->peaks[a->newest] = peak;
+	float ref_peak = 0;
+	for(size_t p = 0; p < parts; ++p) ref_peak = P99_MAXOF(ref_peak, a->peaks[p]);
+
+	//the echo: every reference block through its partition of the filter
+	memset(a->re, 0, sizeof a->re);
+	memset(a->im, 0, sizeof a->im);
+	for(size_t p = 0; p < parts; ++p) {
+		size_t const x = (a->newest + p) % parts;
+		fine_kernels->cmac(a->re, a->im, a->xr + x*AEC_BINS, a->xi + x*AEC_BINS, a->wr + p*AEC_BINS, a->wi + p*AEC_BINS, AEC_BINS, 0);
+	}
+	conjugates(a->re, a->im);
+	fine_fft_inverse(a->fft, a->re, a->im);
+
+	float mic_peak = 0;
+	double mic_energy = 0, err_energy = 0;
+	for(size_t i = 0; i < AEC_BLOCK; ++i) {
+		float const mic = a->in_mic[i], err = mic - a->re[AEC_BLOCK+i];
+		mic_peak = P99_MAXOF(mic_peak, fabsf(mic));
+		mic_energy += mic*mic;
+		err_energy += err*err;
+		a->in_mic[i] = err;
+		a->out[i] = to_i16(err);
+	}
+
+	float const floor = (float)AEC_BLOCK*AEC_FLOOR*AEC_FLOOR;
+	if(mic_energy > floor && err_energy > AEC_DIVERGED*mic_energy) {
+		fine_log(DEBUG, "echo canceller diverged, starting over");
+		fine_aec_reset(a);
+		//the block goes out as it came in
+		for(size_t i = 0; i < AEC_BLOCK; ++i) a->out[i] = to_i16(a->in_mic[i] + a->re[AEC_BLOCK+i]);
+	}
+	/* Geigel: the reference can't make the microphone this loud, someone in the room does.
+	 * A room that is louder than the level thinks so too, so the level creeps up while it holds, until the
+	 * filter adapts. Once the filter explains most of a block, that block is echo and the level stays above it. */
+	else if(mic_peak > a->geigel*ref_peak) {
+		a->hold = AEC_HOLD;
+		if(ref_peak > AEC_FLOOR) a->geigel *= AEC_GEIGEL_RISE;
+	}
+	else if(a->hold) --a->hold;
+	else {
+		if(ref_peak > AEC_FLOOR && 4*err_energy < mic_energy)
+			a->geigel = P99_MAXOF(a->geigel, AEC_GEIGEL_MARGIN*mic_peak/ref_peak);
+		adapt(a);
+		a->mic_energy += mic_energy;
+		a->err_energy += err_energy;
+		if(++a->energy_blocks*AEC_BLOCK >= SAMPLE_RATE) {
+			atomic_store_explicit(&a->erle, 10*log10((a->mic_energy + 1)/(a->err_energy + 1)), memory_order_relaxed);
+			a->mic_energy = a->err_energy = 0;
+			a->energy_blocks = 0;
+		}
+	}
+
+	double const ns = fine_prof_end(FINE_STAGE_ECHO, start) - start;
+	a->block_ns = 0.9*a->block_ns + 0.1*ns;
+	double const budget = AEC_CPU_BUDGET*AEC_BLOCK*1e9/SAMPLE_RATE;
+	if(a->block_ns > budget && a->num_adapt > 1) --a->num_adapt;
+	else if(a->block_ns < budget/2 && a->num_adapt < parts) ++a->num_adapt;
+}
+
+void fine_aec_process(Aec *const a, i16 *const mic, i16 const*const ref, size_t const n) {
+	for(size_t i = 0; i < n; ++i) {
+		a->in_mic[a->fill] = mic[i];
+		a->in_ref[a->fill] = ref[i];
+		mic[i] = a->out[a->fill];
+		if(++a->fill == AEC_BLOCK) {
+			block(a);
+			a->fill = 0;
+		}
+	}
+}
+
+void fine_aec_sync(Aec *const a, uint64_t const heard, uint64_t const captured) {
+	atomic_store_explicit(&a->offset, (int64_t)(heard - captured) - AEC_MARGIN, memory_order_relaxed);
+	atomic_store_explicit(&a->have_offset, 1, memory_order_release);
+}
+
+//n frames of the reference in step with the capture, silence where the playback wrote nothing
+static void read_ref(Aec *const a, i16 *const out, size_t const n) {
+	EchoRef *const r = a->ref;
+	uint64_t const w = atomic_load_explicit(&r->written, memory_order_acquire);
+	if(!atomic_load_explicit(&a->have_offset, memory_order_acquire)) {
+		memset(out, 0, n*sizeof *out);
+		a->frames += n;
+		return;
+	}
+	int64_t const want = (int64_t)a->frames + atomic_load_explicit(&a->offset, memory_order_relaxed);
+	//After an xrun, a rewind or a new measurement of the delays it is lined up again
+	if(!a->synced || (int64_t)a->pos > want + AEC_MAX_SLIP || (int64_t)a->pos < want - AEC_MAX_SLIP) {
+		if(a->synced) fine_log(DEBUG, "echo reference is %+" PRId64 " frames off", (int64_t)a->pos - want);
+		a->pos = P99_MAXOF(want, 0);
+		a->synced = 1;
+	}
+	//what was overwritten or not written yet is silent
+	for(size_t i = 0; i < n; ++i) {
+		uint64_t const f = a->pos + i;
+		out[i] = f < w && w - f <= ECHO_REF_SZ ? r->ring[f & (ECHO_REF_SZ-1)] : 0;
+	}
+	a->pos += n;
+	a->frames += n;
+}
+
+void fine_aec_cancel(Aec *const a, i16 *const mic, size_t const n) {
+	i16 ref[AEC_BLOCK];
+	for(size_t done = 0; done < n; done += AEC_BLOCK) {
+		size_t const len = P99_MINOF(n - done, AEC_BLOCK);
+		read_ref(a, ref, len);
+		fine_aec_process(a, mic+done, ref, len);
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "fine_definitions.h"
+
+/*
+ * Acoustic echo cancellation, so the microphones don't record what the speakers play.
+ * The playback device of the first zone copies every frame it writes, mixed to mono, into an EchoRef
+ * (fine_audio_dev_write). Every capture device reads that reference in step with what it captures and
+ * removes its echo from the samples before anything sees them (fine_audio_dev_read), so the trigger and
+ * the recordings only get the sound of the room. The monitor lines the two up from the device delays
+ * (fine_aec_sync), the reference is read AEC_MARGIN frames early for their jitter.
+ *
+ * The canceller is a partitioned block frequency domain adaptive filter (PBFDAF): the echo path is
+ * FINE_AEC_MS long, cut into partitions of AEC_BLOCK taps, filtered and adapted with normalized LMS in the
+ * frequency domain, overlap-save with FFTs of 2*AEC_BLOCK (fine_fft.h). The partitions are constrained
+ * back to AEC_BLOCK taps round robin, a few per block. While the microphone is much louder than the
+ * reference could make it (double talk, Geigel), the filter holds still. How loud that is starts at the
+ * classic half of the reference and is then learned from the echo.
+ * If a block takes longer than AEC_CPU_BUDGET of its duration, fewer partitions adapt per block until it fits.
+ * The output is AEC_BLOCK samples late.
+ * */
+#define AEC_BLOCK 256
+#define ECHO_REF_SZ (1 << 16) //frames kept of the reference, a power of 2
+
+typedef struct EchoRef EchoRef;
+typedef struct Aec Aec;
+
+//FINE_AEC_MS, the echo path the canceller models in ms. 0 turns it off
+size_t fine_aec_ms_from_env(void);
+
+EchoRef *fine_echo_ref_create(void);
+void fine_echo_ref_destroy(EchoRef *r);
+//Playback: n frames of channels were written to the device. Only one thread may write
+void fine_echo_ref_write(EchoRef *r, i16 const* frames, size_t n, unsigned channels);
+//Playback: the last n frames written were taken back
+void fine_echo_ref_rewind(EchoRef *r, size_t n);
+//@return frames written since the start, less the ones taken back. Any thread
+uint64_t fine_echo_ref_written(EchoRef const* r);
+
+//ref: where fine_aec_cancel reads the reference, 0 if only fine_aec_process is used
+Aec *fine_aec_create(EchoRef *ref, size_t ms);
+void fine_aec_destroy(Aec *a);
+//Forgets the echo path
+void fine_aec_reset(Aec *a);
+
+//Capture: replaces the n samples in mic with themselves without the echo of ref, AEC_BLOCK samples later
+void fine_aec_process(Aec *a, i16 *mic, i16 const* ref, size_t n);
+//Capture: fine_aec_process with the next n frames of the EchoRef
+void fine_aec_cancel(Aec *a, i16 *mic, size_t n);
+/* Any thread: frame heard of the EchoRef was playing while frame captured of the microphone was captured
+ * (written less the playback delay, read plus the capture delay, see DevStatus). Until then the reference is silent.
+ * */
+void fine_aec_sync(Aec *a, uint64_t heard, uint64_t captured);
+
+//@return echo return loss enhancement in dB over the last second with echo, 0 before. Any thread
+float fine_aec_erle(Aec const* a);
@@ -0,0 +1,76 @@
+/*
+ * Convergence of the echo canceller. Build with the fifth line of build.sh, run ./aec_test
+ * Every case plays noise as the reference into a room that echoes it TEST_DELAY frames later with a gain,
+ * some of them louder than the reference, and checks that the canceller removes at least TEST_MIN_ERLE
+ * of it in the last second, measured on its output and as fine_aec_erle reports it.
+ * @return 1 if any case fails
+ * */
+#include "fine_definitions.h"
+#include "fine_aec.h"
+#include "fine_kernel.h"
+#include "fine_log.h"
+#include "p99/p99.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define TEST_SECONDS 20
+#define TEST_AEC_MS 200
+#define TEST_DELAY 3000 //frames from the reference to the microphone, within TEST_AEC_MS
+#define TEST_REFLECTION 500 //frames after it, the same echo once more at a third of the gain
+#define TEST_LEVEL 3000.0f //of the reference noise
+#define TEST_CHUNK 480 //frames per call, like a capture period
+#define TEST_MIN_ERLE 20.0f //dB
+/* --- END DEFINITIONS FOR TUNING --- */
+
+#define TEST_SZ (TEST_SECONDS*SAMPLE_RATE)
+
+static i16 clamp(float const x) {
+	return P99_MAXOF(INT16_MIN, P99_MINOF(INT16_MAX, lrintf(x)));
+}
+
+static bool run(char const*const name, float const gain) {
+	i16 *const ref = malloc(TEST_SZ*sizeof *ref);
+	i16 *const echo = malloc(TEST_SZ*sizeof *echo);
+	i16 *const mic = malloc(TEST_SZ*sizeof *mic);
+	if(!ref || !echo || !mic) fine_exit("Could not allocate the signals");
+	srand(1);
+	for(size_t i = 0; i < TEST_SZ; ++i) ref[i] = clamp(TEST_LEVEL*(2.0f*rand()/RAND_MAX - 1));
+	for(size_t i = 0; i < TEST_SZ; ++i) {
+		float e = 0;
+		if(i >= TEST_DELAY) e += gain*ref[i-TEST_DELAY];
+		if(i >= TEST_DELAY+TEST_REFLECTION) e += gain/3*ref[i-TEST_DELAY-TEST_REFLECTION];
+		echo[i] = mic[i] = clamp(e);
+	}
+
+	Aec *const a = fine_aec_create(0, TEST_AEC_MS);
+	for(size_t i = 0; i < TEST_SZ; i += TEST_CHUNK) fine_aec_process(a, mic+i, ref+i, P99_MINOF(TEST_CHUNK, TEST_SZ-i));
+
+	//the output is AEC_BLOCK frames late
+	double echo_energy = 0, out_energy = 0;
+	for(size_t i = TEST_SZ - SAMPLE_RATE; i < TEST_SZ; ++i) {
+		echo_energy += (double)echo[i-AEC_BLOCK]*echo[i-AEC_BLOCK];
+		out_energy += (double)mic[i]*mic[i];
+	}
+	double const erle = 10*log10((echo_energy + 1)/(out_energy + 1));
+	float const reported = fine_aec_erle(a);
+	bool const ok = erle >= TEST_MIN_ERLE && reported >= TEST_MIN_ERLE;
+	printf("%-40s %s (%.1f dB, reported %.1f dB)\n", name, ok ? "ok" : "FAIL", erle, reported);
+	fine_aec_destroy(a);
+	free(ref);
+	free(echo);
+	free(mic);
+	return ok;
+}
+
+int main(void) {
+	fine_log_init();
+	fine_kernel_init();
+	bool failed = 0;
+	failed |= !run("echo at half the reference", 0.5f);
+	failed |= !run("echo louder than the reference", 1.5f);
+	failed |= !run("echo three times the reference", 3.0f);
+	fine_log_shutdown();
+	return failed;
+}
@@ -1,18 +1,139 @@
 #pragma once
 
-#include <alsa/asoundlib.h>
 #include "fine_definitions.h"
+#include <stdatomic.h>
 #include <threads.h>
 
-int fine_init_devices(char const* out_name, char const* in_name, 
-		 snd_pcm_t **pcm_out_addr, snd_pcm_t **pcm_in_addr,
-		 snd_pcm_hw_params_t *params_out, snd_pcm_hw_params_t *params_in);
+/*
+ * Audio devices. The threads only see AudioDev, so the same pipeline runs on ALSA or, as fast as the
+ * CPU allows, on files and null playback (load tests, profiling on a headless box).
+ * Device specs, as given on the command line or in the names file:
+ *  - "file:<path>": a .wav or raw 16 bit LE file at SAMPLE_RATE, mono for capture. Capture ends with the file.
+ *  - "null": capture reads silence forever, in real time, playback throws the samples away as fast as it can
+ *  - "alsa:<name>" or just an ALSA name like "default" or "hw:1,0". If it can't run at SAMPLE_RATE, S16 with the
+ *    channels asked for, it runs at what it can and the samples are converted, see fine_convert.h.
+ *    period is in converted frames.
+ * Capture is always mono. Playback frames have 1 to MAX_CHANNELS interleaved channels, see fine_mix.h.
+ * */
+enum {FINE_CAPTURE, FINE_PLAYBACK};
 
-int fine_input_write_buf(i16 * data, size_t sz, snd_pcm_t *pcm_in, snd_pcm_hw_params_t *hw_in);
-int fine_output_read_buf(i16 * data, size_t sz, snd_pcm_t *pcm_out, snd_pcm_hw_params_t *hw_out);
+//Health of a stream, see fine_audio_dev_status
+typedef struct DevStatus DevStatus;
+struct DevStatus {
+	uint64_t frames; //read or written since the device was opened
+	uint64_t xruns;
+	uint64_t short_io; //reads or writes that moved fewer frames than asked for
+	uint64_t lost_frames; //estimated from the xrun timestamps
+	bool running;
+	//Only for devices with a clock (ALSA), 0 otherwise:
+	long delay; //playback: frames until a sample written now is heard, capture: frames captured but not read yet
+	long avail; //frames that can be written or read now without blocking
+	long max_delay; //largest delay the monitor saw, capture: closest to an overrun
+	long min_delay; //smallest delay the monitor saw while running, playback: closest to an underrun
+	double drift_ppm; //device clock against CLOCK_MONOTONIC since the stream was started, positive if it runs fast
+	double interval_drift_ppm; //the same over the last whole DRIFT_INTERVAL_MS the monitor saw, 0 before
+	double clock_s; //since the stream was started, by CLOCK_MONOTONIC...
+	double device_s; //...and by the device clock
+};
 
+typedef struct EchoRef EchoRef;
+typedef struct Aec Aec;
+typedef struct AudioDev AudioDev;
+struct AudioDev {
+	char const* kind;
+	unsigned channels; //samples per frame, interleaved
+	size_t period; //frames per read or write call
+	bool eof; //capture only: the input ended, read returns 0 from now on
+	bool clocked; //reads and writes are paced by the device clock, so playback can write silence when idle
+	/* Both block for real devices and recover from xruns on their own.
+	 * @return the number of frames read or written, 0 only at eof */
+	size_t (*read)(AudioDev *dev, i16 *data, size_t n);
+	size_t (*write)(AudioDev *dev, i16 const* data, size_t n);
+	void (*start)(AudioDev *dev); //snd_pcm_prepare
+	void (*stop)(AudioDev *dev); //snd_pcm_drop, drops what was not played or read yet
+	//Playback only, 0 if the device can't. Blocks until everything written was played
+	void (*drain)(AudioDev *dev);
+	/* Playback only, 0 if the device can't. Takes back up to max frames that were written but not played yet,
+	 * the next write replaces them. @return the number of frames taken back */
+	size_t (*rewind)(AudioDev *dev, size_t max);
+	void (*close)(AudioDev *dev);
+	//Fills the fields of st that need the device clock. 0 for devices without one. @return -1 on error
+	int (*status)(AudioDev *dev, DevStatus *st);
+	//See fine_aec.h, 0 without echo cancellation. Playback: gets a copy of what is written, capture: cancels the echo in what is read
+	EchoRef *echo;
+	Aec *aec;
 
-void fine_thread_init_everything(ASys *res, snd_pcm_hw_params_t *hw_out, snd_pcm_hw_params_t *hw_in, snd_pcm_t *pcm_out, snd_pcm_t *pcm_in);
+	//Kept by fine_audio_dev_read/write, recover and the monitor. Atomic because the monitor reads them
+	_Atomic(uint64_t) frames;
+	_Atomic(uint64_t) xruns;
+	_Atomic(uint64_t) short_io;
+	_Atomic(uint64_t) lost_frames;
+	_Atomic(long) max_delay;
+	_Atomic(long) min_delay; //LONG_MAX until the monitor saw the device running
+	_Atomic(double) interval_drift_ppm;
+	double drift_clock_s, drift_device_s; //monitor only: where the current drift interval started, 0 before
+};
+
+//@return 0 if the device can't be opened (logged). channels: of playback frames, capture ignores it
+AudioDev *fine_audio_dev_open(char const* spec, int dir, unsigned channels);
+AudioDev *fine_audio_dev_open_alsa(char const* name, int dir, unsigned channels);
+void fine_audio_dev_close(AudioDev *dev);
+
+//dev->read and dev->write with the frame and short read/write counts and the echo cancellation
+size_t fine_audio_dev_read(AudioDev *dev, i16 *data, size_t n);
+size_t fine_audio_dev_write(AudioDev *dev, i16 const* data, size_t n);
+//dev->rewind, 0 if the device can't. Takes the frames back from dev->echo too
+size_t fine_audio_dev_rewind(AudioDev *dev, size_t max);
+
+//Can be called from any thread while the device is in use. @return -1 if the device clock can't be read
+int fine_audio_dev_status(AudioDev *dev, DevStatus *st);
+void fine_audio_dev_report(AudioDev *dev, char const* what, int level);
+
+//Samples the status of all devices once a period (FINE_MONITOR_MS) until sys->stopped
+int fine_thread_monitor(void *ptr);
+
+/*
+ * Playback stream: the output device is started once and kept running until fine_stream_stop.
+ * The collages the output thread renders are queued and each one is crossfaded into the end of the one before,
+ * silence is written while there is nothing to play. While fade_out is set, the playing collage fades out
+ * within STREAM_FADE_OUT_MS and queued ones are dropped.
+ * With voices it plays them instead, see fine_voice.h: collages overlap and fade_out is not used.
+ * With grains every collage is a cloud of grains instead, see fine_grain.h.
+ * */
+typedef struct Stream Stream;
+typedef struct Plan Plan;
+typedef struct Voices Voices;
+typedef struct Grains Grains;
+/* Starts the playback thread, buffers hold max_samples frames of out->channels.
+ * voices and grains: 0 to play collages from fine_stream_next */
+Stream *fine_stream_start(AudioDev *out, _Atomic(bool) const* fade_out, size_t max_samples, Voices *voices, Grains *grains);
+//Blocks until the stream wants the next collage: nothing is queued and the playing one is about to end. @return the buffer to render it into
+i16 *fine_stream_next(Stream *s);
+//Queues the buffer from fine_stream_next, sz 0 gives it back. published: when the recording it answers was published, or 0
+void fine_stream_put(Stream *s, i16 *data, size_t sz, uint64_t published);
+//With voices or grains: starts a voice playing plan, or a cloud over its clips drawn from seed
+void fine_stream_play(Stream *s, Plan const* plan, size_t newest_rec_idx, uint64_t seed, uint64_t published);
+//Plays what is queued, then stops the device
+void fine_stream_stop(Stream *s);
+
+//Reads or writes exactly sz frames (of in or out->channels), period by period. @return 0, -1 at eof
+int fine_input_write_buf(i16 * data, size_t sz, AudioDev *in);
+int fine_output_read_buf(i16 const* data, size_t sz, AudioDev *out);
+
+
+//Every output device in outs is a zone, every input device in ins a Mic
+void fine_thread_init_everything(ASys *res, AudioDev *const* outs, size_t num_zones, AudioDev *const* ins, size_t num_mics);
+//After the threads are joined
+void fine_thread_free_everything(ASys *sys);
+/* Sets sys->stopped and wakes the output thread. The threads then end on their own.
+ * now: the current collage fades out and no other one is started. Otherwise a collage that was asked for still plays.
+ * */
+void fine_thread_stop_everything(ASys *sys, bool now);
+//Sets play of every zone, with play it wakes their output threads
+void fine_thread_play(ASys *sys, bool play);
+//ptr is a Mic of the ASys
 int fine_thread_input_idle(void *ptr);
+//Moves the recordings the inputs published into the selector. playback_mtx must be held
+void fine_thread_apply_published(ASys *sys);
+//ptr is a Zone of the ASys
 int fine_thread_output(void *ptr);
-
@@ -0,0 +1,271 @@
+#include "fine_aec.h"
+#include "fine_audio_io.h"
+#include "fine_definitions.h"
+#include "fine_log.h"
+#include "fine_wav.h"
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define FILE_DEV_PERIOD 8192 //same as the ALSA period
+#define MONITOR_MS 1000 //between two status samples
+#define DRIFT_INTERVAL_MS 10000 //of the drift series, long enough for a pointer that moves a period at a time
+/* --- END DEFINITIONS FOR TUNING --- */
+
+typedef struct FileDev FileDev;
+struct FileDev {
+	AudioDev dev; //first, so an AudioDev* is a FileDev*
+	FILE *file;
+	bool wav;
+	size_t num_frames; //written so far, for the wav header
+	size_t frames_left; //capture from a wav file: the data chunk may be followed by other chunks
+	WavInfo format; //of a wav file
+};
+
+static bool has_suffix(char const*const s, char const*const suffix) {
+	size_t const n = strlen(s), m = strlen(suffix);
+	return n >= m && !strcmp(s+n-m, suffix);
+}
+
+static size_t file_read(AudioDev *const dev, i16 *const data, size_t n) {
+	FileDev *const f = (FileDev *)dev;
+	if(f->wav && n > f->frames_left) n = f->frames_left;
+	size_t const got = fread(data, sizeof *data, n, f->file);
+	if(f->wav) f->frames_left -= got;
+	if(!got) dev->eof = 1;
+	return got;
+}
+
+static size_t file_write(AudioDev *const dev, i16 const*const data, size_t const n) {
+	FileDev *const f = (FileDev *)dev;
+	size_t const written = fwrite(data, sizeof *data*dev->channels, n, f->file);
+	if(written < n) fine_log(ERROR, "file output: wrote %zu of %zu frames", written, n);
+	f->num_frames += written;
+	//a full disk shouldn't make the output thread spin
+	return n;
+}
+
+static void file_nothing(AudioDev *const dev) { (void)dev; }
+
+static void file_close(AudioDev *const dev) {
+	FileDev *const f = (FileDev *)dev;
+	if(f->wav && dev->write) fine_wav_finish(f->file, &f->format, f->num_frames);
+	fclose(f->file);
+	free(f);
+}
+
+static AudioDev *open_file(char const*const path, int const dir, unsigned const channels) {
+	FILE *const file = fopen(path, dir == FINE_CAPTURE ? "rb" : "wb");
+	if(!file) {
+		fine_log(WARN, "%s could not be opened for %s", path, dir == FINE_CAPTURE ? "capture" : "playback");
+		return 0;
+	}
+	FileDev *const f = calloc(1, sizeof *f);
+	if(!f) fine_exit("Could not allocate file device");
+	*f = (FileDev){
+		.dev = {
+			.kind = "file",
+			.channels = channels,
+			.period = FILE_DEV_PERIOD,
+			.read = dir == FINE_CAPTURE ? file_read : 0,
+			.write = dir == FINE_PLAYBACK ? file_write : 0,
+			.start = file_nothing,
+			.stop = file_nothing,
+			.close = file_close,
+		},
+		.file = file,
+		.wav = has_suffix(path, ".wav") || has_suffix(path, ".WAV"),
+		.format = {.sample_rate = SAMPLE_RATE, .channels = channels, .bits = 16},
+	};
+
+	if(f->wav && dir == FINE_CAPTURE) {
+		WavInfo info;
+		if(fine_wav_read_header(file, &info) < 0 || info.sample_rate != SAMPLE_RATE || info.channels != 1 || info.bits != 16) {
+			fine_log(WARN, "%s must be a 16 bit mono wav file at %d Hz", path, SAMPLE_RATE);
+			file_close(&f->dev);
+			return 0;
+		}
+		f->frames_left = info.num_frames;
+	}
+	else if(f->wav && fine_wav_write_header(file, &f->format) < 0) {
+		fine_log(WARN, "Could not write to %s", path);
+		file_close(&f->dev);
+		return 0;
+	}
+	fine_log(INFO, "%s file %s is ready", dir == FINE_CAPTURE ? "Input" : "Output", path);
+	return &f->dev;
+}
+
+typedef struct NullDev NullDev;
+struct NullDev {
+	AudioDev dev; //first, so an AudioDev* is a NullDev*
+	struct timespec next; //capture: when the next read is due, 0 before the first one
+};
+
+//Silence at SAMPLE_RATE on CLOCK_MONOTONIC, so the input thread waits for it like for a microphone
+static size_t null_read(AudioDev *const dev, i16 *const data, size_t const n) {
+	NullDev *const d = (NullDev *)dev;
+	if(!d->next.tv_sec) clock_gettime(CLOCK_MONOTONIC, &d->next);
+	uint64_t const ns = d->next.tv_nsec + (uint64_t)n*1000000000/SAMPLE_RATE;
+	d->next.tv_sec += ns/1000000000;
+	d->next.tv_nsec = ns%1000000000;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &d->next, 0) == EINTR);
+	memset(data, 0, n*sizeof *data);
+	return n;
+}
+static size_t null_write(AudioDev *const dev, i16 const*const data, size_t const n) {
+	(void)dev;
+	(void)data;
+	return n;
+}
+static void null_close(AudioDev *const dev) { free(dev); }
+
+static AudioDev *open_null(int const dir, unsigned const channels) {
+	NullDev *const d = calloc(1, sizeof *d);
+	if(!d) fine_exit("Could not allocate null device");
+	d->dev = (AudioDev){
+		.kind = "null",
+		.channels = channels,
+		.period = FILE_DEV_PERIOD,
+		.read = dir == FINE_CAPTURE ? null_read : 0,
+		.write = dir == FINE_PLAYBACK ? null_write : 0,
+		.start = file_nothing,
+		.stop = file_nothing,
+		.close = null_close,
+	};
+	return &d->dev;
+}
+
+AudioDev *fine_audio_dev_open(char const*const spec, int const dir, unsigned channels) {
+	assert(channels >= 1 && channels <= MAX_CHANNELS);
+	if(dir == FINE_CAPTURE) channels = 1;
+	AudioDev *const dev = !strncmp(spec, "file:", 5) ? open_file(spec+5, dir, channels)
+		: !strcmp(spec, "null") ? open_null(dir, channels)
+		: fine_audio_dev_open_alsa(!strncmp(spec, "alsa:", 5) ? spec+5 : spec, dir, channels);
+	if(dev) atomic_store_explicit(&dev->min_delay, LONG_MAX, memory_order_relaxed);
+	return dev;
+}
+
+void fine_audio_dev_close(AudioDev *const dev) {
+	if(dev) dev->close(dev);
+}
+
+size_t fine_audio_dev_read(AudioDev *const dev, i16 *const data, size_t const n) {
+	size_t const got = dev->read(dev, data, n);
+	atomic_fetch_add_explicit(&dev->frames, got, memory_order_relaxed);
+	if(got < n && !dev->eof) atomic_fetch_add_explicit(&dev->short_io, 1, memory_order_relaxed);
+	if(dev->aec && got) fine_aec_cancel(dev->aec, data, got);
+	return got;
+}
+
+size_t fine_audio_dev_write(AudioDev *const dev, i16 const*const data, size_t const n) {
+	size_t const written = dev->write(dev, data, n);
+	atomic_fetch_add_explicit(&dev->frames, written, memory_order_relaxed);
+	if(written < n) atomic_fetch_add_explicit(&dev->short_io, 1, memory_order_relaxed);
+	if(dev->echo) fine_echo_ref_write(dev->echo, data, written, dev->channels);
+	return written;
+}
+
+size_t fine_audio_dev_rewind(AudioDev *const dev, size_t const max) {
+	if(!dev->rewind) return 0;
+	size_t const n = dev->rewind(dev, max);
+	if(dev->echo) fine_echo_ref_rewind(dev->echo, n);
+	return n;
+}
+
+int fine_audio_dev_status(AudioDev *const dev, DevStatus *const st) {
+	long const min_delay = atomic_load_explicit(&dev->min_delay, memory_order_relaxed);
+	*st = (DevStatus){
+		.frames = atomic_load_explicit(&dev->frames, memory_order_relaxed),
+		.xruns = atomic_load_explicit(&dev->xruns, memory_order_relaxed),
+		.short_io = atomic_load_explicit(&dev->short_io, memory_order_relaxed),
+		.lost_frames = atomic_load_explicit(&dev->lost_frames, memory_order_relaxed),
+		.running = !dev->eof,
+		.max_delay = atomic_load_explicit(&dev->max_delay, memory_order_relaxed),
+		.min_delay = min_delay == LONG_MAX ? 0 : min_delay,
+		.interval_drift_ppm = atomic_load_explicit(&dev->interval_drift_ppm, memory_order_relaxed),
+	};
+	return dev->status ? dev->status(dev, st) : 0;
+}
+
+void fine_audio_dev_report(AudioDev *const dev, char const*const what, int const level) {
+	DevStatus st;
+	if(fine_audio_dev_status(dev, &st) < 0) {
+		fine_log(WARN, "%s: status can't be read", what);
+		return;
+	}
+	fine_log(level, "%s (%s): %" PRIu64 " frames, %" PRIu64 " xruns, ~%" PRIu64 " frames lost, %" PRIu64 " short, "
+		"delay %ld (%ld..%ld), avail %ld, drift %+.1f ppm%s", what, dev->kind, st.frames, st.xruns, st.lost_frames,
+		st.short_io, st.delay, st.min_delay, st.max_delay, st.avail, st.drift_ppm, st.running ? "" : ", stopped");
+}
+
+/* The monitor keeps the delay extremes, they tell how much of the buffer is actually needed
+ * @return the drift of the device clock in ppm, 0 if unknown
+ * */
+static double monitor_sample(AudioDev *const dev, char const*const what, uint64_t *const last_xruns, DevStatus *const out) {
+	DevStatus st = {0};
+	*out = st;
+	if(!dev->status || fine_audio_dev_status(dev, &st) < 0) return 0;
+	*out = st;
+	if(st.running) {
+		if(st.delay > st.max_delay) atomic_store_explicit(&dev->max_delay, st.delay, memory_order_relaxed);
+		if(st.delay < atomic_load_explicit(&dev->min_delay, memory_order_relaxed))
+			atomic_store_explicit(&dev->min_delay, st.delay, memory_order_relaxed);
+	}
+	//The drift since the start is an average, the series over the intervals shows a clock that wanders
+	if(st.clock_s < dev->drift_clock_s) dev->drift_clock_s = 0; //restarted
+	if(st.clock_s > 0 && !dev->drift_clock_s) {
+		dev->drift_clock_s = st.clock_s;
+		dev->drift_device_s = st.device_s;
+	}
+	else if(st.clock_s > 0 && st.clock_s - dev->drift_clock_s >= DRIFT_INTERVAL_MS/1e3) {
+		double const ppm = ((st.device_s - dev->drift_device_s)/(st.clock_s - dev->drift_clock_s) - 1)*1e6;
+		atomic_store_explicit(&dev->interval_drift_ppm, ppm, memory_order_relaxed);
+		fine_log(DEBUG, "%s: drift %+.1f ppm over the last %.1f s", what, ppm, st.clock_s - dev->drift_clock_s);
+		dev->drift_clock_s = st.clock_s;
+		dev->drift_device_s = st.device_s;
+	}
+	if(st.xruns > *last_xruns) {
+		fine_log(WARN, "%s: %" PRIu64 " xruns so far, ~%" PRIu64 " frames lost", what, st.xruns, st.lost_frames);
+		*last_xruns = st.xruns;
+	}
+	fine_audio_dev_report(dev, what, DEBUG);
+	return st.drift_ppm;
+}
+
+int fine_thread_monitor(void *ptr) {
+	ASys *const sys = ptr;
+	uint64_t last_xruns[MAX_INPUTS+MAX_ZONES] = {0};
+	struct timespec const slice = {.tv_nsec = 100*1000000L}; //so it notices stopped quickly
+	for(size_t ms = 0; !atomic_load_explicit(&sys->stopped, memory_order_acquire); ms += 100) {
+		thrd_sleep(&slice, 0);
+		if(ms % MONITOR_MS) continue;
+		double in_ppm = 0;
+		DevStatus in_st[MAX_INPUTS], out_st;
+		for(size_t m = 0; m < sys->num_mics; ++m) {
+			double const ppm = monitor_sample(sys->mics[m].in, sys->mics[m].what, last_xruns+m, in_st+m);
+			if(!m) in_ppm = ppm;
+		}
+		for(size_t z = 0; z < sys->num_zones; ++z) {
+			Zone *const zone = sys->zones+z;
+			double const out_ppm = monitor_sample(zone->out, zone->what, last_xruns+MAX_INPUTS+z, &out_st);
+			//what a resampler between the two would have to correct
+			if(in_ppm && out_ppm) fine_log(DEBUG, "capture runs %+.1f ppm against %s", in_ppm - out_ppm, zone->what);
+			//the echo reference is what this zone plays
+			uint64_t const written = zone->out->echo ? fine_echo_ref_written(zone->out->echo) : 0;
+			if(!out_st.running || written < (uint64_t)out_st.delay) continue;
+			uint64_t const heard = written - out_st.delay;
+			for(size_t m = 0; m < sys->num_mics; ++m) {
+				AudioDev *const in = sys->mics[m].in;
+				if(in->aec && in_st[m].running) fine_aec_sync(in->aec, heard, in_st[m].frames + in_st[m].delay);
+			}
+		}
+	}
+	return 0;
+}
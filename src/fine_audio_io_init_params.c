@@ -5,141 +5,297 @@
 #include "fine_definitions.h"
 #include "fine_log.h"
 #include "fine_audio_io.h"
+#include "fine_convert.h"
 
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define REWIND_MARGIN 1024 //frames a rewind leaves in the buffer, the hardware may already be reading them
+/* --- END DEFINITIONS FOR TUNING --- */
 
+typedef struct AlsaDev AlsaDev;
+struct AlsaDev {
+	AudioDev dev; //first, so an AudioDev* is an AlsaDev*
+	snd_pcm_t *pcm;
+	snd_pcm_hw_params_t *params;
+	char const* what; //for the logs
+	bool tstamps; //status timestamps are on, so the clock drift can be measured
+	Convert *conv; //0 if the device takes SAMPLE_RATE S16 frames of dev.channels
+	void *raw; //device frames before or after conv
+	size_t raw_sz; //in frames
+};
 
-int fine_init_devices(char const*const out_name, char const*const in_name, 
-	 register snd_pcm_t **const pcm_out_addr, snd_pcm_t register **const pcm_in_addr,
-	 register snd_pcm_hw_params_t *const params_out, register snd_pcm_hw_params_t *const params_in) {
+//The first one the device takes is used, anything but S16 goes through fine_convert.h
+static struct {snd_pcm_format_t alsa; int fine;} const formats[] = {
+	{SND_PCM_FORMAT_S16_LE, FINE_FMT_S16},
+	{SND_PCM_FORMAT_S32_LE, FINE_FMT_S32},
+	{SND_PCM_FORMAT_S24_LE, FINE_FMT_S24},
+	{SND_PCM_FORMAT_S24_3LE, FINE_FMT_S24_3},
+	{SND_PCM_FORMAT_FLOAT_LE, FINE_FMT_FLOAT},
+};
 
-	size_t RATE_IN = 48000;
-	size_t RATE_OUT = 48000;
-	size_t PERIODS_IN  = 2;
-	size_t PERIODS_OUT  = 2;
-	size_t PERIOD_SIZE_IN = 8192;
-	size_t PERIOD_SIZE_OUT = 8192;
-	int ACCESS_IN = SND_PCM_ACCESS_RW_INTERLEAVED;
-	int ACCESS_OUT = SND_PCM_ACCESS_RW_INTERLEAVED;
-	int FORMAT_IN = SND_PCM_FORMAT_S16_LE;
-	int FORMAT_OUT = SND_PCM_FORMAT_S16_LE;
-
-
-	if(!(out_name && in_name && params_out && params_in && pcm_out_addr && pcm_in_addr)) 
-		fine_exit("Fine_init: One of the params are null");
-
-	//Open devices
-	if(snd_pcm_open(pcm_out_addr, out_name, SND_PCM_STREAM_PLAYBACK, 0) < 0) {
-		fine_log(WARN, "PCM device %s could not be opened for playback", out_name);
-		return -1;
-	}
-	if(snd_pcm_open(pcm_in_addr, in_name, SND_PCM_STREAM_CAPTURE, 0) < 0) {
+static double ts_diff(snd_htimestamp_t const a, snd_htimestamp_t const b) {
+	return (a.tv_sec - b.tv_sec) + (a.tv_nsec - b.tv_nsec)*1e-9;
+}
 
-		fine_log(WARN, "PCM device %s could not be opened for capture", in_name);
-		return -1;
-	}
-	fine_log(DEBUG, "devices opened");
+/* Asks for SAMPLE_RATE S16 frames of *channels and takes the closest the device has
+ * @return 0, -1 if the device can't be configured (logged). format, channels and rate are what it runs at
+ * */
+static int configure(snd_pcm_t *const pcm, snd_pcm_hw_params_t *const params, char const*const what,
+	int *const format, unsigned *const channels, unsigned *const rate) {
 
-	//register to avoid taking address
-	register snd_pcm_t *const pcm_out = *pcm_out_addr; 
-	register snd_pcm_t *const pcm_in = *pcm_in_addr;
+	size_t RATE = SAMPLE_RATE;
+	size_t PERIODS = 2;
+	size_t PERIOD_SIZE = 8192;
+	int ACCESS = SND_PCM_ACCESS_RW_INTERLEAVED;
 
 	//Begin hw config
-	if(snd_pcm_hw_params_any(pcm_out, params_out) < 0) {
-
-		fine_log(WARN, "Output device cannot be configured.");
-
-		return -1;
-	}
-	if(snd_pcm_hw_params_any(pcm_in, params_in) < 0) {
-		fine_log(WARN, "Input device cannot be configured.");
+	if(snd_pcm_hw_params_any(pcm, params) < 0) {
+		fine_log(WARN, "%s device cannot be configured.", what);
 		return -1;
 	}
 	fine_log(DEBUG, "starting config");
 
-	if(snd_pcm_hw_params_set_access(pcm_out, params_out, ACCESS_OUT) < 0) {
-		fine_log(WARN, "Error setting access: Output");
-		return -1;
-	}
-	if(snd_pcm_hw_params_set_access(pcm_in, params_in, ACCESS_IN) < 0) {
-		fine_log(WARN, "Error setting access: Input");
+	if(snd_pcm_hw_params_set_access(pcm, params, ACCESS) < 0) {
+		fine_log(WARN, "Error setting access: %s", what);
 		return -1;
 	}
 	fine_log(DEBUG, "set access success");
 
-	if(snd_pcm_hw_params_set_format(pcm_out, params_out, FORMAT_OUT) < 0) {
-		fine_log(WARN, "Error setting format: Output");
-		return -1;
-	}
-	if(snd_pcm_hw_params_set_format(pcm_in, params_in, FORMAT_IN) < 0) {
-		fine_log(WARN, "Error setting format: Input");
+	size_t f = 0;
+	while(f < sizeof formats/sizeof *formats && snd_pcm_hw_params_test_format(pcm, params, formats[f].alsa) < 0) ++f;
+	if(f == sizeof formats/sizeof *formats || snd_pcm_hw_params_set_format(pcm, params, formats[f].alsa) < 0) {
+		fine_log(WARN, "Error setting format: %s", what);
 		return -1;
 	}
+	*format = formats[f].fine;
 	fine_log(DEBUG, "set format success");
 
-	unsigned exact_rate_out = RATE_OUT;
-	unsigned exact_rate_in = RATE_IN;
-	if(snd_pcm_hw_params_set_rate_near(pcm_out, params_out, &exact_rate_out, 0)<0 ) {
-		fine_log(WARN, "Error setting sample rate: Output");
-		return -1;
-	}
-	if(snd_pcm_hw_params_set_rate_near(pcm_in, params_in, &exact_rate_in, 0)<0 ) {
-		fine_log(WARN, "Error setting sample rate: Input");
-		return -1;
-	}
-
-	if(exact_rate_out != RATE_OUT) {
-		fine_log(WARN, "Output: Rate of %u unsupported, using %u", RATE_OUT, exact_rate_out);
-		return -1;
-	}
-	if(exact_rate_in != RATE_IN) {
-		fine_log(WARN, "Input: Rate of %u unsupported, using %u", RATE_IN, exact_rate_in);
+	unsigned exact_rate = RATE;
+	if(snd_pcm_hw_params_set_rate_near(pcm, params, &exact_rate, 0)<0 ) {
+		fine_log(WARN, "Error setting sample rate: %s", what);
 		return -1;
 	}
+	if(exact_rate != RATE) fine_log(INFO, "%s: Rate of %zu unsupported, resampling from %u", what, RATE, exact_rate);
+	*rate = exact_rate;
 	fine_log(DEBUG, "set rate success");
 
-	if(snd_pcm_hw_params_set_channels(pcm_out, params_out, 1) < 0) {
-		fine_log(WARN, "Could not set channels to 1: Output");
-		return -1;
-	}
-	if(snd_pcm_hw_params_set_channels(pcm_in, params_in, 1) < 0) {
-		fine_log(WARN, "Could not set channels to 1: Input");
+	unsigned const CHANNELS = *channels;
+	if(snd_pcm_hw_params_set_channels_near(pcm, params, channels) < 0) {
+		fine_log(WARN, "Could not set channels: %s", what);
 		return -1;
 	}
+	if(*channels != CHANNELS) fine_log(INFO, "%s: %u channels unsupported, using %u", what, CHANNELS, *channels);
 	fine_log(DEBUG, "set channels success");
 
-	if(snd_pcm_hw_params_set_periods(pcm_out, params_out, PERIODS_OUT, 0) <0) {
-		fine_log(WARN, "Could not set periods: Output");
-		return -1;
-	}
-	if(snd_pcm_hw_params_set_periods(pcm_in, params_in, PERIODS_IN, 0) <0) {
-		fine_log(WARN, "Could not set periods: Input");
+	if(snd_pcm_hw_params_set_periods(pcm, params, PERIODS, 0) <0) {
+		fine_log(WARN, "Could not set periods: %s", what);
 		return -1;
 	}
 	fine_log(DEBUG, "set periods success");
 
 	//may fail, use near
-	snd_pcm_uframes_t const buf_sz_out = PERIODS_OUT*PERIOD_SIZE_OUT; 
-	snd_pcm_uframes_t const buf_sz_in = PERIODS_IN*PERIOD_SIZE_IN; 
-	if(snd_pcm_hw_params_set_buffer_size(pcm_out, params_out, buf_sz_out ) < 0) {
-		fine_log(WARN, "Could not set buffer size to %d: Output", buf_sz_out);
+	snd_pcm_uframes_t const buf_sz = PERIODS*PERIOD_SIZE;
+	if(snd_pcm_hw_params_set_buffer_size(pcm, params, buf_sz) < 0) {
+		fine_log(WARN, "Could not set buffer size to %lu: %s", buf_sz, what);
 		return -1;
 	}
+	fine_log(DEBUG, "set buffers success");
 
-	if(snd_pcm_hw_params_set_buffer_size(pcm_in, params_in, buf_sz_in ) < 0) {
-		fine_log(WARN, "Could not set buffer size to %d: Input", buf_sz_in);
+	if (snd_pcm_hw_params(pcm, params) < 0) {
+		fine_log(WARN, "Failed to apply hardware parameters: %s", what);
 		return -1;
 	}
+	return 0;
+}
 
-	fine_log(DEBUG, "set buffers success");
-	if (snd_pcm_hw_params(pcm_out, params_out) < 0) {
-		fine_log(WARN, "Failed to apply hardware parameters: Output");
-		return -1;
+//Timestamps with the system clock, in the clock of CLOCK_MONOTONIC. Without them only the drift is missing.
+static bool enable_tstamps(snd_pcm_t *const pcm, char const*const what) {
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_sw_params_alloca(&sw);
+	if(snd_pcm_sw_params_current(pcm, sw) < 0
+		|| snd_pcm_sw_params_set_tstamp_mode(pcm, sw, SND_PCM_TSTAMP_ENABLE) < 0
+		|| snd_pcm_sw_params_set_tstamp_type(pcm, sw, SND_PCM_TSTAMP_TYPE_MONOTONIC) < 0
+		|| snd_pcm_sw_params(pcm, sw) < 0) {
+		fine_log(WARN, "%s: no status timestamps, clock drift is not measured", what);
+		return 0;
 	}
-	if (snd_pcm_hw_params(pcm_in, params_in) < 0) {
-		fine_log(WARN, "Failed to apply hardware parameters: Input");
-		return -1;
+	return 1;
+}
+
+//The xrun stopped the stream at the trigger timestamp, everything since is lost, for capture also the full buffer
+static void count_xrun(AlsaDev *const a) {
+	atomic_fetch_add_explicit(&a->dev.xruns, 1, memory_order_relaxed);
+	snd_pcm_status_t *status;
+	snd_pcm_status_alloca(&status);
+	if(!a->tstamps || snd_pcm_status(a->pcm, status) < 0 || snd_pcm_status_get_state(status) != SND_PCM_STATE_XRUN) return;
+	snd_htimestamp_t now, stopped;
+	snd_pcm_status_get_htstamp(status, &now);
+	snd_pcm_status_get_trigger_htstamp(status, &stopped);
+	double const gap = ts_diff(now, stopped);
+	size_t const avail = a->dev.read ? snd_pcm_status_get_avail(status) : 0;
+	uint64_t const lost = (gap > 0 ? gap*SAMPLE_RATE : 0) + (a->conv ? fine_convert_to_engine(a->conv, avail) : avail);
+	atomic_fetch_add_explicit(&a->dev.lost_frames, lost, memory_order_relaxed);
+}
+
+static void recover(AlsaDev *const a, snd_pcm_sframes_t const err, size_t const n) {
+	switch(err) {
+		case -EPIPE:
+			fine_log(ERROR, "BUFFER %s %s %zu frames", a->dev.write ? "UNDERRUN playing" : "OVERRUN recording", n);
+			count_xrun(a);
+			break;
+		case -EBADFD:
+			fine_log(ERROR, "%s PCM not in the right state", a->what);
+			break;
+		case -ESTRPIPE:
+			fine_log(ERROR, "%s: A suspend event occured", a->what);
+			break;
+	}
+	snd_pcm_prepare(a->pcm);
+}
+
+static size_t readi(AlsaDev *const a, void *const data, size_t const n) {
+	snd_pcm_sframes_t wasread;
+	while((wasread = snd_pcm_readi(a->pcm, data, n)) < 0) recover(a, wasread, n);
+	return wasread;
+}
+
+static size_t writei(AlsaDev *const a, void const*const data, size_t const n) {
+	snd_pcm_sframes_t written;
+	while((written = snd_pcm_writei(a->pcm, data, n)) < 0) recover(a, written, n);
+	return written;
+}
+
+//@return a->raw with room for n device frames
+static void *raw_frames(AlsaDev *const a, size_t const n) {
+	if(n > a->raw_sz) {
+		void *const raw = realloc(a->raw, n*fine_convert_frame_bytes(a->conv));
+		if(!raw) fine_exit("Could not allocate %s conversion buffer", a->what);
+		a->raw = raw;
+		a->raw_sz = n;
+	}
+	return a->raw;
+}
+
+//With conversion as many device frames are read as make n frames
+static size_t alsa_read(AudioDev *const dev, i16 *const data, size_t const n) {
+	AlsaDev *const a = (AlsaDev *)dev;
+	if(!a->conv) return readi(a, data, n);
+	size_t const need = fine_convert_need(a->conv, n);
+	char *const raw = raw_frames(a, need);
+	size_t got = 0;
+	while(got < need) got += readi(a, raw + got*fine_convert_frame_bytes(a->conv), need - got);
+	return fine_convert_in(a->conv, data, n, raw, got);
+}
+
+static size_t alsa_write(AudioDev *const dev, i16 const*const data, size_t const n) {
+	AlsaDev *const a = (AlsaDev *)dev;
+	if(!a->conv) return writei(a, data, n);
+	char *const raw = raw_frames(a, fine_convert_max_out(a->conv, n));
+	size_t const m = fine_convert_out(a->conv, raw, data, n);
+	size_t written = 0;
+	while(written < m) written += writei(a, raw + written*fine_convert_frame_bytes(a->conv), m - written);
+	return n;
+}
+
+static void alsa_start(AudioDev *const dev) { snd_pcm_prepare(((AlsaDev *)dev)->pcm); }
+static void alsa_stop(AudioDev *const dev) { snd_pcm_drop(((AlsaDev *)dev)->pcm); }
+static void alsa_drain(AudioDev *const dev) { snd_pcm_drain(((AlsaDev *)dev)->pcm); }
+
+static size_t alsa_rewind(AudioDev *const dev, size_t const max) {
+	AlsaDev *const a = (AlsaDev *)dev;
+	snd_pcm_sframes_t n = snd_pcm_rewindable(a->pcm) - REWIND_MARGIN;
+	if(n <= 0) return 0;
+	if((size_t)n > max) n = max;
+	n = snd_pcm_rewind(a->pcm, n);
+	if(n <= 0) return 0;
+	atomic_fetch_sub_explicit(&dev->frames, n, memory_order_relaxed);
+	return n;
+}
+
+static int alsa_status(AudioDev *const dev, DevStatus *const st) {
+	AlsaDev *const a = (AlsaDev *)dev;
+	snd_pcm_status_t *status;
+	snd_pcm_status_alloca(&status);
+	if(snd_pcm_status(a->pcm, status) < 0) return -1;
+	st->running = snd_pcm_status_get_state(status) == SND_PCM_STATE_RUNNING;
+	st->delay = snd_pcm_status_get_delay(status);
+	st->avail = snd_pcm_status_get_avail(status);
+	if(a->conv) {
+		st->delay = fine_convert_to_engine(a->conv, st->delay);
+		st->avail = fine_convert_to_engine(a->conv, st->avail);
+	}
+	if(!a->tstamps || !st->running) return 0;
+
+	//The audio timestamp is the hardware position since the trigger, in time of the device clock, the status
+	//timestamp when it was read. The position is only as fine as the pointer of the driver, a whole period on some,
+	//so the drift over t seconds can be off by period/t: over a long run it still settles, over an interval less so.
+	snd_htimestamp_t now, trigger, audio;
+	snd_pcm_status_get_htstamp(status, &now);
+	snd_pcm_status_get_trigger_htstamp(status, &trigger);
+	snd_pcm_status_get_audio_htstamp(status, &audio);
+	double const elapsed = ts_diff(now, trigger);
+	double const device = audio.tv_sec + audio.tv_nsec*1e-9;
+	if(elapsed > 1 && device > 0) {
+		st->drift_ppm = (device/elapsed - 1)*1e6;
+		st->clock_s = elapsed;
+		st->device_s = device;
 	}
-	fine_log(INFO, "devices are ready");
 	return 0;
 }
 
+static void alsa_close(AudioDev *const dev) {
+	AlsaDev *const a = (AlsaDev *)dev;
+	if(a->pcm) snd_pcm_close(a->pcm);
+	if(a->params) snd_pcm_hw_params_free(a->params);
+	fine_convert_destroy(a->conv);
+	free(a->raw);
+	free(a);
+}
+
+AudioDev *fine_audio_dev_open_alsa(char const*const name, int const dir, unsigned const channels) {
+	AlsaDev *const a = calloc(1, sizeof *a);
+	if(!a) fine_exit("Could not allocate ALSA device");
+	a->what = dir == FINE_CAPTURE ? "Input" : "Output";
+	a->dev = (AudioDev){
+		.kind = "alsa",
+		.channels = channels,
+		.clocked = 1,
+		.read = dir == FINE_CAPTURE ? alsa_read : 0,
+		.write = dir == FINE_PLAYBACK ? alsa_write : 0,
+		.start = alsa_start,
+		.stop = alsa_stop,
+		.drain = dir == FINE_PLAYBACK ? alsa_drain : 0,
+		.rewind = dir == FINE_PLAYBACK ? alsa_rewind : 0,
+		.close = alsa_close,
+		.status = alsa_status,
+	};
+
+	//Open devices
+	if(snd_pcm_open(&a->pcm, name, dir == FINE_CAPTURE ? SND_PCM_STREAM_CAPTURE : SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+		fine_log(WARN, "PCM device %s could not be opened for %s", name, dir == FINE_CAPTURE ? "capture" : "playback");
+		a->pcm = 0;
+		alsa_close(&a->dev);
+		return 0;
+	}
+	fine_log(DEBUG, "device %s opened", name);
+
+	int format;
+	unsigned dev_channels = channels, rate;
+	if(snd_pcm_hw_params_malloc(&a->params) < 0 || configure(a->pcm, a->params, a->what, &format, &dev_channels, &rate) < 0) {
+		alsa_close(&a->dev);
+		return 0;
+	}
+	a->conv = fine_convert_create(format, dev_channels, rate, dir, channels);
+	//rewound device frames don't map back to what the resampler was fed
+	if(a->conv && fine_convert_resamples(a->conv)) a->dev.rewind = 0;
+
+	snd_pcm_uframes_t period = 0;
+	if(snd_pcm_hw_params_get_period_size(a->params, &period, 0)<0) {
+		fine_log(WARN, "%s period size cannot be read", a->what);
+		alsa_close(&a->dev);
+		return 0;
+	}
+	a->dev.period = a->conv ? fine_convert_to_engine(a->conv, period) : period;
+	a->tstamps = enable_tstamps(a->pcm, a->what);
+	fine_log(INFO, "%s device %s is ready", a->what, name);
+	return &a->dev;
+}
@@ -1,89 +1,301 @@
 #include "fine_definitions.h" 
+#include "fine_aec.h"
 #include "fine_log.h"
+#include "fine_prof.h"
 #include "fine_audio_io.h"
-#include "fine_fx_reverb.h"
+#include "fine_render.h"
+#include "fine_select.h"
+#include "fine_vad.h"
+#include "fine_rand.h"
 #include "p99/p99.h"
-#include <alsa/asoundlib.h>
 #include <limits.h>
 #include <threads.h>
 #include <string.h>
-#include <time.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
 
 
-fine_reverb_model my_reverb;
+/* FINE_THRESHOLDS: upper/lower envelope thresholds of the inputs, in their order, like "500/80,900/150".
+ * An input without them, or without the lower one, keeps the default
+ * */
+static void thresholds_from_env(Mic *const mics, size_t const num_mics) {
+	/* --- BEGIN DEFINITIONS FOR TUNING --- */
+	int const THRESH_UPPER = 500;
+	int const THRESH_LOWER = 80;
+	/* --- END DEFINITIONS FOR TUNING --- */
+
+	for(size_t m = 0; m < num_mics; ++m) {
+		mics[m].thresh_upper = THRESH_UPPER;
+		mics[m].thresh_lower = THRESH_LOWER;
+	}
+	char const*const env = getenv("FINE_THRESHOLDS");
+	if(!env || !*env) return;
+	char const* pos = env;
+	for(size_t m = 0; m < num_mics && *pos; ++m) {
+		char *end;
+		long const upper = strtol(pos, &end, 10);
+		long lower = mics[m].thresh_lower;
+		if(end != pos && *end == '/') lower = strtol(end+1, &end, 10);
+		if(end == pos || (*end && *end != ',') || upper <= 0 || lower < 0 || lower > upper) {
+			fine_log(WARN, "FINE_THRESHOLDS=%s is not a list of upper/lower thresholds, using %d/%d", env, THRESH_UPPER, THRESH_LOWER);
+			return;
+		}
+		mics[m].thresh_upper = upper;
+		mics[m].thresh_lower = lower;
+		pos = *end ? end+1 : end;
+	}
+	for(size_t m = 0; m < num_mics; ++m)
+		fine_log(INFO, "%s thresholds: %d/%d", mics[m].what, mics[m].thresh_upper, mics[m].thresh_lower);
+}
 
-void fine_thread_init_everything(ASys *const res, snd_pcm_hw_params_t *const hw_out, snd_pcm_hw_params_t *const hw_in, snd_pcm_t *const pcm_out, snd_pcm_t *const pcm_in) {
+/* @return the slot for the next recording of an input, one that no other input has claimed.
+ * store_lock must be held
+ * */
+static size_t claim_slot(ASys *const sys) {
+	for(;;) {
+		size_t const slot = atomic_fetch_add_explicit(&sys->rec_next, 1, memory_order_relaxed) % MAX_NUM_REC;
+		bool taken = 0;
+		for(size_t m = 0; m < sys->num_mics; ++m) taken |= atomic_load_explicit(&sys->mics[m].slot, memory_order_relaxed) == slot;
+		if(!taken) return slot;
+	}
+}
+
+//Every input claims a slot after the file_num loaded ones. store_lock must be write locked or the threads not started
+static void claim_all(ASys *const sys, size_t const file_num) {
+	atomic_store_explicit(&sys->rec_next, file_num, memory_order_relaxed);
+	for(size_t m = 0; m < sys->num_mics; ++m) atomic_store_explicit(&sys->mics[m].slot, MAX_NUM_REC, memory_order_relaxed);
+	for(size_t m = 0; m < sys->num_mics; ++m) {
+		size_t const slot = claim_slot(sys);
+		atomic_store_explicit(&sys->mics[m].slot, slot, memory_order_relaxed);
+		fine_select_remove(sys->selector, slot);
+	}
+}
+
+/* FINE_AEC_MS: the inputs cancel the echo of the first zone. Only a device with a clock can line the two up,
+ * files and null devices play and record as fast as they can
+ * */
+static void echo_from_env(ASys *const sys) {
+	size_t const ms = fine_aec_ms_from_env();
+	AudioDev *const out = sys->zones[0].out;
+	if(!ms) return;
+	if(!out->clocked || !out->status) {
+		fine_log(DEBUG, "no echo cancellation, %s has no clock", sys->zones[0].what);
+		return;
+	}
+	sys->echo = fine_echo_ref_create();
+	out->echo = sys->echo;
+	for(size_t m = 0; m < sys->num_mics; ++m) {
+		AudioDev *const in = sys->mics[m].in;
+		if(in->clocked && in->status) in->aec = fine_aec_create(sys->echo, ms);
+	}
+	fine_log(INFO, "cancelling %zu ms of echo of %s", ms, sys->zones[0].what);
+}
+
+void fine_thread_init_everything(ASys *const res, AudioDev *const*const outs, size_t const num_zones,
+	AudioDev *const*const ins, size_t const num_mics) {
+	assert(num_zones >= 1 && num_zones <= MAX_ZONES);
+	assert(num_mics >= 1 && num_mics <= MAX_INPUTS);
 	fine_log(INFO, "Recordings will take around %zu MB of RAM", sizeof(Recording) * MAX_NUM_REC/1000000);
 	if(sizeof(Recording) * MAX_NUM_REC/1000000 >= 256) fine_log(WARN, "Recordings using too much memory");
 
 	int toset = 0;
 	ASys sys = {
-		.idle_buf_idx = 0,
-		.idle_buf = calloc(IDLE_BUFSZ, sizeof(i16)),
 		.rec_csz=0,
 		.rec_idx=0,
-		.play = 0,
 		.rec_arr=calloc(MAX_NUM_REC, sizeof(Recording)),
+		.selector=fine_select_create(MAX_NUM_REC),
 		.fade_out=0,
-		.hw_out = hw_out,
-		.hw_in=hw_in,
-		.pcm_out=pcm_out,
-		.pcm_in=pcm_in,
+		.zones = calloc(num_zones, sizeof(Zone)),
+		.num_zones = num_zones,
+		.base_seed = fine_rand_seed_from_env(),
+		.mics = calloc(num_mics, sizeof(Mic)),
+		.num_mics = num_mics,
+		.mics_running = num_mics,
+		.last_publisher = 0,
+		.echo = 0,
+		.published_tail = 0,
+		.published_head = 0,
+		.reload=0,
+		.num_recordings=0,
+		.num_collages=0,
 		.stopped=0
 	};
 
+	if(!sys.rec_arr || !sys.zones || !sys.mics) fine_exit("Could not allocate the recordings");
 	memcpy(res, &sys, sizeof(ASys));
 	//NOTE: sys is dead now, do not reference it
+
+	for(size_t z = 0; z < num_zones; ++z) {
+		Zone *const zone = res->zones+z;
+		zone->sys = res;
+		zone->idx = z;
+		zone->out = outs[z];
+		if(z) snprintf(zone->what, sizeof zone->what, "output%zu", z);
+		else snprintf(zone->what, sizeof zone->what, "output");
+	}
+	for(size_t m = 0; m < num_mics; ++m) {
+		Mic *const mic = res->mics+m;
+		mic->sys = res;
+		mic->idx = m;
+		mic->in = ins[m];
+		mic->idle_buf = calloc(IDLE_BUFSZ, sizeof(i16));
+		if(!mic->idle_buf) fine_exit("Could not allocate the recordings");
+		if(m) snprintf(mic->what, sizeof mic->what, "input%zu", m);
+		else snprintf(mic->what, sizeof mic->what, "input");
+	}
+	thresholds_from_env(res->mics, num_mics);
+	if(fine_vad_from_env()) {
+		for(size_t m = 0; m < num_mics; ++m) res->mics[m].vad = fine_vad_create();
+		fine_log(INFO, "the inputs trigger on the spectral activity detector");
+	}
+	echo_from_env(res);
+	for(size_t i = 0; i < PUBLISH_QUEUE; ++i) atomic_store_explicit(&res->published[i].seq, i, memory_order_relaxed);
 	
 	//set mtx, playback, updaterecordings, nextrecaddr
 	mtx_init(&(res->playback_mtx), mtx_plain);
 	cnd_init(&(res->playback));
 
 	mtx_init(&(res->fread_mtx), mtx_plain);
+	pthread_rwlock_init(&res->store_lock, 0);
 
 	cnd_init(&(res->fread));
 
-	reverb_init(&my_reverb);
 	//PRELOAD MY RECORDINGS HERE:
-	
-	//16 LE
-	FILE *curfile;
-	size_t file_num = 0;
-	while(file_num < MAX_NUM_REC){
-		char fname[32] = {0};
-		sprintf(fname, "data/%zu.raw", file_num);
-		curfile = fopen(fname, "rb");
-		if(!curfile) break;
-
-		fseek(curfile, 0, SEEK_END);
-		long const num_samples = ftell(curfile)/sizeof(i16);
-		if(ftell(curfile)%sizeof(i16))
-			fine_log(WARN, "Flie %zu is not divisible into 16 bit segments. Ignoring tail.", file_num);
-
-		rewind(curfile);
+	size_t const file_num = fine_render_load_recordings(res->rec_arr, res->selector, "data");
+	res->rec_idx = file_num % MAX_NUM_REC;
+	res->rec_csz = file_num;
+	//the first one at rec_idx
+	claim_all(res, file_num);
 
-		
-		res->rec_arr[res->rec_idx].sz = fread(
-			res->rec_arr[res->rec_idx].data, sizeof(i16), P99_MINOF(num_samples, RECORDING_SIZE), curfile
-		);
-		fclose(curfile);
+	fine_log(INFO, "loaded %zu files into memory", file_num);
+}
 
+void fine_thread_free_everything(ASys *const sys) {
+	mtx_destroy(&sys->playback_mtx);
+	mtx_destroy(&sys->fread_mtx);
+	pthread_rwlock_destroy(&sys->store_lock);
+	cnd_destroy(&sys->playback);
+	cnd_destroy(&sys->fread);
+	fine_select_destroy(sys->selector);
+	free(sys->rec_arr);
+	for(size_t m = 0; m < sys->num_mics; ++m) {
+		free(sys->mics[m].idle_buf);
+		fine_vad_destroy(sys->mics[m].vad);
+		fine_aec_destroy(sys->mics[m].in->aec);
+		sys->mics[m].in->aec = 0;
+	}
+	sys->zones[0].out->echo = 0;
+	fine_echo_ref_destroy(sys->echo);
+	free(sys->mics);
+	free(sys->zones);
+}
 
-		++file_num;
-		res->rec_idx = file_num;
-		res->rec_csz = file_num;
+/* Queues the recording in the slot of mic for the selector and claims the next slot, without a lock.
+ * store_lock must be read locked.
+ * @return -1 if the queue is full: the recording is dropped and its slot used again
+ * */
+static int publish(ASys *const sys, Mic *const mic, float const loudness) {
+	size_t pos = atomic_load_explicit(&sys->published_tail, memory_order_relaxed);
+	for(;;) {
+		Published *const cell = sys->published + pos%PUBLISH_QUEUE;
+		size_t const seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		if(seq == pos) {
+			if(atomic_compare_exchange_weak_explicit(&sys->published_tail, &pos, pos+1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		//the cell still holds the recording from PUBLISH_QUEUE before
+		else if(seq < pos) return -1;
+		else pos = atomic_load_explicit(&sys->published_tail, memory_order_relaxed);
 	}
+	Published *const cell = sys->published + pos%PUBLISH_QUEUE;
+	cell->slot = atomic_load_explicit(&mic->slot, memory_order_relaxed);
+	cell->loudness = loudness;
+	cell->claimed = claim_slot(sys);
+	cell->ns = fine_prof_now();
+	atomic_store_explicit(&mic->slot, cell->claimed, memory_order_relaxed);
+	atomic_store_explicit(&cell->seq, pos+1, memory_order_release);
+	return 0;
+}
 
-	fine_log(INFO, "loaded %zu files into memory", file_num);
+void fine_thread_apply_published(ASys *const sys) {
+	for(;;) {
+		size_t const pos = sys->published_head;
+		Published *const cell = sys->published + pos%PUBLISH_QUEUE;
+		if(atomic_load_explicit(&cell->seq, memory_order_acquire) != pos+1) return;
+		fine_select_publish(sys->selector, cell->slot, cell->loudness);
+		fine_select_remove(sys->selector, cell->claimed); //about to be overwritten
+		sys->rec_idx = (cell->slot + 1) % MAX_NUM_REC;
+		sys->rec_csz = P99_MINOF(sys->rec_csz+1, MAX_NUM_REC);
+		//the next collage of every zone is the first that can answer it
+		for(size_t z = 0; z < sys->num_zones; ++z) sys->zones[z].published_ns = cell->ns;
+		sys->published_head = pos+1;
+		atomic_store_explicit(&cell->seq, pos+PUBLISH_QUEUE, memory_order_release);
+	}
+}
+
+void fine_thread_play(ASys *const sys, bool const play) {
+	for(size_t z = 0; z < sys->num_zones; ++z) atomic_store_explicit(&sys->zones[z].play, play, memory_order_release);
+	if(play) cnd_broadcast(&sys->playback);
+}
+
+void fine_thread_stop_everything(ASys *const sys, bool const now) {
+	mtx_lock(&sys->playback_mtx);
+	if(now) {
+		fine_thread_play(sys, 0);
+		atomic_store_explicit(&sys->fade_out, 1, memory_order_release);
+	}
+	atomic_store_explicit(&sys->stopped, 1, memory_order_release);
+	cnd_broadcast(&sys->playback);
+	mtx_unlock(&sys->playback_mtx);
 }
 
-size_t fine_input_write_until(i16 * const data, size_t const sz, snd_pcm_t *const pcm_in, snd_pcm_hw_params_t *const hw_in, float const alpha, i16 const THRESH_LOWER) {
+/* Replaces the whole store with the files in the data dir. Only an input thread may call it, while it doesn't record.
+ * The files are read into a scratch store first, so the zones go on playing meanwhile. Only copying them over keeps
+ * the output threads and the other inputs out with store_lock, they must not render from or record into a slot
+ * while it is overwritten.
+ * */
+static void reload_everything(ASys *const sys) {
+	//untouched pages of it are never allocated
+	Recording *const scratch = calloc(MAX_NUM_REC, sizeof *scratch);
+	if(!scratch) fine_exit("Could not allocate the recordings");
+	Selector *const selector = fine_select_create(MAX_NUM_REC);
+	size_t const file_num = fine_render_load_recordings(scratch, selector, "data");
+
+	pthread_rwlock_wrlock(&sys->store_lock);
+	mtx_lock(&sys->playback_mtx);
+	//what is still queued is about the old recordings
+	fine_thread_apply_published(sys);
+	Selector *const old = sys->selector;
+	sys->selector = selector;
+	for(size_t i = 0; i < MAX_NUM_REC; ++i) {
+		Recording *const rec = sys->rec_arr+i;
+		//cached clips of the old recordings must not be reused, odd until the files are in
+		atomic_fetch_add_explicit(&rec->gen, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		if(i < file_num) {
+			rec->sz = scratch[i].sz;
+			memcpy(rec->data, scratch[i].data, rec->sz*sizeof *rec->data);
+		}
+		rec->mic = 0;
+		atomic_fetch_add_explicit(&rec->gen, 1, memory_order_release);
+	}
+	sys->rec_idx = file_num % MAX_NUM_REC;
+	sys->rec_csz = file_num;
+	claim_all(sys, file_num);
+	mtx_unlock(&sys->playback_mtx);
+	pthread_rwlock_unlock(&sys->store_lock);
+	fine_select_destroy(old);
+	free(scratch);
+	fine_log(INFO, "reloaded %zu files into memory", file_num);
+}
+
+//vad: ends it instead of the envelope if set
+size_t fine_input_write_until(i16 * const data, size_t const sz, AudioDev *const in, float const alpha, i16 const THRESH_LOWER, Vad *const vad) {
 	
-	snd_pcm_sframes_t left = sz;
-	snd_pcm_uframes_t tmp_uframe = 0; 
-	if(snd_pcm_hw_params_get_period_size(hw_in, &tmp_uframe, 0)<0) 
-		fine_exit("Input period size cannot be read");
-	snd_pcm_uframes_t const per_read = tmp_uframe;
+	size_t left = sz;
+	size_t const per_read = in->period;
 
 	assert(per_read < INT_MAX/INT16_MAX);
 
@@ -91,26 +303,11 @@ size_t fine_input_write_until(i16 * const data, size_t const sz, snd_pcm_t *cons
 	while(left > 0) {
 
 		fine_log(DEBUG, "ema lower: %f", ema);
-		snd_pcm_sframes_t const toread = left < per_read? left : per_read;
-		snd_pcm_sframes_t wasread; 
-		while((wasread = snd_pcm_readi(pcm_in, data+(sz-left), toread)) < 0) {
-			switch(wasread) {
-				case -EPIPE:
-					fine_log(ERROR, "BUFFER OVERRUN recording %zu frames", toread);
-					break;
-				case -EBADFD:
-					fine_log(ERROR, "output PCM not in the right state");
-					break;
-
-				case -ESTRPIPE:
-					fine_log(ERROR, "output: A suspend event occured");
-					break;
-				default:
-					//fine_log(ERROR, "Error %d", wasread);
-					break;
-			}
-			snd_pcm_prepare(pcm_in); 
-		}
+		size_t const toread = left < per_read? left : per_read;
+		uint64_t t = fine_prof_now();
+		size_t const wasread = fine_audio_dev_read(in, data+(sz-left), toread);
+		t = fine_prof_end(FINE_STAGE_CAPTURE, t);
+		if(in->eof) return sz-left;
 		if(!wasread) continue;
 		if(wasread < toread)
 			fine_log(WARN, "expected to read %zu frames, actually read %zu frames", toread, wasread);
@@ -121,8 +318,10 @@ size_t fine_input_write_until(i16 * const data, size_t const sz, snd_pcm_t *cons
 		}
 
 		ema = alpha * ((float)sum / wasread) + ema * (1-alpha);
+		bool const active = vad ? fine_vad_process(vad, data+(sz-left), wasread) : ema >= THRESH_LOWER;
+		fine_prof_end(FINE_STAGE_ENVELOPE, t);
 
-		if(ema < THRESH_LOWER) {
+		if(!active) {
 			fine_log(DEBUG, "RETURNED EARLY!: wrote %zu samples", sz-left);
 			return sz-left;
 		}
@@ -136,12 +335,12 @@ size_t fine_input_write_until(i16 * const data, size_t const sz, snd_pcm_t *cons
 }
 //TODO: xrun fix
 int fine_thread_input_idle(void *ptr) {
-	ASys *const sys = ptr;
-	snd_pcm_prepare(sys->pcm_in);
-	snd_pcm_uframes_t period_sz = 0;
-	if(snd_pcm_hw_params_get_period_size(sys->hw_in, &period_sz, 0)<0)
-		fine_exit("Could not get input period size");
-	size_t const num_in_samples = period_sz; //NOTE: Here one frame is one sample, b/c single channel
+	Mic *const mic = ptr;
+	ASys *const sys = mic->sys;
+	AudioDev *const in = mic->in;
+	fine_prof_thread(mic->what);
+	in->start(in);
+	size_t const num_in_samples = in->period; //NOTE: Here one frame is one sample, b/c single channel
 
 	size_t const bufsz = IDLE_BUFSZ;
 	assert(num_in_samples <= bufsz);
@@ -149,8 +348,8 @@ int fine_thread_input_idle(void *ptr) {
 	/* --- BEGIN DEFINITIONS FOR TUNING --- */
 	float const alpha_upper = 0.3; 
 	float const alpha_lower = 0.6; 
-	int const THRESH_UPPER = 500; 
-	int const THRESH_LOWER = 80;
+	size_t const min_pre_roll = SAMPLE_RATE/4; //with echo cancellation
+	float const min_erle = 20; //dB the echo canceller must remove before the lockout gets shorter
 	/* --- END DEFINITIONS FOR TUNING --- */
 
 	i16 *tmp_buf = calloc(num_in_samples, sizeof(*tmp_buf));
@@ -158,21 +357,24 @@ int fine_thread_input_idle(void *ptr) {
 	float ema_upper = 0;
 	// --- WARM-UP READ ---
 	// Read and discard the first buffer
-	fine_input_write_buf(tmp_buf, num_in_samples, sys->pcm_in, sys->hw_in);
+	fine_input_write_buf(tmp_buf, num_in_samples, in);
 	// --- END WARM-UP ---	
 	bool recording = 0;
-	struct timespec last_recording = {0};
-	clock_gettime(CLOCK_MONOTONIC_COARSE, &last_recording);
+	//Time is counted in captured samples, not on the clock, so file input can run faster than real time
+	size_t samples_since_recording = 0;
 	while(!atomic_load_explicit(&sys->stopped, memory_order_acquire)) {
 
-		fine_log(DEBUG, "ema upper: %f", ema_upper);
-		size_t const bufidx = sys->idle_buf_idx;
-		sys->idle_buf_idx = (sys->idle_buf_idx + num_in_samples)%bufsz;
-		i16 *const idle_buf = sys->idle_buf;
+		fine_log(DEBUG, "%s ema upper: %f", mic->what, ema_upper);
+		size_t const bufidx = mic->idle_buf_idx;
+		mic->idle_buf_idx = (mic->idle_buf_idx + num_in_samples)%bufsz;
+		i16 *const idle_buf = mic->idle_buf;
 
 		
-		fine_input_write_buf(tmp_buf, num_in_samples, sys->pcm_in, sys->hw_in);
+		if(fine_input_write_buf(tmp_buf, num_in_samples, in) < 0) break;
+		samples_since_recording += num_in_samples;
+		if(atomic_exchange_explicit(&sys->reload, 0, memory_order_acquire)) reload_everything(sys);
 
+		uint64_t t = fine_prof_now();
 		int sum = 0;
 		assert(num_in_samples < INT_MAX/INT16_MAX);
 		for(size_t i = 0; i < num_in_samples; ++i) {
@@ -181,56 +383,88 @@ int fine_thread_input_idle(void *ptr) {
 		}
 
                 ema_upper = alpha_upper * ((float)sum / num_in_samples) + ema_upper * (1-alpha_upper);
+		bool const active = mic->vad ? fine_vad_process(mic->vad, tmp_buf, num_in_samples) : ema_upper >= mic->thresh_upper;
+		t = fine_prof_end(FINE_STAGE_ENVELOPE, t);
 		// fine_log(DEBUG,"EMA: %f", ema_upper);
 
-		struct timespec now = {0};
-
-		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
-
-		int const seconds_since_approx = now.tv_sec-last_recording.tv_sec;
-
-		if(seconds_since_approx > IDLE_BUFSZ/SAMPLE_RATE) {
-			atomic_store_explicit(&sys->play, 0, memory_order_release); //1 seconds chance to play after recording
+		//only the input that published last, the others would cut its chance short
+		if(samples_since_recording > IDLE_BUFSZ && atomic_load_explicit(&sys->last_publisher, memory_order_relaxed) == mic->idx) {
+			fine_thread_play(sys, 0); //1 seconds chance to play after recording
 		}
 		
-		if(ema_upper >= THRESH_UPPER && seconds_since_approx > IDLE_BUFSZ/SAMPLE_RATE) { //record until lower thresh is reached
+		//Samples after a recording before the next trigger. Without echo cancellation the collage it starts would
+		//trigger the input again, once the canceller has converged only a pre-roll is needed
+		bool const cancelled = in->aec && fine_aec_erle(in->aec) > min_erle;
+		size_t const lockout = cancelled ? P99_MAXOF(min_pre_roll, num_in_samples) : IDLE_BUFSZ;
+		if(active && samples_since_recording > lockout) { //record until lower thresh is reached
 			
-			atomic_store_explicit(&sys->play, 0, memory_order_release);
-			//signal output thread to fade out.
+			fine_thread_play(sys, 0);
+			//signal the output threads to fade out.
 			atomic_store_explicit(&sys->fade_out, 1, memory_order_release);
-			//Why not lock here? we make a rule where nobody can access the very last place recording.
-			//This is for much better performance
-			for(size_t i = 0; i < IDLE_BUFSZ; ++i) {
-				sys->rec_arr[sys->rec_idx].data[i] = sys->idle_buf[(sys->idle_buf_idx+i)%IDLE_BUFSZ];
+			//Why not lock here? we make a rule where nobody can access the slot an input claimed.
+			//This is for much better performance. The read lock only keeps a reload out until it is published
+			pthread_rwlock_rdlock(&sys->store_lock);
+			Recording *const rec = sys->rec_arr + atomic_load_explicit(&mic->slot, memory_order_relaxed);
+			//Odd while it is written, so cached clips of the old recording are never reused and a copy made meanwhile is dropped
+			atomic_fetch_add_explicit(&rec->gen, 1, memory_order_relaxed);
+			atomic_thread_fence(memory_order_release);
+			rec->mic = mic->idx;
+			//what was captured since the last recording, the device was restarted after it
+			size_t const pre_roll = P99_MINOF(samples_since_recording, IDLE_BUFSZ);
+			for(size_t i = 0; i < pre_roll; ++i) {
+				rec->data[i] = idle_buf[(mic->idle_buf_idx+IDLE_BUFSZ-pre_roll+i)%IDLE_BUFSZ];
 			}
-			sys->rec_arr[sys->rec_idx].sz = IDLE_BUFSZ + fine_input_write_until(
-				sys->rec_arr[sys->rec_idx].data+IDLE_BUFSZ,
-				RECORDING_SIZE-IDLE_BUFSZ,
-				sys->pcm_in, sys->hw_in, alpha_lower, THRESH_LOWER
+			t = fine_prof_end(FINE_STAGE_TRIGGER, t);
+			rec->sz = pre_roll + fine_input_write_until(
+				rec->data+pre_roll,
+				RECORDING_SIZE-pre_roll,
+				in, alpha_lower, mic->thresh_lower, mic->vad
 			);
+			atomic_fetch_add_explicit(&rec->gen, 1, memory_order_release);
+			fine_prof_end(FINE_STAGE_RECORD, t);
+
+			t = fine_prof_now();
+			in->stop(in);
+			float const loudness = fine_select_loudness(rec->data, rec->sz);
+			int const queued = publish(sys, mic, loudness);
+			pthread_rwlock_unlock(&sys->store_lock);
+			if(queued < 0) fine_log(WARN, "%s: %d recordings wait for the selector, dropped this one", mic->what, PUBLISH_QUEUE);
+			else {
+				//Right away if no output thread holds playback_mtx, otherwise the next one takes it before it draws
+				if(mtx_trylock(&sys->playback_mtx) == thrd_success) {
+					fine_thread_apply_published(sys);
+					mtx_unlock(&sys->playback_mtx);
+				}
+				atomic_fetch_add_explicit(&sys->num_recordings, 1, memory_order_relaxed);
+				atomic_fetch_add_explicit(&mic->num_recordings, 1, memory_order_relaxed);
+				atomic_store_explicit(&sys->last_publisher, mic->idx, memory_order_relaxed);
+			}
 
-			snd_pcm_drop(sys->pcm_in);
-
-			mtx_lock(&sys->playback_mtx); //There is always work to do at this point
-
-			sys->rec_idx = (sys->rec_idx + 1) % MAX_NUM_REC;
-			sys->rec_csz = P99_MINOF(sys->rec_csz+1, MAX_NUM_REC);
-
-
-			mtx_unlock(&sys->playback_mtx);
-
-			atomic_store_explicit(&sys->play, 1, memory_order_release);
+			fine_prof_end(FINE_STAGE_PUBLISH, t);
+			//A stop while recording has already cleared play and faded out, leave it like that
+			if(atomic_load_explicit(&sys->stopped, memory_order_acquire)) break;
 			//Is it posisble that output misses the fade out? Yes, but it's no big deal.
+			//Cleared before play, or the output could cancel the collage it is about to render for this recording
 			atomic_store_explicit(&sys->fade_out, 0, memory_order_release);
-			//Output can miss this. However, play is active at this point.
-			cnd_signal(&sys->playback);
-
-			clock_gettime(CLOCK_MONOTONIC_COARSE, &last_recording);
+			//Output can miss the signal. However, play is active at this point.
+			fine_thread_play(sys, 1);
 
+			samples_since_recording = 0;
 
-			snd_pcm_prepare(sys->pcm_in);
+			if(in->eof) break;
+			in->start(in);
 		}
 
         }
 	free(tmp_buf);
+
+	if(in->eof) {
+		fine_log(INFO, "%s ended", mic->what);
+		//the others could still trigger collages
+		if(atomic_fetch_sub_explicit(&sys->mics_running, 1, memory_order_acq_rel) == 1) {
+			fine_log(INFO, "input ended, stopping");
+			fine_thread_stop_everything(sys, 0);
+		}
+	}
+	return 0;
 }
@@ -0,0 +1,274 @@
+#include "fine_audio_io.h"
+#include "fine_definitions.h"
+#include "fine_log.h"
+#include "fine_fx.h"
+#include "fine_grain.h"
+#include "fine_prof.h"
+#include "fine_voice.h"
+#include "p99/p99.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define STREAM_CHUNK 1024 //frames per write, fade_out and the queue are checked between two writes
+#define STREAM_FADE_OUT_MS 50
+#define STREAM_XFADE_MS 250 //the end of a collage is mixed with the start of the next one
+#define STREAM_BUFS 4 //rendering, queued, playing and the one fading out in a crossfade
+/* --- END DEFINITIONS FOR TUNING --- */
+
+typedef struct StreamBuf StreamBuf;
+struct StreamBuf {
+	i16 *data;
+	size_t sz;
+	size_t pos; //next frame to play
+	uint64_t published; //the recording it answers, for FINE_STAGE_RESPONSE
+	bool used; //handed out by fine_stream_next and not played to the end yet
+};
+
+struct Stream {
+	AudioDev *out;
+	size_t channels; //of out, the buffers and chunk hold frames of them
+	_Atomic(bool) const* fade_out;
+	size_t max_samples;
+	Voices *voices; //plays them instead of collages
+	Grains *grains; //or these
+	thrd_t thrd;
+	i16 *chunk; //what is written next
+
+	//All protected by mtx, cnd is signalled when the renderer or the stream thread has something to do
+	mtx_t mtx;
+	cnd_t cnd;
+	StreamBuf bufs[STREAM_BUFS];
+	StreamBuf *queued;
+	StreamBuf *cur;
+	StreamBuf *prev; //fades out while cur fades in, released after xfade_len frames
+	size_t xfade_len;
+	size_t xfade_pos; //frames of the crossfade played
+	size_t silence; //frames of silence written since the last collage ended, a new one may take them back
+	bool wants_next;
+	bool stopping;
+};
+
+static void release(StreamBuf *const b) {
+	b->used = 0;
+	b->sz = b->pos = 0;
+}
+
+static bool want_next(Stream const*const s) {
+	if(s->queued) return 0;
+	bool free_buf = 0;
+	for(size_t i = 0; i < STREAM_BUFS; ++i) free_buf |= !s->bufs[i].used;
+	return free_buf && (!s->cur || s->cur->sz - s->cur->pos <= (STREAM_AHEAD_MS+STREAM_XFADE_MS)*SAMPLE_RATE/1000);
+}
+
+//The queued collage starts, crossfaded with the rest of the playing one
+static void start_next(Stream *const s) {
+	StreamBuf *const next = s->queued;
+	s->queued = 0;
+	if(s->prev) release(s->prev);
+	s->prev = 0;
+	if(s->cur) {
+		s->prev = s->cur;
+		//a next one that is shorter than the rest ends the crossfade early, what is left of prev is dropped
+		s->xfade_len = P99_MINOF(s->prev->sz - s->prev->pos, next->sz);
+		s->xfade_pos = 0;
+	}
+	//the device still has silence to play, the collage goes in front of it
+	else if(s->silence) fine_audio_dev_rewind(s->out, s->silence);
+	s->silence = 0;
+	s->cur = next;
+	if(next->published) fine_prof_end(FINE_STAGE_RESPONSE, next->published);
+	fine_log(DEBUG, "stream: starting %zu frames%s", next->sz, s->prev ? ", crossfaded" : "");
+}
+
+/* Fills s->chunk with up to n frames of cur and prev, releases them once played
+ * @return the number of frames filled, 0 if nothing plays
+ * */
+static size_t fill(Stream *const s, size_t const n) {
+	if(!s->cur) return 0;
+	StreamBuf *const c = s->cur, *const p = s->prev;
+	size_t const ch = s->channels;
+	size_t const k = P99_MINOF(n, c->sz - c->pos);
+	memcpy(s->chunk, c->data+c->pos*ch, k*ch*sizeof(i16));
+	if(p) {
+		//the crossfade ends no later than c, see start_next
+		size_t const m = P99_MINOF(k, s->xfade_len - s->xfade_pos);
+		i16 const*const from = p->data + p->pos*ch;
+		for(size_t i = 0; i < m*ch; ++i) {
+			float const g = (float)(s->xfade_pos+i/ch+1)/s->xfade_len;
+			s->chunk[i] = roundf(s->chunk[i]*g + from[i]*(1-g));
+		}
+		p->pos += m;
+		s->xfade_pos += m;
+		if(s->xfade_pos == s->xfade_len) {
+			release(p);
+			s->prev = 0;
+		}
+	}
+	c->pos += k;
+	if(c->pos == c->sz) {
+		release(c);
+		s->cur = 0;
+	}
+	return k;
+}
+
+//A trigger: what the device has not played yet is taken back if it can be, the rest fades out
+static size_t fade_out(Stream *const s) {
+	size_t const fade_len = STREAM_FADE_OUT_MS*SAMPLE_RATE/1000;
+	if(!s->prev) s->cur->pos -= fine_audio_dev_rewind(s->out, s->cur->pos);
+	size_t const n = fill(s, fade_len);
+	//by sample rather than by frame, the channels are a step of 1/(n*channels) apart
+	fine_fx_fade_linear(s->chunk, n*s->channels, 0, n*s->channels);
+	if(s->prev) release(s->prev);
+	if(s->cur) release(s->cur);
+	s->prev = s->cur = 0;
+	fine_log(DEBUG, "stream: faded out");
+	return n;
+}
+
+static bool engine_busy(Stream const*const s) {
+	return s->voices ? fine_voice_busy(s->voices) : fine_grain_busy(s->grains);
+}
+
+//The voices or the grains make every chunk, they fade out on their own
+static void play_engine(Stream *const s) {
+	while(1) {
+		mtx_lock(&s->mtx);
+		while(!engine_busy(s) && !s->stopping && !s->out->clocked) {
+			cnd_wait(&s->cnd, &s->mtx);
+		}
+		bool const done = s->stopping && !engine_busy(s);
+		mtx_unlock(&s->mtx);
+		if(done) return;
+
+		if(s->voices) fine_voice_render(s->voices, s->chunk, STREAM_CHUNK);
+		else fine_grain_render(s->grains, s->chunk, STREAM_CHUNK);
+		uint64_t const start = fine_prof_now();
+		size_t const written = fine_audio_dev_write(s->out, s->chunk, STREAM_CHUNK);
+		fine_prof_end(FINE_STAGE_PLAYBACK, start);
+		if(written < STREAM_CHUNK)
+			fine_log(WARN, "expected to write %d frames, actually wrote %zu frames", STREAM_CHUNK, written);
+	}
+}
+
+static int stream_thread(void *ptr) {
+	Stream *const s = ptr;
+	fine_prof_thread("playback");
+	s->out->start(s->out);
+	while(!s->voices && !s->grains) {
+		mtx_lock(&s->mtx);
+		bool const fade = atomic_load_explicit(s->fade_out, memory_order_acquire);
+		//rendered before the trigger
+		if(fade && s->queued) {
+			release(s->queued);
+			s->queued = 0;
+		}
+		//Without a clock nothing paces the silence, so it waits instead
+		while(!s->cur && !s->queued && !s->stopping && !s->out->clocked) {
+			cnd_wait(&s->cnd, &s->mtx);
+		}
+		if(!s->cur && !s->queued && s->stopping) {
+			mtx_unlock(&s->mtx);
+			break;
+		}
+		if(s->queued && (!s->cur || s->cur->sz - s->cur->pos <= STREAM_XFADE_MS*SAMPLE_RATE/1000)) start_next(s);
+
+		size_t n = fade && s->cur ? fade_out(s) : fill(s, STREAM_CHUNK);
+		if(n < STREAM_CHUNK && s->out->clocked) {
+			memset(s->chunk+n*s->channels, 0, (STREAM_CHUNK-n)*s->channels*sizeof(i16));
+			s->silence += STREAM_CHUNK-n;
+			n = STREAM_CHUNK;
+		}
+		bool const want = want_next(s);
+		if(want && !s->wants_next) cnd_broadcast(&s->cnd);
+		s->wants_next = want;
+		mtx_unlock(&s->mtx);
+
+		uint64_t const start = fine_prof_now();
+		size_t const written = fine_audio_dev_write(s->out, s->chunk, n);
+		fine_prof_end(FINE_STAGE_PLAYBACK, start);
+		if(written < n)
+			fine_log(WARN, "expected to write %zu frames, actually wrote %zu frames", n, written);
+	}
+	if(s->voices || s->grains) play_engine(s);
+	//everything was played, nothing is left to drop
+	if(s->out->drain) s->out->drain(s->out);
+	s->out->stop(s->out);
+	return 0;
+}
+
+Stream *fine_stream_start(AudioDev *const out, _Atomic(bool) const*const fade_out, size_t const max_samples,
+	Voices *const voices, Grains *const grains) {
+	Stream *const s = calloc(1, sizeof *s);
+	if(!s) fine_exit("Could not allocate the playback stream");
+	*s = (Stream){
+		.out = out,
+		.channels = out->channels,
+		.fade_out = fade_out,
+		.max_samples = max_samples,
+		.voices = voices,
+		.grains = grains,
+		.chunk = malloc(P99_MAXOF(STREAM_CHUNK, STREAM_FADE_OUT_MS*SAMPLE_RATE/1000)*out->channels*sizeof(i16)),
+	};
+	if(!s->chunk) fine_exit("Could not allocate the playback stream");
+	for(size_t i = 0; i < STREAM_BUFS && !voices && !grains; ++i) {
+		if(!(s->bufs[i].data = malloc(max_samples*out->channels*sizeof(i16)))) fine_exit("Could not allocate the playback stream");
+	}
+	mtx_init(&s->mtx, mtx_plain);
+	cnd_init(&s->cnd);
+	if(thrd_create(&s->thrd, stream_thread, s) != thrd_success) fine_exit("Could not start the playback thread");
+	return s;
+}
+
+i16 *fine_stream_next(Stream *const s) {
+	mtx_lock(&s->mtx);
+	while(!want_next(s)) cnd_wait(&s->cnd, &s->mtx);
+	StreamBuf *b = s->bufs;
+	while(b->used) ++b;
+	b->used = 1;
+	mtx_unlock(&s->mtx);
+	return b->data;
+}
+
+void fine_stream_put(Stream *const s, i16 *const data, size_t const sz, uint64_t const published) {
+	assert(sz <= s->max_samples);
+	mtx_lock(&s->mtx);
+	StreamBuf *b = s->bufs;
+	while(b->data != data) ++b;
+	if(sz) {
+		b->sz = sz;
+		b->pos = 0;
+		b->published = published;
+		s->queued = b;
+	}
+	else release(b);
+	s->wants_next = want_next(s);
+	cnd_broadcast(&s->cnd);
+	mtx_unlock(&s->mtx);
+}
+
+void fine_stream_play(Stream *const s, Plan const*const plan, size_t const newest_rec_idx, uint64_t const seed,
+	uint64_t const published) {
+	if(s->voices) fine_voice_start(s->voices, plan, newest_rec_idx, published);
+	else fine_grain_start(s->grains, plan, newest_rec_idx, seed, published);
+	mtx_lock(&s->mtx);
+	cnd_broadcast(&s->cnd);
+	mtx_unlock(&s->mtx);
+}
+
+void fine_stream_stop(Stream *const s) {
+	mtx_lock(&s->mtx);
+	s->stopping = 1;
+	cnd_broadcast(&s->cnd);
+	mtx_unlock(&s->mtx);
+	thrd_join(s->thrd, 0);
+	mtx_destroy(&s->mtx);
+	cnd_destroy(&s->cnd);
+	for(size_t i = 0; i < STREAM_BUFS; ++i) free(s->bufs[i].data);
+	free(s->chunk);
+	free(s);
+}
@@ -0,0 +1,181 @@
+/*
+ * Offline renderer: renders collages from a recording store into wav files, on all cores.
+ * Build with the third line of build.sh.
+ *   ./batch [-n collages] [-s first seed] [-j threads] [-c channels] [-d data dir] [-o output dir]
+ * Collage i is drawn from seed first+i with gen_indices, fine_plan_build and render_recordings, like the
+ * output thread does. Every collage starts from the freshly loaded selector, so it only depends on its seed and
+ * the data dir, not on the number of threads: seed s gives the collage the live system would play with
+ * FINE_SEED=s right after loading the same data dir. The first seed defaults to FINE_SEED, the channels
+ * to FINE_CHANNELS.
+ * */
+#include "fine_definitions.h"
+#include "fine_log.h"
+#include "fine_kernel.h"
+#include "fine_mix.h"
+#include "fine_prof.h"
+#include "fine_render.h"
+#include "fine_select.h"
+#include "fine_wav.h"
+#include "p99/p99.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+
+typedef struct Batch Batch;
+struct Batch {
+	Recording const* rec_arr;
+	Selector const* selector;
+	size_t newest_rec_idx;
+	PlanBudget budget;
+	uint64_t first_seed;
+	size_t num_collages;
+	char const* out_dir;
+	size_t cache_bytes; //per thread
+
+	_Atomic(size_t) next; //next collage to render
+	_Atomic(size_t) num_samples; //rendered so far
+	_Atomic(uint64_t) render_ns; //summed over all threads
+	_Atomic(size_t) num_failed;
+};
+
+//sz frames of channels
+static int write_wav(char const*const path, i16 const*const data, size_t const sz, unsigned const channels) {
+	WavInfo const info = {.sample_rate = SAMPLE_RATE, .channels = channels, .bits = 16};
+	FILE *const file = fopen(path, "wb");
+	if(!file) {
+		fine_log(WARN, "Could not open %s", path);
+		return -1;
+	}
+	int const res = fine_wav_write_header(file, &info) < 0
+		|| fwrite(data, sizeof *data*channels, sz, file) != sz
+		|| fine_wav_finish(file, &info, sz) < 0 ? -1 : 0;
+	if(fclose(file) || res < 0) {
+		fine_log(WARN, "Could not write %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int worker(void *ptr) {
+	Batch *const batch = ptr;
+	fine_prof_thread("worker");
+	i16 *const data = calloc(batch->budget.max_samples*batch->budget.channels, sizeof *data);
+	fine_reverb_model *const reverb = malloc(sizeof *reverb);
+	if(!data || !reverb) fine_exit("Could not allocate render buffers");
+	reverb_init(reverb);
+	ClipCache *const cache = fine_clip_cache_create(batch->cache_bytes);
+	p99_seed *const seed = p99_seed_get();
+
+	size_t i;
+	while((i = atomic_fetch_add_explicit(&batch->next, 1, memory_order_relaxed)) < batch->num_collages) {
+		uint64_t const collage_seed = batch->first_seed + i;
+		fine_rand_seed(seed, collage_seed);
+
+		Selector *const sel = fine_select_clone(batch->selector);
+		size_t indices[OPT_NUM_RECORDINGS] = {0};
+		size_t const num = gen_indices(sel, seed, indices, batch->newest_rec_idx);
+		fine_select_destroy(sel);
+
+		Plan plan;
+		if(fine_plan_build(&plan, seed, batch->rec_arr, batch->newest_rec_idx, indices, num, &batch->budget) < 0) {
+			atomic_fetch_add_explicit(&batch->num_failed, 1, memory_order_relaxed);
+			continue;
+		}
+
+		uint64_t const start = fine_prof_now();
+		size_t const sz = render_recordings(data, batch->budget.max_samples, cache, reverb, batch->rec_arr, batch->newest_rec_idx, &plan, 0);
+		uint64_t const ns = fine_prof_end(FINE_STAGE_RENDER, start) - start;
+
+		char path[256];
+		snprintf(path, sizeof path, "%s/collage_%" PRIu64 ".wav", batch->out_dir, collage_seed);
+		if(write_wav(path, data, sz, batch->budget.channels) < 0) atomic_fetch_add_explicit(&batch->num_failed, 1, memory_order_relaxed);
+
+		atomic_fetch_add_explicit(&batch->num_samples, sz, memory_order_relaxed);
+		atomic_fetch_add_explicit(&batch->render_ns, ns, memory_order_relaxed);
+		fine_log(INFO, "seed %" PRIu64 ": %zu clips, %.1f s, rendered in %.0f ms (RTF %.4f)",
+			collage_seed, plan.num_clips, (double)sz/SAMPLE_RATE, ns/1e6, sz ? ns*1e-9*SAMPLE_RATE/sz : 0);
+	}
+
+	fine_clip_cache_destroy(cache);
+	free(reverb);
+	free(data);
+	return 0;
+}
+
+int main(int argc, char *argv[argc+1]) {
+	size_t num_collages = 1;
+	uint64_t first_seed = fine_rand_seed_from_env();
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t channels = 0; //FINE_CHANNELS
+	char const* data_dir = "data";
+	char const* out_dir = ".";
+
+	int opt;
+	while((opt = getopt(argc, argv, "n:s:j:c:d:o:")) != -1) {
+		switch(opt) {
+			case 'n': num_collages = strtoull(optarg, 0, 0); break;
+			case 's': first_seed = strtoull(optarg, 0, 0); break;
+			case 'j': num_threads = strtol(optarg, 0, 0); break;
+			case 'c': channels = strtoull(optarg, 0, 0); break;
+			case 'd': data_dir = optarg; break;
+			case 'o': out_dir = optarg; break;
+			default:
+				fine_exit("usage: %s [-n collages] [-s first seed] [-j threads] [-c channels] [-d data dir] [-o output dir]", argv[0]);
+		}
+	}
+	if(channels > MAX_CHANNELS) fine_exit("-c: at most %d channels", MAX_CHANNELS);
+	num_threads = P99_MAXOF(1, P99_MINOF(num_threads, P99_MINOF((long)num_collages, MAX_THREADS)));
+
+	fine_trace_init(); //first, it blocks SIGUSR1 for the threads started later
+	fine_log_init();
+	fine_kernel_init();
+	if(!channels) channels = fine_mix_channels_from_env();
+
+	Recording *const rec_arr = calloc(MAX_NUM_REC, sizeof *rec_arr);
+	Selector *const selector = fine_select_create(MAX_NUM_REC);
+	if(!rec_arr) fine_exit("Could not allocate recordings");
+	size_t const num_files = fine_render_load_recordings(rec_arr, selector, data_dir);
+	if(!num_files) fine_exit("No recordings in %s (expected %s/0.raw, %s/1.raw, ...)", data_dir, data_dir, data_dir);
+	//Same state as the live system after loading: the slot after the newest one is about to be overwritten
+	fine_select_remove(selector, num_files % MAX_NUM_REC);
+	fine_log(INFO, "loaded %zu files, rendering %zu collages on %ld threads", num_files, num_collages, num_threads);
+
+	Batch batch = {
+		.rec_arr = rec_arr,
+		.selector = selector,
+		.newest_rec_idx = num_files-1,
+		.budget = fine_render_budget(channels),
+		.first_seed = first_seed,
+		.num_collages = num_collages,
+		.out_dir = out_dir,
+		.cache_bytes = CLIP_CACHE_BYTES/num_threads,
+	};
+
+	uint64_t const start = fine_prof_now();
+	thrd_t thrd[MAX_THREADS];
+	for(long t = 0; t < num_threads; ++t) {
+		if(thrd_create(thrd+t, worker, &batch) != thrd_success) fine_exit("Could not start thread %ld", t);
+	}
+	for(long t = 0; t < num_threads; ++t) thrd_join(thrd[t], 0);
+	double const wall_s = (fine_prof_now() - start)*1e-9;
+
+	double const audio_s = (double)atomic_load(&batch.num_samples)/SAMPLE_RATE;
+	double const render_s = atomic_load(&batch.render_ns)*1e-9;
+	fine_log(INFO, "%zu collages, %.1f s of audio in %.2f s: %.2f collages/s, RTF %.4f per thread, %.1fx real time overall",
+		num_collages, audio_s, wall_s, num_collages/wall_s, audio_s > 0 ? render_s/audio_s : 0, audio_s/wall_s);
+
+	fine_trace_dump();
+	fine_prof_report(INFO);
+
+	size_t const num_failed = atomic_load(&batch.num_failed);
+	if(num_failed) fine_log(ERROR, "%zu collages could not be planned or written", num_failed);
+	fine_select_destroy(selector);
+	free(rec_arr);
+	fine_log_shutdown();
+	return num_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,334 @@
+/*
+ * Speed and conformance of the DSP kernels. Build with the second line of build.sh, run ./bench [file.raw]
+ * Every kernel runs over test.raw and synthetic signals at several block sizes, once per kernel table
+ * the CPU supports (fine_kernel.h). Each run is checked against the reference at the same block size:
+ * the scalar table, or fine_fx_compress_ref for the compressor.
+ * @return 1 if any run is outside its tolerance
+ * */
+#include "fine_definitions.h"
+#include "fine_aec.h"
+#include "fine_fft.h"
+#include "fine_log.h"
+#include "fine_fx.h"
+#include "fine_fx_reverb.h"
+#include "fine_kernel.h"
+#include "fine_mix.h"
+#include "fine_vad.h"
+#include "p99/p99.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define BENCH_SIGNAL_SZ (SAMPLE_RATE*4)
+#define BENCH_MIN_NS 20e6 //repeat every run for at least this long...
+#define BENCH_MIN_REPS 3 //...and at least this often, then take the fastest
+#define BENCH_MIN_DBFS -60.0 //quieter samples are left out of the gain difference
+#define BENCH_INPUT_GAIN 11.0f //test.raw is quiet, render_recordings amplifies 6-16x before the compressor
+#define BENCH_WIN_LEN 1024 //Hann window of the grain, like fine_grain.c
+#define BENCH_TAPS 32 //FIR length of the resampler, like fine_convert.c
+#define BENCH_PAN_CHANNELS 6 //not a divisor of the vector width, so the pan kernels shuffle
+#define BENCH_FFT 512 //like the echo canceller
+#define BENCH_ECHO_DELAY 300 //frames from the reference to its echo
+#define BENCH_ECHO_MS 200 //like FINE_AEC_MS
+/* --- END DEFINITIONS FOR TUNING --- */
+
+static size_t const block_sizes[] = {64, 1024, BENCH_SIGNAL_SZ};
+
+typedef struct Signal Signal;
+struct Signal {
+	char const* name;
+	i16 *data;
+	float *mix; //data*3, as a mix that needs limiting
+	size_t sz;
+};
+
+typedef struct Bench Bench;
+struct Bench {
+	char const* name;
+	void (*reset)(void); //called before every pass over a signal, for kernels with state
+	void (*run)(i16 *data, float const* mix, size_t n); //processes one block in place
+	void (*ref)(i16 *data, float const* mix, size_t n); //0: run with the scalar tables
+	bool dispatched; //goes through fine_kernels, so it is run with every table
+	int max_err; //in LSB
+	double min_snr; //in dB
+	double max_db; //largest gain difference, where the reference is above BENCH_MIN_DBFS
+};
+
+static fine_reverb_model reverb;
+static Limiter limiter;
+static float grain_win[BENCH_WIN_LEN+2];
+static float grain_acc[BENCH_SIGNAL_SZ];
+static i16 grain_src[BENCH_SIGNAL_SZ];
+static float fir_taps[BENCH_TAPS];
+static float pan_acc[BENCH_SIGNAL_SZ*BENCH_PAN_CHANNELS];
+static float pan_src[BENCH_SIGNAL_SZ];
+static float const pan_gains[BENCH_PAN_CHANNELS] = {1.0f, 0.5f, -0.75f, 0.25f, -1.0f, 0.9f};
+static Fft *fft;
+static float fft_re[BENCH_FFT], fft_im[BENCH_FFT];
+static Aec *aec;
+static i16 echo_ref[BENCH_SIGNAL_SZ];
+static i16 echo_line[BENCH_ECHO_DELAY];
+static size_t echo_pos;
+static Vad *vad;
+
+static void reset_reverb(void) {
+	reverb_reset(&reverb);
+	reverb_set_params(&reverb, 2.0f/3, 2.0f/3, 0.5f, 0.5f);
+}
+static void reset_limiter(void) { fine_mix_limiter_init(&limiter, 50.0f, 5, SAMPLE_RATE, 1); }
+//a new one, fine_aec_reset keeps the samples in flight
+static void reset_echo(void) {
+	fine_aec_destroy(aec);
+	aec = fine_aec_create(0, BENCH_ECHO_MS);
+	memset(echo_line, 0, sizeof echo_line);
+	echo_pos = 0;
+}
+static void reset_vad(void) {
+	fine_vad_destroy(vad);
+	vad = fine_vad_create();
+}
+
+static void run_amplify(i16 *const data, float const*const mix, size_t const n) { (void)mix; fine_fx_amplify(data, n, 6.0f); }
+static void run_fade(i16 *const data, float const*const mix, size_t const n) { (void)mix; fine_fx_fade_linear(data, n, n/8, n/8); }
+static void run_compress(i16 *const data, float const*const mix, size_t const n) {
+	(void)mix;
+	fine_fx_compress(data, n, SAMPLE_RATE, 4000.0f, 10.0f, 3.0f, 80.0f, 1.0f);
+}
+static void ref_compress(i16 *const data, float const*const mix, size_t const n) {
+	(void)mix;
+	fine_fx_compress_ref(data, n, SAMPLE_RATE, 4000.0f, 10.0f, 3.0f, 80.0f, 1.0f);
+}
+static void run_reverb(i16 *const data, float const*const mix, size_t const n) { (void)mix; fine_fx_reverb(data, n, &reverb); }
+static void run_limit(i16 *const data, float const*const mix, size_t const n) { fine_mix_limit(data, mix, n, &limiter); }
+//One grain over the whole block, 3/4 speed (it reads up to 3n/4+1)
+static void run_grain(i16 *const data, float const*const mix, size_t const n) {
+	(void)mix;
+	if(n < 8) return;
+	memcpy(grain_src, data, n*sizeof *data);
+	memset(grain_acc, 0, n*sizeof *grain_acc);
+	fine_kernels->grain(grain_acc, n, grain_src, 0.25f, 0.75f, grain_win, 0, (float)BENCH_WIN_LEN/n, 1.0f);
+	for(size_t i = 0; i < n; ++i) data[i] = roundf(grain_acc[i]);
+}
+//The FIR of the resampler over the mix (3x the signal), as far as the block reaches
+static void run_fir(i16 *const data, float const*const mix, size_t const n) {
+	for(size_t i = 0; i + BENCH_TAPS <= n; ++i) data[i] = roundf(fine_kernels->dot(mix+i, fir_taps, BENCH_TAPS));
+}
+
+//Forward and back over every BENCH_FFT samples of the block, the rest stays as it is
+static void run_fft(i16 *const data, float const*const mix, size_t const n) {
+	(void)mix;
+	for(size_t i = 0; i + BENCH_FFT <= n; i += BENCH_FFT) {
+		for(size_t k = 0; k < BENCH_FFT; ++k) {
+			fft_re[k] = data[i+k];
+			fft_im[k] = 0;
+		}
+		fine_fft_forward(fft, fft_re, fft_im);
+		fine_fft_inverse(fft, fft_re, fft_im);
+		for(size_t k = 0; k < BENCH_FFT; ++k) data[i+k] = roundf(fft_re[k]);
+	}
+}
+//The signal is the reference, the microphone hears it BENCH_ECHO_DELAY later at half the level. Leaves what is left of it
+static void run_echo(i16 *const data, float const*const mix, size_t const n) {
+	(void)mix;
+	for(size_t i = 0; i < n; ++i) {
+		echo_ref[i] = data[i];
+		data[i] = echo_line[echo_pos]/2;
+		echo_line[echo_pos] = echo_ref[i];
+		echo_pos = (echo_pos + 1) % BENCH_ECHO_DELAY;
+	}
+	fine_aec_process(aec, data, echo_ref, n);
+}
+//Silences the blocks the detector doesn't find activity in
+static void run_vad(i16 *const data, float const*const mix, size_t const n) {
+	(void)mix;
+	if(!fine_vad_process(vad, data, n)) memset(data, 0, n*sizeof *data);
+}
+
+//Frame i keeps channel i % channels, so every lane of the frames is checked
+static void pan_out(i16 *const data, size_t const n) {
+	for(size_t i = 0; i < n; ++i) data[i] = roundf(pan_acc[i*BENCH_PAN_CHANNELS + i%BENCH_PAN_CHANNELS]);
+}
+static void run_pan(i16 *const data, float const*const mix, size_t const n) {
+	(void)mix;
+	memset(pan_acc, 0, n*BENCH_PAN_CHANNELS*sizeof *pan_acc);
+	fine_mix_pan_add(pan_acc, data, n, BENCH_PAN_CHANNELS, pan_gains);
+	pan_out(data, n);
+}
+//From the mix (3x the signal), at a third of the gains
+static void run_pan_f(i16 *const data, float const*const mix, size_t const n) {
+	for(size_t i = 0; i < n; ++i) pan_src[i] = mix[i]/3;
+	memset(pan_acc, 0, n*BENCH_PAN_CHANNELS*sizeof *pan_acc);
+	fine_mix_pan_add_f(pan_acc, pan_src, n, BENCH_PAN_CHANNELS, pan_gains);
+	pan_out(data, n);
+}
+
+//Same settings as render_recordings
+static Bench const benches[] = {
+	{.name = "amplify", .run = run_amplify, .dispatched = 1, .max_err = 1, .min_snr = 60, .max_db = INFINITY},
+	{.name = "fade", .run = run_fade, .dispatched = 1, .max_err = 1, .min_snr = 60, .max_db = INFINITY},
+	{.name = "compress", .run = run_compress, .ref = ref_compress, .dispatched = 1, .max_err = INT16_MAX, .min_snr = 30, .max_db = 0.5},
+	{.name = "reverb", .reset = reset_reverb, .run = run_reverb, .dispatched = 1, .max_err = 1, .min_snr = 60, .max_db = INFINITY},
+	{.name = "limit", .reset = reset_limiter, .run = run_limit, .dispatched = 1, .max_err = 1, .min_snr = 60, .max_db = INFINITY},
+	{.name = "grain", .run = run_grain, .dispatched = 1, .max_err = 1, .min_snr = 60, .max_db = INFINITY},
+	{.name = "fir", .run = run_fir, .dispatched = 1, .max_err = 1, .min_snr = 60, .max_db = INFINITY},
+	{.name = "pan", .run = run_pan, .dispatched = 1, .max_err = 1, .min_snr = 60, .max_db = INFINITY},
+	{.name = "pan_f", .run = run_pan_f, .dispatched = 1, .max_err = 1, .min_snr = 60, .max_db = INFINITY},
+	{.name = "fft", .run = run_fft, .dispatched = 1, .max_err = 1, .min_snr = 60, .max_db = INFINITY},
+	{.name = "vad", .reset = reset_vad, .run = run_vad, .dispatched = 1, .max_err = 0, .min_snr = INFINITY, .max_db = INFINITY},
+	{.name = "echo", .reset = reset_echo, .run = run_echo, .dispatched = 1, .max_err = 1, .min_snr = 60, .max_db = INFINITY},
+};
+
+static double now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec*1e9 + t.tv_nsec;
+}
+
+static void pass(Bench const*const bench, void (*const run)(i16 *, float const*, size_t), i16 *const data,
+	Signal const*const sig, size_t const block) {
+	if(bench->reset) bench->reset();
+	for(size_t i = 0; i < sig->sz; i += block) run(data+i, sig->mix+i, P99_MINOF(block, sig->sz - i));
+}
+
+//@return the fastest pass in ns, data holds the output
+static double timed(Bench const*const bench, void (*const run)(i16 *, float const*, size_t), i16 *const data,
+	Signal const*const sig, size_t const block) {
+	double best = INFINITY, total = 0;
+	for(size_t rep = 0; rep < BENCH_MIN_REPS || total < BENCH_MIN_NS; ++rep) {
+		memcpy(data, sig->data, sig->sz*sizeof *data);
+		double const start = now_ns();
+		pass(bench, run, data, sig, block);
+		double const ns = now_ns() - start;
+		best = P99_MINOF(best, ns);
+		total += ns;
+	}
+	return best;
+}
+
+static void compare(i16 const*const ref, i16 const*const out, size_t const n, int *const max_err, double *const snr, double *const max_db) {
+	double const min_level = 32768*pow(10, BENCH_MIN_DBFS/20);
+	double sig = 0, noise = 0;
+	*max_err = 0;
+	*max_db = 0;
+	for(size_t i = 0; i < n; ++i) {
+		int const d = abs(ref[i] - out[i]);
+		*max_err = P99_MAXOF(*max_err, d);
+		sig += (double)ref[i]*ref[i];
+		noise += (double)d*d;
+		if(d && abs(ref[i]) >= min_level) {
+			double const db = out[i] == 0 || (out[i] < 0) != (ref[i] < 0) ? INFINITY : fabs(20*log10((double)out[i]/ref[i]));
+			*max_db = P99_MAXOF(*max_db, db);
+		}
+	}
+	*snr = noise == 0 ? INFINITY : 10*log10(sig/noise);
+}
+
+static void make_signal(Signal *const sig, char const*const name, size_t const sz) {
+	sig->name = name;
+	sig->sz = sz;
+	sig->data = calloc(sz, sizeof *sig->data);
+	sig->mix = calloc(sz, sizeof *sig->mix);
+	if(!sig->data || !sig->mix) fine_exit("Could not allocate %s", name);
+}
+
+static size_t make_signals(Signal *const sigs, char const*const path) {
+	size_t num = 0;
+	FILE *const file = fopen(path, "rb");
+	if(file) {
+		Signal *const sig = sigs + num++;
+		make_signal(sig, path, BENCH_SIGNAL_SZ);
+		sig->sz = fread(sig->data, sizeof *sig->data, BENCH_SIGNAL_SZ, file);
+		fclose(file);
+		for(size_t i = 0; i < sig->sz; ++i) sig->data[i] = P99_MAXOF(P99_MINOF(sig->data[i]*BENCH_INPUT_GAIN, INT16_MAX), INT16_MIN);
+		if(!sig->sz) --num;
+	}
+	else fine_log(WARN, "Could not open %s, running only the synthetic signals", path);
+
+	Signal *sig = sigs + num++;
+	make_signal(sig, "sine 440 Hz -6 dBFS", BENCH_SIGNAL_SZ);
+	for(size_t i = 0; i < sig->sz; ++i) sig->data[i] = 16384*sin(2*M_PI*440*i/SAMPLE_RATE);
+
+	sig = sigs + num++;
+	make_signal(sig, "white noise", BENCH_SIGNAL_SZ);
+	uint32_t x = 1;
+	for(size_t i = 0; i < sig->sz; ++i) {
+		x = x*1664525u + 1013904223u;
+		sig->data[i] = (int32_t)(x >> 16) - 32768;
+	}
+
+	//alternating loud and quiet bursts, the compressor and the limiter have to attack and release all the time
+	sig = sigs + num++;
+	make_signal(sig, "bursts", BENCH_SIGNAL_SZ);
+	for(size_t i = 0; i < sig->sz; ++i) {
+		float const amp = (i/(SAMPLE_RATE/10))%2 ? 2000 : 30000;
+		sig->data[i] = amp*sin(2*M_PI*1000*i/SAMPLE_RATE);
+	}
+
+	for(size_t s = 0; s < num; ++s) {
+		for(size_t i = 0; i < sigs[s].sz; ++i) sigs[s].mix[i] = 3.0f*sigs[s].data[i];
+	}
+	return num;
+}
+
+int main(int argc, char *argv[argc+1]) {
+	char const*const path = argc > 1 ? argv[1] : "test.raw";
+	Kernels const* tables[8];
+	size_t const num_tables = fine_kernel_list(tables, sizeof tables/sizeof *tables);
+	Signal sigs[4];
+	size_t const num_sigs = make_signals(sigs, path);
+	reverb_init(&reverb);
+	for(size_t i = 0; i <= BENCH_WIN_LEN; ++i) grain_win[i] = 0.5f - 0.5f*cosf(2*(float)M_PI*i/BENCH_WIN_LEN);
+	//a Hann window summing to 1/3, so the output has the level of the signal
+	for(size_t i = 0; i < BENCH_TAPS; ++i) fir_taps[i] = (0.5f - 0.5f*cosf(2*(float)M_PI*(i+1)/(BENCH_TAPS+1)))/(1.5f*(BENCH_TAPS+1));
+	fft = fine_fft_create(BENCH_FFT);
+
+	i16 *const ref = malloc(BENCH_SIGNAL_SZ*sizeof *ref);
+	i16 *const out = malloc(BENCH_SIGNAL_SZ*sizeof *out);
+	if(!ref || !out) fine_exit("Could not allocate bench buffers");
+
+	printf("%-9s %-22s %7s %-8s %10s %10s %9s %7s %8s %7s\n",
+		"kernel", "signal", "block", "variant", "ns/sample", "Msample/s", "RTF", "maxerr", "SNR dB", "max dB");
+	int failed = 0;
+	for(size_t b = 0; b < sizeof benches/sizeof *benches; ++b) {
+		Bench const*const bench = benches + b;
+		for(size_t s = 0; s < num_sigs; ++s) {
+			Signal const*const sig = sigs + s;
+			for(size_t k = 0; k < sizeof block_sizes/sizeof *block_sizes; ++k) {
+				size_t const block = block_sizes[k];
+				fine_kernels = &fine_kernels_scalar;
+				double const ref_ns = timed(bench, bench->ref ? bench->ref : bench->run, ref, sig, block);
+				if(bench->ref || !bench->dispatched) {
+					printf("%-9s %-22.22s %7zu %-8s %10.2f %10.1f %9.5f\n", bench->name, sig->name, block,
+						bench->ref ? "ref" : "scalar", ref_ns/sig->sz, sig->sz/ref_ns*1e3, ref_ns/sig->sz*SAMPLE_RATE*1e-9);
+				}
+				for(size_t t = 0; bench->dispatched && t < num_tables; ++t) {
+					fine_kernels = tables[t];
+					double const ns = timed(bench, bench->run, out, sig, block);
+					int max_err;
+					double snr, max_db;
+					compare(ref, out, sig->sz, &max_err, &snr, &max_db);
+					bool const ok = max_err <= bench->max_err && snr >= bench->min_snr && max_db <= bench->max_db;
+					failed |= !ok;
+					printf("%-9s %-22.22s %7zu %-8s %10.2f %10.1f %9.5f %7d %8.1f %7.2f%s\n", bench->name, sig->name, block,
+						tables[t]->name, ns/sig->sz, sig->sz/ns*1e3, ns/sig->sz*SAMPLE_RATE*1e-9, max_err, snr, max_db, ok ? "" : "  FAIL");
+				}
+			}
+		}
+	}
+	fine_kernels = &fine_kernels_scalar;
+
+	if(failed) fine_log(ERROR, "Some kernels are outside their tolerance");
+	free(ref);
+	free(out);
+	fine_fft_destroy(fft);
+	fine_aec_destroy(aec);
+	fine_vad_destroy(vad);
+	for(size_t s = 0; s < num_sigs; ++s) {
+		free(sigs[s].data);
+		free(sigs[s].mix);
+	}
+	return failed;
+}
@@ -0,0 +1,188 @@
+#include "fine_clip_cache.h"
+#include "fine_definitions.h"
+#include "fine_log.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_BUCKETS 1024 //power of two
+
+typedef struct ClipEntry ClipEntry;
+struct ClipEntry {
+	ClipKey key;
+	ClipEntry *hnext; //hash chain
+	ClipEntry *lru_prev; //towards the most recently used
+	ClipEntry *lru_next;
+	ClipEntry *slot_prev; //all entries of the same slot, for invalidation
+	ClipEntry *slot_next;
+	i16 data[];
+};
+
+struct ClipCache {
+	size_t budget;
+	size_t used;
+	size_t fixed; //bytes of every entry when the entries come from pool, 0 when they are malloc'ed
+	void *pool;
+	ClipEntry *free_list; //through hnext
+	size_t hits;
+	size_t misses;
+	ClipEntry *lru_head; //most recently used
+	ClipEntry *lru_tail;
+	ClipEntry *buckets[NUM_BUCKETS];
+	ClipEntry *slot_head[MAX_NUM_REC];
+	uint32_t slot_gen[MAX_NUM_REC];
+};
+
+static size_t hash_key(ClipKey const*const key) {
+	uint64_t h = key->slot;
+	h = h*0x9E3779B97F4A7C15u ^ key->gen;
+	h = h*0x9E3779B97F4A7C15u ^ key->offs;
+	h = h*0x9E3779B97F4A7C15u ^ key->num_samples;
+	h = h*0x9E3779B97F4A7C15u ^ key->gain_choice;
+	return (h ^ (h>>29)) & (NUM_BUCKETS-1);
+}
+
+static bool key_eq(ClipKey const*const a, ClipKey const*const b) {
+	return a->slot == b->slot && a->gen == b->gen && a->offs == b->offs
+		&& a->num_samples == b->num_samples && a->gain_choice == b->gain_choice;
+}
+
+static size_t entry_bytes(size_t const num_samples) {
+	return sizeof(ClipEntry) + num_samples*sizeof(i16);
+}
+
+ClipCache *fine_clip_cache_create(size_t const budget_bytes) {
+	ClipCache *const cache = calloc(1, sizeof *cache);
+	if(!cache) fine_exit("Could not allocate clip cache");
+	cache->budget = budget_bytes;
+	return cache;
+}
+
+ClipCache *fine_clip_cache_create_fixed(size_t const budget_bytes) {
+	ClipCache *const cache = fine_clip_cache_create(budget_bytes);
+	size_t const align = _Alignof(ClipEntry);
+	cache->fixed = (entry_bytes(RECORDING_SIZE) + align - 1)/align*align;
+	size_t const num = budget_bytes/cache->fixed;
+	if(!num) return cache;
+	if(!(cache->pool = malloc(num*cache->fixed))) fine_exit("Could not allocate clip cache");
+	memset(cache->pool, 0, num*cache->fixed); //no page faults later
+	for(size_t i = num; i--;) {
+		ClipEntry *const e = (ClipEntry *)((char *)cache->pool + i*cache->fixed);
+		e->hnext = cache->free_list;
+		cache->free_list = e;
+	}
+	return cache;
+}
+
+static void lru_unlink(ClipCache *const cache, ClipEntry *const e) {
+	if(e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+	else cache->lru_head = e->lru_next;
+	if(e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+	else cache->lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = 0;
+}
+
+static void lru_push_front(ClipCache *const cache, ClipEntry *const e) {
+	e->lru_prev = 0;
+	e->lru_next = cache->lru_head;
+	if(cache->lru_head) cache->lru_head->lru_prev = e;
+	else cache->lru_tail = e;
+	cache->lru_head = e;
+}
+
+static void entry_remove(ClipCache *const cache, ClipEntry *const e) {
+	ClipEntry **link = cache->buckets + hash_key(&e->key);
+	while(*link != e) link = &(*link)->hnext;
+	*link = e->hnext;
+
+	lru_unlink(cache, e);
+
+	if(e->slot_prev) e->slot_prev->slot_next = e->slot_next;
+	else cache->slot_head[e->key.slot] = e->slot_next;
+	if(e->slot_next) e->slot_next->slot_prev = e->slot_prev;
+
+	if(cache->fixed) {
+		cache->used -= cache->fixed;
+		e->hnext = cache->free_list;
+		cache->free_list = e;
+	}
+	else {
+		cache->used -= entry_bytes(e->key.num_samples);
+		free(e);
+	}
+}
+
+void fine_clip_cache_invalidate(ClipCache *const cache, size_t const slot) {
+	assert(slot < MAX_NUM_REC);
+	while(cache->slot_head[slot]) entry_remove(cache, cache->slot_head[slot]);
+}
+
+//Entries of an overwritten slot can never hit again, so free them as soon as we see the new generation
+static void sync_slot(ClipCache *const cache, ClipKey const*const key) {
+	assert(key->slot < MAX_NUM_REC);
+	if(cache->slot_gen[key->slot] == key->gen) return;
+	fine_clip_cache_invalidate(cache, key->slot);
+	cache->slot_gen[key->slot] = key->gen;
+}
+
+i16 const* fine_clip_cache_get(ClipCache *const cache, ClipKey const*const key) {
+	sync_slot(cache, key);
+	for(ClipEntry *e = cache->buckets[hash_key(key)]; e; e = e->hnext) {
+		if(!key_eq(&e->key, key)) continue;
+		lru_unlink(cache, e);
+		lru_push_front(cache, e);
+		++cache->hits;
+		return e->data;
+	}
+	++cache->misses;
+	return 0;
+}
+
+void fine_clip_cache_put(ClipCache *const cache, ClipKey const*const key, i16 const*const data) {
+	assert(!cache->fixed || key->num_samples <= RECORDING_SIZE);
+	size_t const bytes = cache->fixed ? cache->fixed : entry_bytes(key->num_samples);
+	if(bytes > cache->budget) return;
+	sync_slot(cache, key);
+
+	size_t const bucket = hash_key(key);
+	for(ClipEntry *e = cache->buckets[bucket]; e; e = e->hnext) {
+		if(key_eq(&e->key, key)) return;
+	}
+
+	while(cache->used + bytes > cache->budget) entry_remove(cache, cache->lru_tail);
+
+	ClipEntry *const e = cache->fixed ? cache->free_list : malloc(bytes);
+	if(cache->fixed) cache->free_list = e->hnext;
+	else if(!e) {
+		fine_log(WARN, "clip cache: allocation of %zu bytes failed", bytes);
+		return;
+	}
+	*e = (ClipEntry){.key = *key, .hnext = cache->buckets[bucket], .slot_next = cache->slot_head[key->slot]};
+	memcpy(e->data, data, key->num_samples*sizeof(i16));
+
+	cache->buckets[bucket] = e;
+	if(e->slot_next) e->slot_next->slot_prev = e;
+	cache->slot_head[key->slot] = e;
+	lru_push_front(cache, e);
+	cache->used += bytes;
+}
+
+void fine_clip_cache_clear(ClipCache *const cache) {
+	while(cache->lru_head) entry_remove(cache, cache->lru_head);
+}
+
+void fine_clip_cache_destroy(ClipCache *const cache) {
+	if(!cache) return;
+	fine_clip_cache_clear(cache);
+	free(cache->pool);
+	free(cache);
+}
+
+size_t fine_clip_cache_bytes(ClipCache const*const cache) {
+	return cache->used;
+}
+
+void fine_clip_cache_stats(ClipCache const*const cache, size_t *const hits, size_t *const misses) {
+	if(hits) *hits = cache->hits;
+	if(misses) *misses = cache->misses;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "fine_definitions.h"
+
+/*
+ * LRU cache of clips that already went through the pre-reverb chain (amplify, compress, fade).
+ * A clip only depends on the slice of the recording and on the gain choice, so it can be reused
+ * between collages. Entries are keyed on the generation of the recording slot, which the input
+ * thread bumps before it overwrites the slot.
+ * NOTE: not thread safe. Every thread that renders owns its own cache.
+ * */
+typedef struct ClipKey ClipKey;
+struct ClipKey {
+	size_t slot; //index into rec_arr, NOT relative to the newest recording
+	uint32_t gen;
+	size_t offs;
+	size_t num_samples;
+	unsigned gain_choice;
+};
+
+typedef struct ClipCache ClipCache;
+
+ClipCache *fine_clip_cache_create(size_t budget_bytes);
+/* Takes the whole budget up front, as entries for the longest clip (RECORDING_SIZE), and touches it.
+ * Then get and put never allocate or free, for the real-time threads. Fewer clips fit in the budget. */
+ClipCache *fine_clip_cache_create_fixed(size_t budget_bytes);
+void fine_clip_cache_destroy(ClipCache *cache);
+
+/*
+ * @return the cached samples (key->num_samples of them), or 0 on a miss.
+ * The pointer is valid until the next call that modifies the cache.
+ * */
+i16 const* fine_clip_cache_get(ClipCache *cache, ClipKey const* key);
+
+/* Copies data into the cache, evicting the least recently used clips until it fits the budget.
+ * Clips bigger than the whole budget are not cached.
+ * */
+void fine_clip_cache_put(ClipCache *cache, ClipKey const* key, i16 const* data);
+
+//Drops every clip taken from slot
+void fine_clip_cache_invalidate(ClipCache *cache, size_t slot);
+void fine_clip_cache_clear(ClipCache *cache);
+
+size_t fine_clip_cache_bytes(ClipCache const* cache);
+void fine_clip_cache_stats(ClipCache const* cache, size_t *hits, size_t *misses);
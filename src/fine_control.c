@@ -0,0 +1,298 @@
+#include "fine_control.h"
+#include "fine_aec.h"
+#include "fine_audio_io.h"
+#include "fine_log.h"
+#include "fine_prof.h"
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <threads.h>
+#include <unistd.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_LINE_SZ 256 //longest command
+#define CONTROL_OUT_SZ 16384 //longest answer, the stats
+/* --- END DEFINITIONS FOR TUNING --- */
+
+typedef struct Client Client;
+struct Client {
+	int fd; //-1 if unused
+	size_t len;
+	char line[CONTROL_LINE_SZ];
+};
+
+struct Control {
+	ASys *sys;
+	thrd_t thrd;
+	int listen_fd; //-1 without the socket
+	int signal_fd;
+	int wake[2]; //fine_control_stop writes to wake[1]
+	char path[sizeof ((struct sockaddr_un *)0)->sun_path];
+	uint64_t start_ns;
+	Client clients[CONTROL_MAX_CLIENTS];
+};
+
+typedef struct Out Out;
+struct Out {
+	size_t len;
+	char buf[CONTROL_OUT_SZ];
+};
+
+static void out_printf(Out *const o, char const*const format, ...) {
+	va_list args;
+	va_start(args, format);
+	int const n = vsnprintf(o->buf+o->len, sizeof o->buf - o->len, format, args);
+	va_end(args);
+	if(n > 0) o->len = o->len + n < sizeof o->buf ? o->len + n : sizeof o->buf - 1;
+}
+
+static void out_send(int const fd, Out const*const o) {
+	for(size_t sent = 0; sent < o->len;) {
+		ssize_t const n = send(fd, o->buf+sent, o->len-sent, MSG_NOSIGNAL);
+		if(n <= 0) return;
+		sent += n;
+	}
+}
+
+static void control_signals(sigset_t *const set) {
+	sigemptyset(set);
+	sigaddset(set, SIGTERM);
+	sigaddset(set, SIGINT);
+}
+
+void fine_control_init(void) {
+	sigset_t set;
+	control_signals(&set);
+	pthread_sigmask(SIG_BLOCK, &set, 0);
+}
+
+bool fine_control_wait(struct timespec const*const timeout) {
+	sigset_t set;
+	control_signals(&set);
+	int const sig = sigtimedwait(&set, 0, timeout);
+	if(sig < 0) return 0;
+	fine_log(INFO, "got %s, stopping", strsignal(sig));
+	return 1;
+}
+
+static uint64_t rss_bytes(void) {
+	FILE *const file = fopen("/proc/self/statm", "r");
+	if(!file) return 0;
+	unsigned long long size = 0, resident = 0;
+	int const ok = fscanf(file, "%llu %llu", &size, &resident) == 2;
+	fclose(file);
+	return ok ? resident*sysconf(_SC_PAGESIZE) : 0;
+}
+
+static void stats_device(Out *const o, AudioDev *const dev, char const*const what) {
+	DevStatus st;
+	if(fine_audio_dev_status(dev, &st) < 0) return;
+	out_printf(o, "fine_device_frames_total{dev=\"%s\"} %" PRIu64 "\n", what, st.frames);
+	out_printf(o, "fine_device_xruns_total{dev=\"%s\"} %" PRIu64 "\n", what, st.xruns);
+	out_printf(o, "fine_device_lost_frames_total{dev=\"%s\"} %" PRIu64 "\n", what, st.lost_frames);
+	out_printf(o, "fine_device_short_io_total{dev=\"%s\"} %" PRIu64 "\n", what, st.short_io);
+	out_printf(o, "fine_device_delay_frames{dev=\"%s\"} %ld\n", what, st.delay);
+	out_printf(o, "fine_device_min_delay_frames{dev=\"%s\"} %ld\n", what, st.min_delay);
+	out_printf(o, "fine_device_max_delay_frames{dev=\"%s\"} %ld\n", what, st.max_delay);
+	out_printf(o, "fine_device_avail_frames{dev=\"%s\"} %ld\n", what, st.avail);
+	out_printf(o, "fine_device_drift_ppm{dev=\"%s\"} %.1f\n", what, st.drift_ppm);
+	out_printf(o, "fine_device_interval_drift_ppm{dev=\"%s\"} %.1f\n", what, st.interval_drift_ppm);
+}
+
+static void stats(Control *const c, Out *const o) {
+	ASys *const sys = c->sys;
+	mtx_lock(&sys->playback_mtx);
+	size_t const stored = sys->rec_csz;
+	mtx_unlock(&sys->playback_mtx);
+
+	out_printf(o, "fine_uptime_seconds %.1f\n", (fine_prof_now() - c->start_ns)*1e-9);
+	out_printf(o, "fine_recordings_total %" PRIu64 "\n", atomic_load_explicit(&sys->num_recordings, memory_order_relaxed));
+	out_printf(o, "fine_recordings_stored %zu\n", stored);
+	out_printf(o, "fine_collages_total %" PRIu64 "\n", atomic_load_explicit(&sys->num_collages, memory_order_relaxed));
+	for(int s = 0; s < FINE_NUM_STAGES; ++s) {
+		ProfStats st;
+		fine_prof_stats(s, &st);
+		if(!st.count) continue;
+		char const*const name = fine_prof_stage_name(s);
+		out_printf(o, "fine_stage_count{stage=\"%s\"} %" PRIu64 "\n", name, st.count);
+		out_printf(o, "fine_stage_seconds_total{stage=\"%s\"} %.6f\n", name, st.total_ns*1e-9);
+		out_printf(o, "fine_stage_seconds{stage=\"%s\",quantile=\"0.5\"} %.6f\n", name, st.p50_ns*1e-9);
+		out_printf(o, "fine_stage_seconds{stage=\"%s\",quantile=\"0.99\"} %.6f\n", name, st.p99_ns*1e-9);
+		out_printf(o, "fine_stage_max_seconds{stage=\"%s\"} %.6f\n", name, st.max_ns*1e-9);
+	}
+	for(size_t m = 0; m < sys->num_mics; ++m) {
+		Mic *const mic = sys->mics+m;
+		out_printf(o, "fine_input_recordings_total{dev=\"%s\"} %" PRIu64 "\n", mic->what,
+			atomic_load_explicit(&mic->num_recordings, memory_order_relaxed));
+		if(mic->in->aec) out_printf(o, "fine_input_echo_erle_db{dev=\"%s\"} %.1f\n", mic->what, fine_aec_erle(mic->in->aec));
+		stats_device(o, mic->in, mic->what);
+	}
+	for(size_t z = 0; z < sys->num_zones; ++z) stats_device(o, sys->zones[z].out, sys->zones[z].what);
+	out_printf(o, "fine_memory_recordings_bytes %zu\n", sizeof(Recording)*MAX_NUM_REC);
+	out_printf(o, "fine_memory_rss_bytes %" PRIu64 "\n", rss_bytes());
+}
+
+static void command(Control *const c, int const fd, char *const line) {
+	ASys *const sys = c->sys;
+	Out *const o = malloc(sizeof *o);
+	if(!o) return;
+	o->len = 0;
+	line[strcspn(line, "\r")] = 0;
+
+	if(!strcmp(line, "play")) {
+		mtx_lock(&sys->playback_mtx);
+		fine_thread_play(sys, 1);
+		mtx_unlock(&sys->playback_mtx);
+		out_printf(o, "ok\n");
+	}
+	else if(!strcmp(line, "stop")) {
+		fine_log(INFO, "stop from the control socket");
+		fine_thread_stop_everything(sys, 1);
+		out_printf(o, "ok, stopping\n");
+	}
+	else if(!strcmp(line, "reload")) {
+		atomic_store_explicit(&sys->reload, 1, memory_order_release);
+		out_printf(o, "ok, reloading after the next capture period\n");
+	}
+	else if(!strcmp(line, "stats")) {
+		stats(c, o);
+		out_printf(o, "ok\n");
+	}
+	else if(!strcmp(line, "help")) {
+		out_printf(o, "commands: play, stop, reload, stats, help\nok\n");
+	}
+	else if(*line) {
+		out_printf(o, "error: unknown command \"%s\", try help\n", line);
+	}
+	out_send(fd, o);
+	free(o);
+}
+
+//@return 0 once the client is gone
+static int client_read(Control *const c, Client *const cl) {
+	ssize_t const n = read(cl->fd, cl->line+cl->len, sizeof cl->line - 1 - cl->len);
+	if(n <= 0) return 0;
+	cl->len += n;
+	cl->line[cl->len] = 0;
+	char *nl;
+	while((nl = strchr(cl->line, '\n'))) {
+		*nl = 0;
+		command(c, cl->fd, cl->line);
+		cl->len -= nl+1 - cl->line;
+		memmove(cl->line, nl+1, cl->len+1);
+	}
+	if(cl->len == sizeof cl->line - 1) {
+		send(cl->fd, "error: line too long\n", 21, MSG_NOSIGNAL);
+		cl->len = 0;
+	}
+	return 1;
+}
+
+static int control_thread(void *ptr) {
+	Control *const c = ptr;
+	fine_prof_thread("control");
+	enum {WAKE, SIGNAL, LISTEN, FIRST_CLIENT};
+	struct pollfd fds[FIRST_CLIENT + CONTROL_MAX_CLIENTS];
+	while(1) {
+		fds[WAKE] = (struct pollfd){.fd = c->wake[0], .events = POLLIN};
+		fds[SIGNAL] = (struct pollfd){.fd = c->signal_fd, .events = POLLIN};
+		fds[LISTEN] = (struct pollfd){.fd = c->listen_fd, .events = POLLIN}; //ignored if -1
+		for(size_t i = 0; i < CONTROL_MAX_CLIENTS; ++i)
+			fds[FIRST_CLIENT+i] = (struct pollfd){.fd = c->clients[i].fd, .events = POLLIN};
+
+		if(poll(fds, FIRST_CLIENT + CONTROL_MAX_CLIENTS, -1) < 0) continue; //EINTR
+		if(fds[WAKE].revents) break;
+
+		if(fds[SIGNAL].revents) {
+			struct signalfd_siginfo info;
+			if(read(c->signal_fd, &info, sizeof info) == sizeof info) {
+				fine_log(INFO, "got %s, stopping", strsignal(info.ssi_signo));
+				fine_thread_stop_everything(c->sys, 1);
+			}
+		}
+		if(fds[LISTEN].revents) {
+			int const fd = accept(c->listen_fd, 0, 0);
+			Client *free_cl = 0;
+			for(size_t i = 0; i < CONTROL_MAX_CLIENTS && !free_cl; ++i) {
+				if(c->clients[i].fd < 0) free_cl = c->clients+i;
+			}
+			if(fd >= 0 && free_cl) *free_cl = (Client){.fd = fd};
+			else if(fd >= 0) {
+				send(fd, "error: too many clients\n", 24, MSG_NOSIGNAL);
+				close(fd);
+			}
+		}
+		for(size_t i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+			Client *const cl = c->clients+i;
+			if(cl->fd >= 0 && fds[FIRST_CLIENT+i].revents && !client_read(c, cl)) {
+				close(cl->fd);
+				cl->fd = -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int open_socket(char const*const path) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if(strlen(path) >= sizeof addr.sun_path) {
+		fine_log(WARN, "control socket path %s is too long", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	int const fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) return -1;
+	unlink(path); //left over from a crash
+	if(bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, CONTROL_MAX_CLIENTS) < 0) {
+		fine_log(WARN, "control socket %s can't be opened, only signals stop the program", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+Control *fine_control_start(ASys *const sys) {
+	Control *const c = calloc(1, sizeof *c);
+	if(!c) fine_exit("Could not allocate the control endpoint");
+	c->sys = sys;
+	c->start_ns = fine_prof_now();
+	for(size_t i = 0; i < CONTROL_MAX_CLIENTS; ++i) c->clients[i].fd = -1;
+
+	sigset_t set;
+	control_signals(&set);
+	if((c->signal_fd = signalfd(-1, &set, SFD_CLOEXEC)) < 0 || pipe(c->wake) < 0)
+		fine_exit("Could not set up the control thread");
+
+	char const*const env = getenv("FINE_CONTROL");
+	snprintf(c->path, sizeof c->path, "%s", env && *env ? env : "fine.sock");
+	c->listen_fd = open_socket(c->path);
+
+	if(thrd_create(&c->thrd, control_thread, c) != thrd_success) fine_exit("Could not start the control thread");
+	if(c->listen_fd >= 0) fine_log(INFO, "control socket %s is ready", c->path);
+	return c;
+}
+
+void fine_control_stop(Control *const c) {
+	if(write(c->wake[1], "", 1) < 0) fine_log(WARN, "Could not wake the control thread");
+	thrd_join(c->thrd, 0);
+	for(size_t i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+		if(c->clients[i].fd >= 0) close(c->clients[i].fd);
+	}
+	if(c->listen_fd >= 0) {
+		close(c->listen_fd);
+		unlink(c->path);
+	}
+	close(c->signal_fd);
+	close(c->wake[0]);
+	close(c->wake[1]);
+	free(c);
+}
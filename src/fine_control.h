@@ -0,0 +1,30 @@
+#pragma once
+#include "fine_definitions.h"
+#include <time.h>
+
+/*
+ * Control and metrics endpoint for running headless under a supervisor.
+ * A Unix socket (FINE_CONTROL, default fine.sock) takes one command per line and answers it:
+ *  - play: play a collage now
+ *  - stop: fade out and shut down, like SIGTERM and SIGINT
+ *  - reload: replace the recordings with the files in the data dir
+ *  - stats: counters, stage histograms, device health and memory use in the Prometheus text format, ends with "ok"
+ *  - help
+ * e.g. echo stats | socat - UNIX-CONNECT:fine.sock
+ * One thread serves it with poll(), it sleeps until a client, a signal or fine_control_stop wakes it.
+ * Shutting down goes through fine_thread_stop_everything, so all threads end and can be joined.
+ * */
+
+typedef struct Control Control;
+
+//Blocks SIGTERM and SIGINT, so only the control thread takes them. Must be called before any other thread is started.
+void fine_control_init(void);
+
+//Waits up to timeout for SIGTERM or SIGINT before fine_control_start, e.g. between retries. @return whether one came
+bool fine_control_wait(struct timespec const* timeout);
+
+//Starts the control thread, exits if it can't: the signals would be lost. Without the socket (logged) it still handles them.
+Control *fine_control_start(ASys *sys);
+
+//Ends the control thread and removes the socket
+void fine_control_stop(Control *ctrl);
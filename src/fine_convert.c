@@ -0,0 +1,259 @@
+#include "fine_convert.h"
+#include "fine_audio_io.h"
+#include "fine_kernel.h"
+#include "fine_log.h"
+#include "p99/p99.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define CONVERT_TAPS 32 //FIR length per phase, in input samples
+#define CONVERT_MAX_PHASES 1024
+#define CONVERT_CUTOFF 0.92 //of the Nyquist frequency of the lower rate
+#define CONVERT_KAISER_BETA 8.0 //about 80 dB stopband
+/* --- END DEFINITIONS FOR TUNING --- */
+
+#define CENTER (CONVERT_TAPS/2 - 1) //the output lies between this tap and the next one
+
+struct Convert {
+	int format;
+	unsigned channels;
+	unsigned engine_channels; //1 for capture
+	unsigned rate; //of the device
+	size_t frame_bytes;
+
+	//Resampler from in_rate to out_rate. Samples are floats at the scale of i16
+	uint64_t in_rate;
+	uint64_t out_rate;
+	size_t num_phases;
+	float *coeffs; //num_phases+1 rows of CONVERT_TAPS, row p is the output p/num_phases past the center
+	float *hist[MAX_CHANNELS]; //input, one per engine channel, the FIR window of the next output starts at hist[][start]
+	size_t hist_sz;
+	size_t hist_cap;
+	size_t start;
+	uint64_t rem; //the next output lies rem/out_rate past the center of its window
+	float *tmp[MAX_CHANNELS]; //resampled, before it is packed
+	size_t tmp_cap;
+};
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+	while(b) {
+		uint64_t const t = a%b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+//Modified Bessel function of the first kind, order 0, for the Kaiser window
+static double bessel_i0(double const x) {
+	double sum = 1, term = 1;
+	for(int k = 1; k < 50 && term > 1e-12*sum; ++k) {
+		term *= (x/(2*k))*(x/(2*k));
+		sum += term;
+	}
+	return sum;
+}
+
+//Windowed sinc, every row sums to 1
+static void design(Convert *const c) {
+	double const fc = CONVERT_CUTOFF*P99_MINOF(1.0, (double)c->out_rate/c->in_rate);
+	for(size_t p = 0; p <= c->num_phases; ++p) {
+		float *const row = c->coeffs + p*CONVERT_TAPS;
+		double sum = 0;
+		for(size_t t = 0; t < CONVERT_TAPS; ++t) {
+			double const d = (double)t - CENTER - (double)p/c->num_phases;
+			double const x = d/(CONVERT_TAPS/2);
+			double const win = fabs(x) < 1 ? bessel_i0(CONVERT_KAISER_BETA*sqrt(1 - x*x))/bessel_i0(CONVERT_KAISER_BETA) : 0;
+			double const sinc = d == 0 ? 1 : sin(M_PI*fc*d)/(M_PI*fc*d);
+			row[t] = sinc*win;
+			sum += row[t];
+		}
+		for(size_t t = 0; t < CONVERT_TAPS; ++t) row[t] /= sum;
+	}
+}
+
+//All num planes get room for need samples
+static void grow(float **const planes, size_t const num, size_t *const cap, size_t const need) {
+	if(need <= *cap) return;
+	size_t const cap_new = P99_MAXOF(need, 2 * *cap);
+	for(size_t e = 0; e < num; ++e) {
+		float *const grown = realloc(planes[e], cap_new*sizeof *grown);
+		if(!grown) fine_exit("Could not allocate conversion buffers");
+		planes[e] = grown;
+	}
+	*cap = cap_new;
+}
+
+Convert *fine_convert_create(int const format, unsigned const channels, unsigned const rate, int const dir,
+	unsigned const engine_channels) {
+	assert(engine_channels >= 1 && engine_channels <= MAX_CHANNELS);
+	if(format == FINE_FMT_S16 && channels == engine_channels && rate == SAMPLE_RATE) return 0;
+	Convert *const c = calloc(1, sizeof *c);
+	if(!c) fine_exit("Could not allocate a converter");
+	static size_t const sample_bytes[] = {[FINE_FMT_S16] = 2, [FINE_FMT_S24] = 4, [FINE_FMT_S24_3] = 3, [FINE_FMT_S32] = 4, [FINE_FMT_FLOAT] = 4};
+	c->format = format;
+	c->channels = channels;
+	c->engine_channels = engine_channels;
+	c->rate = rate;
+	c->frame_bytes = sample_bytes[format]*channels;
+	if(rate == SAMPLE_RATE) return c;
+
+	c->in_rate = dir == FINE_CAPTURE ? rate : SAMPLE_RATE;
+	c->out_rate = dir == FINE_CAPTURE ? SAMPLE_RATE : rate;
+	c->num_phases = c->out_rate/gcd(c->in_rate, c->out_rate);
+	if(c->num_phases > CONVERT_MAX_PHASES) {
+		fine_log(INFO, "resampling %u Hz needs %zu phases, using the nearest of %d", rate, c->num_phases, CONVERT_MAX_PHASES);
+		c->num_phases = CONVERT_MAX_PHASES;
+	}
+	c->coeffs = malloc((c->num_phases+1)*CONVERT_TAPS*sizeof *c->coeffs);
+	if(!c->coeffs) fine_exit("Could not allocate a converter");
+	design(c);
+	//silence before the first sample, so the first output is centered on it
+	grow(c->hist, engine_channels, &c->hist_cap, CENTER);
+	for(unsigned e = 0; e < engine_channels; ++e) memset(c->hist[e], 0, CENTER*sizeof *c->hist[e]);
+	c->hist_sz = CENTER;
+	return c;
+}
+
+void fine_convert_destroy(Convert *const c) {
+	if(!c) return;
+	free(c->coeffs);
+	for(unsigned e = 0; e < c->engine_channels; ++e) {
+		free(c->hist[e]);
+		free(c->tmp[e]);
+	}
+	free(c);
+}
+
+size_t fine_convert_frame_bytes(Convert const*const c) { return c->frame_bytes; }
+bool fine_convert_resamples(Convert const*const c) { return c->rate != SAMPLE_RATE; }
+size_t fine_convert_to_device(Convert const*const c, size_t const n) { return (uint64_t)n*c->rate/SAMPLE_RATE; }
+size_t fine_convert_to_engine(Convert const*const c, size_t const n) { return (uint64_t)n*SAMPLE_RATE/c->rate; }
+
+static float sat(float const x) {
+	return x >= INT16_MAX ? INT16_MAX : x <= INT16_MIN ? INT16_MIN : roundf(x);
+}
+
+static double clamp(double const x, double const lo, double const hi) {
+	return x < lo ? lo : x > hi ? hi : x;
+}
+
+//The average of the channels of n frames, appended to hist. Host byte order is little endian, like the formats
+static void unpack(Convert *const c, void const*const raw, size_t const n) {
+	grow(c->hist, 1, &c->hist_cap, c->hist_sz + n);
+	float *const out = c->hist[0] + c->hist_sz;
+	unsigned char const* p = raw;
+	float const scale = 1.0f/c->channels;
+	for(size_t i = 0; i < n; ++i) {
+		float sum = 0;
+		for(unsigned ch = 0; ch < c->channels; ++ch) {
+			int32_t v;
+			float f;
+			switch(c->format) {
+				case FINE_FMT_S16: { int16_t s; memcpy(&s, p, 2); sum += s; p += 2; break; }
+				case FINE_FMT_S24: memcpy(&v, p, 4); sum += ((int32_t)((uint32_t)v << 8) >> 8)/256.0f; p += 4; break;
+				case FINE_FMT_S24_3: v = p[0] | p[1] << 8 | (uint32_t)p[2] << 16; sum += ((int32_t)((uint32_t)v << 8) >> 8)/256.0f; p += 3; break;
+				case FINE_FMT_S32: memcpy(&v, p, 4); sum += v/65536.0f; p += 4; break;
+				case FINE_FMT_FLOAT: memcpy(&f, p, 4); sum += f*32768.0f; p += 4; break;
+			}
+		}
+		out[i] = sum*scale;
+	}
+	c->hist_sz += n;
+}
+
+/* Engine channel e of in[e][i] to device channel ch: with at least as many device channels the engine
+ * channels repeat over them (mono to all), with fewer the engine channels are averaged into them. */
+static double spread(Convert const*const c, float *const*const in, size_t const i, unsigned const ch) {
+	if(c->engine_channels <= c->channels) return in[ch % c->engine_channels][i];
+	double sum = 0;
+	unsigned num = 0;
+	for(unsigned e = ch; e < c->engine_channels; e += c->channels, ++num) sum += in[e][i];
+	return sum/num;
+}
+
+//n frames of in, one plane per engine channel, to n device frames
+static void pack(Convert const*const c, void *const raw, float *const*const in, size_t const n) {
+	unsigned char *p = raw;
+	for(size_t i = 0; i < n; ++i) {
+		int32_t v;
+		int16_t s;
+		float f;
+		for(unsigned ch = 0; ch < c->channels; ++ch) {
+			double const x = spread(c, in, i, ch);
+			switch(c->format) {
+				case FINE_FMT_S16: s = sat(x); memcpy(p, &s, 2); p += 2; break;
+				case FINE_FMT_S24: v = lrint(clamp(x*256, -8388608, 8388607)); memcpy(p, &v, 4); p += 4; break;
+				case FINE_FMT_S24_3: v = lrint(clamp(x*256, -8388608, 8388607)); p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p += 3; break;
+				case FINE_FMT_S32: v = lrint(clamp(x*65536, INT32_MIN, INT32_MAX)); memcpy(p, &v, 4); p += 4; break;
+				case FINE_FMT_FLOAT: f = x/32768; memcpy(p, &f, 4); p += 4; break;
+			}
+		}
+	}
+}
+
+//Makes up to max outputs of every engine channel from hist into c->tmp. @return their number
+static size_t resample(Convert *const c, size_t const max) {
+	unsigned const num = c->engine_channels;
+	grow(c->tmp, num, &c->tmp_cap, max);
+	size_t k = 0;
+	while(k < max && c->start + CONVERT_TAPS <= c->hist_sz) {
+		size_t const p = (c->rem*c->num_phases + c->out_rate/2)/c->out_rate;
+		for(unsigned e = 0; e < num; ++e) {
+			c->tmp[e][k] = fine_kernels->dot(c->hist[e] + c->start, c->coeffs + p*CONVERT_TAPS, CONVERT_TAPS);
+		}
+		++k;
+		c->rem += c->in_rate;
+		c->start += c->rem/c->out_rate;
+		c->rem %= c->out_rate;
+	}
+	//only what the next windows read stays
+	size_t const keep = c->hist_sz - P99_MINOF(c->start, c->hist_sz);
+	for(unsigned e = 0; e < num; ++e) memmove(c->hist[e], c->hist[e] + c->hist_sz - keep, keep*sizeof *c->hist[e]);
+	c->start -= c->hist_sz - keep;
+	c->hist_sz = keep;
+	return k;
+}
+
+size_t fine_convert_need(Convert const*const c, size_t const n) {
+	if(!fine_convert_resamples(c) || !n) return n;
+	//window start of the last of the n outputs
+	uint64_t const last = c->start + (c->rem + (n-1)*c->in_rate)/c->out_rate;
+	return last + CONVERT_TAPS > c->hist_sz ? last + CONVERT_TAPS - c->hist_sz : 0;
+}
+
+size_t fine_convert_in(Convert *const c, i16 *const out, size_t const max, void const*const raw, size_t const n) {
+	unpack(c, raw, n);
+	if(!fine_convert_resamples(c)) {
+		for(size_t i = 0; i < n; ++i) out[i] = sat(c->hist[0][i]);
+		c->hist_sz = 0;
+		return n;
+	}
+	size_t const k = resample(c, max);
+	for(size_t i = 0; i < k; ++i) out[i] = sat(c->tmp[0][i]);
+	return k;
+}
+
+size_t fine_convert_max_out(Convert const*const c, size_t const n) {
+	return fine_convert_resamples(c) ? fine_convert_to_device(c, n) + 2 : n;
+}
+
+size_t fine_convert_out(Convert *const c, void *const raw, i16 const*const in, size_t const n) {
+	unsigned const num = c->engine_channels;
+	grow(c->hist, num, &c->hist_cap, c->hist_sz + n);
+	for(size_t i = 0; i < n; ++i) {
+		for(unsigned e = 0; e < num; ++e) c->hist[e][c->hist_sz+i] = in[i*num + e];
+	}
+	c->hist_sz += n;
+	if(!fine_convert_resamples(c)) {
+		pack(c, raw, c->hist, n);
+		c->hist_sz = 0;
+		return n;
+	}
+	size_t const k = resample(c, fine_convert_max_out(c, n));
+	pack(c, raw, c->tmp, k);
+	return k;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "fine_definitions.h"
+
+/*
+ * Adapts a device to the engine, which always runs at SAMPLE_RATE, 16 bit, mono for capture and 1 to MAX_CHANNELS
+ * interleaved channels for playback (fine_mix.h).
+ * On the device side the samples can be S16, S24 (in 32 bits), S24_3 (packed), S32 or FLOAT, little endian,
+ * with any number of channels: capture averages them into mono. Playback repeats the engine channels over
+ * the device channels (mono to all of them), or averages engine channel e into device channel e % channels
+ * if the device has fewer. Every engine channel is resampled on its own.
+ * Other rates go through a polyphase windowed-sinc resampler. Its phases are exact for every ratio with
+ * at most CONVERT_MAX_PHASES phases (all the usual ones: 44.1, 32, 96 kHz...), others take the nearest phase.
+ * The FIR is the dot kernel (fine_kernel.h).
+ * */
+
+enum {FINE_FMT_S16, FINE_FMT_S24, FINE_FMT_S24_3, FINE_FMT_S32, FINE_FMT_FLOAT};
+
+typedef struct Convert Convert;
+
+/* dir: FINE_CAPTURE or FINE_PLAYBACK
+ * engine_channels: of the engine frames, 1 for capture
+ * @return 0 if the device already takes SAMPLE_RATE S16 frames of engine_channels
+ * */
+Convert *fine_convert_create(int format, unsigned channels, unsigned rate, int dir, unsigned engine_channels);
+void fine_convert_destroy(Convert *c);
+
+//@return bytes of one device frame
+size_t fine_convert_frame_bytes(Convert const* c);
+
+//@return whether the rate is converted, so device frames and engine frames don't match one to one
+bool fine_convert_resamples(Convert const* c);
+
+//@return device frames that make up n engine frames, about
+size_t fine_convert_to_device(Convert const* c, size_t n);
+size_t fine_convert_to_engine(Convert const* c, size_t n);
+
+//Capture: @return how many device frames fine_convert_in needs to make n engine frames
+size_t fine_convert_need(Convert const* c, size_t n);
+
+/* Capture: converts n device frames from raw and makes up to max engine frames into out, n without resampling.
+ * What is left makes the next ones. @return the number of engine frames */
+size_t fine_convert_in(Convert *c, i16 *out, size_t max, void const* raw, size_t n);
+
+//Playback: @return the most device frames fine_convert_out makes from n engine frames
+size_t fine_convert_max_out(Convert const* c, size_t n);
+
+//Playback: converts n engine frames from in to device frames in raw. @return their number
+size_t fine_convert_out(Convert *c, void *raw, i16 const* in, size_t n);
@@ -1,51 +1,127 @@
 #pragma once
 #include <stdint.h>
-#include <alsa/asoundlib.h>
+#include <stddef.h>
 #include <threads.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 typedef int16_t i16;
 
 typedef struct ASys ASys;
 typedef struct ASys_params ASys_params;
 typedef struct Recording Recording;
+typedef struct Selector Selector;
+typedef struct AudioDev AudioDev;
+typedef struct Zone Zone;
+typedef struct Mic Mic;
+typedef struct Published Published;
+typedef struct EchoRef EchoRef;
+typedef struct Vad Vad;
 #define SAMPLE_RATE 48000
 #define RECORDING_SIZE (SAMPLE_RATE*4) //Max recording length is 4 seconds
 #define IDLE_BUFSZ SAMPLE_RATE
 #define MAX_NUM_REC 512
+#define MAX_CHANNELS 8 //of the output, frames are interleaved
+#define MAX_ZONES 8 //output devices, each plays its own collages from the shared recordings
+#define MAX_INPUTS 8 //capture devices, each records into the shared recordings on its own trigger
+#define PUBLISH_QUEUE 64 //recordings published by the inputs that the selector has not taken yet, a power of 2
 #define OPT_NUM_RECORDINGS 10
+#define CLIP_CACHE_BYTES (64*1024*1024) //processed clips kept between collages
+#define STREAM_AHEAD_MS 2000 //the next collage is asked for this long before the playing one ends, rendering it must take less
 struct Recording {
 	size_t sz;
+	_Atomic(uint32_t) gen; //bumped before and after the slot is overwritten, odd while it is written. See fine_gen_unchanged
+	unsigned mic; //the input that recorded it, 0 for the files loaded from data
 	i16 data[RECORDING_SIZE];
 };
-struct ASys {
-
-	/*only the input thread will access idx, csz, next_rec_addr, and dereference idle_buf*/
+/* Like a seqlock: whether a recording read after its gen was seen was neither overwritten since nor being written then.
+ * Called after reading its samples, with seen from before
+ * */
+inline bool fine_gen_unchanged(_Atomic(uint32_t) const*const gen, uint32_t const seen) {
+	atomic_thread_fence(memory_order_acquire);
+	return !(seen & 1) && atomic_load_explicit(gen, memory_order_relaxed) == seen;
+}
+/* An output device and the thread that plays collages on it (fine_thread_output). The render state
+ * (clip cache, reverb, voices or grains, random numbers) is the thread's own, rec_arr and the selector are shared.
+ * */
+struct Zone {
+	ASys *sys;
+	size_t idx; //collage n of zone z is drawn from seed base_seed+n*num_zones+z
+	char what[16]; //"output", then "output1", "output2"... for the logs and stats
+	AudioDev *out;
+	_Atomic(bool) play; //set true / false by the input thread, read and, with voices or grains, cleared by the output thread
+	/* When the newest recording the selector took was published, 0 once a collage that can draw it took it.
+	 * Protected by playback_mtx, set by fine_thread_apply_published
+	 * */
+	uint64_t published_ns;
+};
+/* A capture device and the thread that records from it (fine_thread_input_idle), with its own trigger.
+ * Every input claims the slot of its next recording ahead of time, so no two of them write to the same one,
+ * and the selector never draws it.
+ * */
+struct Mic {
+	ASys *sys;
+	size_t idx;
+	char what[16]; //"input", then "input1", "input2"... for the logs and stats
+	AudioDev *in;
+	//only its thread accesses idle_buf_idx and dereferences idle_buf, the pre-roll of a recording
 	size_t idle_buf_idx;
-	size_t idle_buf_csz;
-	i16 *const idle_buf;
+	i16 *idle_buf;
+	int thresh_upper; //envelope that starts a recording, see FINE_THRESHOLDS
+	int thresh_lower; //and ends it
+	Vad *vad; //starts and ends recordings instead of the envelope if set, see FINE_VAD
+	_Atomic(size_t) slot; //claimed for the next recording. Written by its thread with store_lock held
+	_Atomic(uint64_t) num_recordings;
+};
+//A recording on its way to the selector, a cell of the lock-free queue in ASys
+struct Published {
+	_Atomic(size_t) seq; //the position the cell can be written at, +1 once written
+	size_t slot;
+	size_t claimed; //the next slot of the input, it is removed from the selector
+	float loudness;
+	uint64_t ns; //when it was queued, fine_prof_now
+};
+struct ASys {
 
 	mtx_t fread_mtx;
 	cnd_t fread;
 
 	mtx_t playback_mtx;
-	cnd_t playback;
-	_Atomic(bool) play; //set true /false by input thread, read by output thread.
+	cnd_t playback; //broadcast to all zones
 
 	_Atomic(bool) fade_out; 
 	/* Protected by mtx-- Output thread will unlock until signaled playback
 	 * Input thread captures mtx when playback ends AND input finishes. Then, output captures mtx to compute effects and playback
 	 * */
 	size_t rec_csz;
-	size_t rec_idx;
-	//NOTE: the very last recording(the max_rec_num place, if it were a queue) is not to be read
-	//and only to be written by the input thread
+	size_t rec_idx; //one after the newest slot the selector took
+	_Atomic(size_t) rec_next; //the inputs claim slots rec_next % MAX_NUM_REC, one after the other
+	//NOTE: the slots claimed by the inputs (Mic.slot) are not to be read and only to be written by their input
 	Recording *const rec_arr; //Each recording has the max possible size. Make sure this fits into 256MB
+	Selector *selector; //weights of the recordings in rec_arr. Protected by playback_mtx, a reload replaces it
+	/* The inputs publish into this queue without taking a lock, so they never wait behind playback_mtx or
+	 * each other. fine_thread_apply_published moves what is queued into the selector, with playback_mtx held
+	 * */
+	Published published[PUBLISH_QUEUE];
+	_Atomic(size_t) published_tail;
+	size_t published_head; //protected by playback_mtx
+	//read locked by the output threads while they render from rec_arr and by the inputs while they record into it,
+	//write locked by a reload of the whole store
+	pthread_rwlock_t store_lock;
+	_Atomic(bool) reload; //set by the control thread, one of the input threads reloads the data dir
+
+	Zone *const zones;
+	size_t const num_zones;
+	uint64_t const base_seed; //FINE_SEED or drawn once, shared by the zones
+	Mic *const mics;
+	size_t const num_mics;
+	_Atomic(size_t) mics_running; //inputs that have not ended yet, the last one stops everything
+	_Atomic(size_t) last_publisher; //the input that published last, it ends the chance to play
+	EchoRef *echo; //what the first zone plays, the inputs cancel its echo. 0 without echo cancellation, see fine_aec.h
 
-	snd_pcm_hw_params_t *const hw_out;
-	snd_pcm_hw_params_t *const hw_in;
-	snd_pcm_t *const pcm_out;
-	snd_pcm_t *const pcm_in;
+	_Atomic(uint64_t) num_recordings; //made since the start
+	_Atomic(uint64_t) num_collages; //played since the start, by all zones
 
 	_Atomic(bool) stopped;
 };
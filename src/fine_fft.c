@@ -0,0 +1,81 @@
+#include "fine_fft.h"
+#include "fine_kernel.h"
+#include "fine_log.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+struct Fft {
+	size_t n;
+	size_t num_swaps;
+	uint32_t (*swaps)[2]; //pairs of the bit reversal
+	//the twiddles of the pass with half butterflies per group start at half-1: exp(-i*pi*k/half), k < half
+	float *twr;
+	float *twi;
+};
+
+Fft *fine_fft_create(size_t const n) {
+	assert(n >= 2 && !(n & (n-1)) && n <= UINT32_MAX);
+	Fft *const f = malloc(sizeof *f);
+	if(!f) fine_exit("Could not allocate the FFT tables");
+	*f = (Fft){
+		.n = n,
+		.swaps = malloc(n/2*sizeof *f->swaps),
+		.twr = malloc((n-1)*sizeof *f->twr),
+		.twi = malloc((n-1)*sizeof *f->twi),
+	};
+	if(!f->swaps || !f->twr || !f->twi) fine_exit("Could not allocate the FFT tables");
+
+	unsigned const bits = __builtin_ctzll(n);
+	for(size_t i = 0; i < n; ++i) {
+		size_t r = 0;
+		for(unsigned b = 0; b < bits; ++b) r |= ((i >> b) & 1) << (bits-1-b);
+		if(i < r) {
+			f->swaps[f->num_swaps][0] = i;
+			f->swaps[f->num_swaps][1] = r;
+			++f->num_swaps;
+		}
+	}
+	for(size_t half = 1; half < n; half *= 2) {
+		for(size_t k = 0; k < half; ++k) {
+			double const a = -M_PI*k/half;
+			f->twr[half-1+k] = cos(a);
+			f->twi[half-1+k] = sin(a);
+		}
+	}
+	return f;
+}
+
+void fine_fft_destroy(Fft *const f) {
+	if(!f) return;
+	free(f->swaps);
+	free(f->twr);
+	free(f->twi);
+	free(f);
+}
+
+size_t fine_fft_size(Fft const*const f) {
+	return f->n;
+}
+
+void fine_fft_forward(Fft const*const f, float *const re, float *const im) {
+	for(size_t s = 0; s < f->num_swaps; ++s) {
+		uint32_t const a = f->swaps[s][0], b = f->swaps[s][1];
+		float const r = re[a], i = im[a];
+		re[a] = re[b];
+		im[a] = im[b];
+		re[b] = r;
+		im[b] = i;
+	}
+	for(size_t half = 1; half < f->n; half *= 2) fine_kernels->fft_pass(re, im, f->n, half, f->twr+half-1, f->twi+half-1);
+}
+
+//The forward transform with re and im swapped is the inverse one with them swapped, times n
+void fine_fft_inverse(Fft const*const f, float *const re, float *const im) {
+	fine_fft_forward(f, im, re);
+	float const scale = 1.0f/f->n;
+	for(size_t i = 0; i < f->n; ++i) {
+		re[i] *= scale;
+		im[i] *= scale;
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "fine_definitions.h"
+
+/*
+ * Complex FFT of a power of 2 size, in place on split re/im arrays.
+ * Radix 2, decimation in time: a bit reversal, then log2(n) passes of the fft_pass kernel (fine_kernel.h),
+ * so every pass with at least a vector of butterflies per group runs on vectors.
+ * NOTE: the tables are only read, one Fft can be shared by threads.
+ * */
+typedef struct Fft Fft;
+
+//n: a power of 2, at least 2
+Fft *fine_fft_create(size_t n);
+void fine_fft_destroy(Fft *f);
+size_t fine_fft_size(Fft const* f);
+
+//Not normalized
+void fine_fft_forward(Fft const* f, float *re, float *im);
+//Scaled by 1/n, so it undoes fine_fft_forward
+void fine_fft_inverse(Fft const* f, float *re, float *im);
@@ -13,4 +13,14 @@ void fine_fx_compress(int16_t * data,
                       float  release_ms,
                       float  makeup_gain);
 
+//Exact but slow version of fine_fx_compress, for checking it
+void fine_fx_compress_ref(int16_t * data,
+                      size_t sz,
+                      unsigned sample_rate,
+                      float  threshold,
+                      float  ratio,
+                      float  attack_ms,
+                      float  release_ms,
+                      float  makeup_gain);
+
 void fine_fx_fade_linear(i16 *data, size_t sz, size_t in, size_t out);
@@ -17,6 +17,11 @@
 #include <stddef.h>
 #include <math.h>
 
+#include "fine_kernel.h"
+#include "fine_log.h"
+#include "p99/p99.h"
+#include <stdlib.h>
+
 #ifndef M_EPSILON_F
 #define M_EPSILON_F 1e-12f
 #endif
@@ -40,7 +45,9 @@ static inline float ms_to_coeff(float ms, unsigned sample_rate)
 // attack_ms   : attack time in milliseconds
 // release_ms  : release time in milliseconds
 // makeup_gain : linear multiplier applied to output (1.0 = no make-up)
-void fine_fx_compress(int16_t * const data,
+//
+// Reference version: exact per-sample gain with powf. Kept to check fine_fx_compress against.
+void fine_fx_compress_ref(int16_t * const data,
                       size_t const sz,
                       unsigned const sample_rate,
                       float const threshold,
@@ -129,3 +136,105 @@ void fine_fx_compress(int16_t * const data,
     }
 }
 
+
+// --- Fast version ---
+//
+// Same envelope follower as the reference, but the gain computer runs at control rate:
+// once every COMPRESS_BLOCK samples, in the log2 domain, with polynomial log2/exp2.
+// The smoothed gain is ramped linearly across the block by the ramp kernel (fine_kernel.h),
+// which runs on vectors.
+//
+// Tolerance: with the settings render_recordings uses (threshold 4000, ratio 10,
+// attack 3 ms, release 80 ms, after 6-16x amplification) the output stays within
+// 0.5 dB of fine_fx_compress_ref wherever the reference is above -60 dBFS.
+
+#define COMPRESS_BLOCK 16
+
+// log2 for x > 0: exponent from the float bits, 4th order polynomial for the mantissa.
+// |error| < 1.1e-4
+static inline float fast_log2(float x)
+{
+    union { float f; uint32_t u; } v = { x };
+    const float e = (float)((int32_t)(v.u >> 23) - 127);
+    v.u = (v.u & 0x007fffffu) | 0x3f800000u; // mantissa in [1, 2)
+    const float m = v.f - 1.0f;
+    return e + (((( -0.08001088f*m + 0.31546761f)*m - 0.67293419f)*m + 1.43730217f)*m + 0.00010019f);
+}
+
+// 2^x for x in [-126, 0]: exponent bits from the integer part, 4th order polynomial for the rest.
+// relative error < 4e-6
+static inline float fast_exp2(float x)
+{
+    if (x < -126.0f) x = -126.0f;
+    const float fl = floorf(x);
+    const float f = x - fl;
+    union { float f; uint32_t u; } v;
+    v.f = (((0.01368398f*f + 0.05171774f)*f + 0.24162132f)*f + 0.69296955f)*f + 1.00000360f;
+    v.u += (uint32_t)((int32_t)fl) << 23;
+    return v.f;
+}
+
+void fine_fx_compress(int16_t * const data,
+                      size_t const sz,
+                      unsigned const sample_rate,
+                      float const threshold,
+                      float const ratio,
+                      float const attack_ms,
+                      float const release_ms,
+                      float const makeup_gain)
+{
+    if (!data || sz == 0 || sample_rate == 0) return;
+
+    // Bypass is the same as the reference (just makeup gain)
+    if (ratio <= 1.000001f || threshold <= 0.0f) {
+        fine_fx_compress_ref(data, sz, sample_rate, threshold, ratio, attack_ms, release_ms, makeup_gain);
+        return;
+    }
+
+    const float attack_coeff = ms_to_coeff(attack_ms, sample_rate);
+    const float release_coeff = ms_to_coeff(release_ms, sample_rate);
+
+    const float attack_minus_release = attack_coeff - release_coeff;
+
+    // The gain smoother only steps once per block
+    const float attack_block = powf(attack_coeff, COMPRESS_BLOCK);
+    const float release_block = powf(release_coeff, COMPRESS_BLOCK);
+
+    const float k = 1.0f - 1.0f / ratio;
+    const float log2_threshold = fast_log2(threshold);
+
+    // gains[b] is the gain at the start of block b, makeup included
+    const size_t num_blocks = (sz + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+    float * const gains = malloc((num_blocks + 1) * sizeof *gains);
+    if (!gains) fine_exit("Could not allocate compressor gains");
+
+    float env = 0.0f;
+    float g_smoothed = 1.0f;
+    gains[0] = makeup_gain;
+
+    for (size_t b = 0; b < num_blocks; ++b) {
+        const int16_t * restrict p = data + b * COMPRESS_BLOCK;
+        const size_t len = P99_MINOF(sz - b * COMPRESS_BLOCK, (size_t)COMPRESS_BLOCK);
+
+        // envelope follower, per sample (serial). Same as c*env + (1-c)*absx with a shorter
+        // dependency chain, and c is picked without a branch (the branch mispredicts a lot on audio).
+        for (size_t i = 0; i < len; ++i) {
+            const float absx = fabsf((float)p[i]);
+            const float c = release_coeff + attack_minus_release * (float)(absx > env);
+            env = absx + c * (env - absx);
+        }
+
+        // gain computer, per block: gain = (env/threshold)^(-k) = 2^(-k*(log2(env) - log2(threshold)))
+        float gain = 1.0f;
+        if (env > threshold + M_EPSILON_F)
+            gain = fast_exp2(-k * (fast_log2(env) - log2_threshold));
+
+        const float c = gain < g_smoothed ? attack_block : release_block;
+        g_smoothed = c * g_smoothed + (1.0f - c) * gain;
+        gains[b + 1] = g_smoothed * makeup_gain;
+    }
+
+    // apply: linear gain ramp, clamp, round
+    fine_kernels->ramp(data, sz, COMPRESS_BLOCK, gains);
+    free(gains);
+}
@@ -1,7 +1,11 @@
 //NOTE: TRANSLATION OF FREEVERB BY GEMINI 
 #include "fine_fx_reverb.h"
+#include "fine_kernel.h"
 #include <string.h> // For memset
 
+// Samples per call of the comb bank, at most the shortest comb (combtuningL1)
+#define REVERB_BLOCK 256
+
 // --- Parameter constants from tuning.h ---
 //
 const float fixedgain     = 0.015f;
@@ -39,27 +43,6 @@ static void reverb_update(fine_reverb_model *rvb) {
     }
 }
 
-/**
- * @brief Processes one sample through a comb filter.
- * C translation of comb::process()
- */
-static inline float comb_process(comb_filter *c, float input) {
-    float output;
-
-    output = c->buffer[c->bufidx];
-    undenormalise(output); //
-
-    c->filterstore = (output * c->damp2) + (c->filterstore * c->damp1);
-    undenormalise(c->filterstore); //
-
-    c->buffer[c->bufidx] = input + (c->filterstore * c->feedback);
-
-    if (++(c->bufidx) >= c->bufsize) {
-        c->bufidx = 0;
-    }
-    return output;
-}
-
 /**
  * @brief Processes one sample through an allpass filter.
  * C translation of allpass::process()
@@ -157,46 +140,65 @@ void reverb_set_params(fine_reverb_model *rvb, float roomsize, float damp, float
 }
 
 void fine_fx_reverb(i16 *const data, size_t const sz, fine_reverb_model *rvb) {
-    
-    // Process sample by sample
-    for (size_t i = 0; i < sz; i++) {
-        
+    // The combs run as a kernel bank (comb::process() of every comb), a block at a time
+    float *bufs[NUM_COMBS], store[NUM_COMBS];
+    int32_t sizes[NUM_COMBS], idx[NUM_COMBS];
+    for (int j = 0; j < NUM_COMBS; j++) {
+        bufs[j] = rvb->combs[j].buffer;
+        sizes[j] = rvb->combs[j].bufsize;
+        idx[j] = rvb->combs[j].bufidx;
+        store[j] = rvb->combs[j].filterstore;
+    }
+    float input[REVERB_BLOCK], combs_out[REVERB_BLOCK];
+
+    for (size_t start = 0; start < sz; start += REVERB_BLOCK) {
+        const size_t n = sz - start < REVERB_BLOCK ? sz - start : REVERB_BLOCK;
+
         // --- 1. Convert i16 to float ---
         // Scale -32768..32767 to -1.0..1.0
-        const float in_sample = (float)data[i] * (1.0f / 32768.0f);
-        
-        float out_sample = 0.0f;
-        float input = in_sample * rvb->gain;
+        for (size_t i = 0; i < n; i++) {
+            input[i] = (float)data[start + i] * (1.0f / 32768.0f) * rvb->gain;
+        }
 
         // --- 2. Process Reverb Logic ---
         // Based on revmodel::processreplace()
-        
-        // Accumulate comb filters in parallel
-        for (int j = 0; j < NUM_COMBS; j++) {
-            out_sample += comb_process(&rvb->combs[j], input);
-        }
 
-        // Feed through allpasses in series
-        for (int j = 0; j < NUM_ALLPASSES; j++) {
-            out_sample = allpass_process(&rvb->allpasses[j], out_sample);
-        }
-
-        // --- 3. Mix wet and dry signals ---
-        // Mono equivalent of the stereo mix
-        out_sample = out_sample * rvb->wet_scaled + in_sample * rvb->dry_scaled;
-
-        // --- 4. Convert float to i16 ---
-        // Scale -1.0..1.0 to -32767..32767 (with saturation)
-        out_sample *= 32767.0f;
-
-        // Hard clipping
-        if (out_sample > 32767.0f) {
-            out_sample = 32767.0f;
-        } else if (out_sample < -32768.0f) {
-            out_sample = -32768.0f;
+        // Accumulate comb filters in parallel
+        memset(combs_out, 0, n * sizeof *combs_out);
+        fine_kernels->comb_bank(combs_out, input, n, bufs, sizes, idx, store, NUM_COMBS,
+            rvb->combs[0].feedback, rvb->combs[0].damp1, rvb->combs[0].damp2);
+
+        for (size_t i = 0; i < n; i++) {
+            const float in_sample = (float)data[start + i] * (1.0f / 32768.0f);
+            float out_sample = combs_out[i];
+
+            // Feed through allpasses in series
+            for (int j = 0; j < NUM_ALLPASSES; j++) {
+                out_sample = allpass_process(&rvb->allpasses[j], out_sample);
+            }
+
+            // --- 3. Mix wet and dry signals ---
+            // Mono equivalent of the stereo mix
+            out_sample = out_sample * rvb->wet_scaled + in_sample * rvb->dry_scaled;
+
+            // --- 4. Convert float to i16 ---
+            // Scale -1.0..1.0 to -32767..32767 (with saturation)
+            out_sample *= 32767.0f;
+
+            // Hard clipping
+            if (out_sample > 32767.0f) {
+                out_sample = 32767.0f;
+            } else if (out_sample < -32768.0f) {
+                out_sample = -32768.0f;
+            }
+
+            // Write back to the buffer
+            data[start + i] = (i16)out_sample;
         }
+    }
 
-        // Write back to the buffer
-        data[i] = (i16)out_sample;
+    for (int j = 0; j < NUM_COMBS; j++) {
+        rvb->combs[j].bufidx = idx[j];
+        rvb->combs[j].filterstore = store[j];
     }
 }
@@ -0,0 +1,325 @@
+#include "fine_grain.h"
+#include "fine_kernel.h"
+#include "fine_log.h"
+#include "fine_mix.h"
+#include "fine_prof.h"
+#include "fine_rand.h"
+#include "p99/p99.h"
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define GRAIN_BLOCK 256 //frames mixed at once, grains start anywhere inside one
+#define GRAIN_WIN_LEN 1024 //entries of a window table
+#define GRAIN_TUKEY 0.5f //share of a Tukey window that tapers, the rest is flat
+#define GRAIN_DENSITY 2000 //grains per second of a cloud
+#define GRAIN_JITTER 0.5 //the time between two grains varies by up to this share
+#define GRAIN_MIN_MS 20
+#define GRAIN_MAX_MS 200
+#define GRAIN_PITCH 7 //semitones a grain is shifted up or down at most
+#define GRAIN_SPREAD 0.25f //with more than one channel the grains of a clip spread this far around its pan
+#define GRAIN_CLOUD_FADE_MS 500 //grains at the start and end of a cloud are quieter
+#define GRAIN_FADE_MS 20 //fine_grain_fade_all
+#define GRAIN_MAX_CLOUDS 8 //a new cloud ends the oldest one beyond this
+#define GRAIN_PENDING 4 //clouds waiting to start
+#define GRAIN_CPU_BUDGET 0.5 //of the duration of the frames fine_grain_render makes
+#define GRAIN_MIN_DENSITY (1.0/64) //the budget never thins the clouds below this share
+/* --- END DEFINITIONS FOR TUNING --- */
+
+typedef struct Grain Grain;
+struct Grain {
+	i16 const* src; //the data of the recording, read in place
+	_Atomic(uint32_t) const* slot_gen;
+	uint32_t gen; //of the recording when the grain started
+	double pos; //next frame in src
+	float rate;
+	float gain;
+	float const* win;
+	float wpos; //next position in win
+	float wstep;
+	size_t delay; //frames of the current block before it starts
+	size_t left; //frames to play
+	float gains[MAX_CHANNELS]; //of its pan
+};
+
+typedef struct Cloud Cloud;
+struct Cloud {
+	Plan plan;
+	uint32_t gen[OPT_NUM_RECORDINGS]; //of the recording of each clip when the cloud was queued
+	size_t newest_rec_idx;
+	p99_seed seed;
+	uint64_t order; //the cloud with the lowest ends first
+	size_t pos; //frames since the cloud started
+	double next; //frame of the next grain, counted like pos
+	bool active;
+};
+
+typedef struct Pending Pending;
+struct Pending {
+	Plan plan;
+	uint32_t gen[OPT_NUM_RECORDINGS];
+	size_t newest_rec_idx;
+	uint64_t seed;
+	uint64_t published;
+};
+
+struct Grains {
+	size_t max_grains;
+	Recording const* recordings;
+	size_t channels; //of the frames it renders
+	Limiter lim;
+	float hann[GRAIN_WIN_LEN+2]; //one more entry than a grain reads, against rounding
+	float tukey[GRAIN_WIN_LEN+2];
+	float norm; //gain of a grain, so that the overlapping grains of a cloud add up to about one clip
+	double density; //share of GRAIN_DENSITY the CPU budget allows
+	float gain; //of the whole mix, ramps down by step after fine_grain_fade_all
+	float step;
+	uint64_t next_order;
+	float *mixed; //frames, grows to the largest n of fine_grain_render
+	size_t mixed_sz;
+	float mono[GRAIN_BLOCK]; //a grain before it is panned
+	_Atomic(bool) fade_all;
+
+	mtx_t mtx; //protects the pending clouds and the counts for fine_grain_busy
+	Pending pending[GRAIN_PENDING];
+	size_t num_pending;
+	size_t num_clouds;
+	size_t num_grains;
+
+	Cloud clouds[GRAIN_MAX_CLOUDS];
+	size_t playing; //grains[0..playing) play. Only the rendering thread uses it, num_grains is a copy
+	Grain grains[]; //max_grains
+};
+
+//The same slot render_recordings reads for the clip
+static size_t clip_slot(size_t const newest_rec_idx, PlanClip const*const clip) {
+	return ((size_t)MAX_NUM_REC + newest_rec_idx-clip->index)%MAX_NUM_REC;
+}
+
+size_t fine_grain_num_from_env(void) {
+	char const*const env = getenv("FINE_GRAINS");
+	if(!env || !*env) return 0;
+	char *end = 0;
+	size_t const value = strtoull(env, &end, 0);
+	if(!*end) return value;
+	fine_log(WARN, "FINE_GRAINS=%s is not a number, ignoring it", env);
+	return 0;
+}
+
+Grains *fine_grain_create(size_t const max_grains, Recording const*const recordings, size_t const channels) {
+	Grains *const g = calloc(1, sizeof *g + max_grains*sizeof *g->grains);
+	if(!g) fine_exit("Could not allocate %zu grains", max_grains);
+	g->max_grains = max_grains;
+	g->recordings = recordings;
+	g->channels = channels;
+	fine_mix_limiter_init(&g->lim, 50.0f, 5, SAMPLE_RATE, channels);
+	for(size_t i = 0; i <= GRAIN_WIN_LEN; ++i) {
+		float const x = (float)i/GRAIN_WIN_LEN;
+		g->hann[i] = 0.5f - 0.5f*cosf(2*(float)M_PI*x);
+		//the tapers are the two halves of a Hann window GRAIN_TUKEY long
+		float const edge = P99_MINOF(x, 1-x);
+		g->tukey[i] = edge >= GRAIN_TUKEY/2 ? 1.0f : 0.5f - 0.5f*cosf(2*(float)M_PI*edge/GRAIN_TUKEY);
+	}
+	g->norm = 1/sqrtf(GRAIN_DENSITY*(GRAIN_MIN_MS+GRAIN_MAX_MS)/2000.0f);
+	g->density = 1;
+	g->gain = 1;
+	mtx_init(&g->mtx, mtx_plain);
+	return g;
+}
+
+void fine_grain_destroy(Grains *const g) {
+	mtx_destroy(&g->mtx);
+	free(g->mixed);
+	free(g);
+}
+
+int fine_grain_start(Grains *const g, Plan const*const plan, size_t const newest_rec_idx, uint64_t const seed,
+	uint64_t const published) {
+	mtx_lock(&g->mtx);
+	if(g->num_pending == GRAIN_PENDING) {
+		mtx_unlock(&g->mtx);
+		fine_log(WARN, "%d clouds are waiting to start, dropping a new one", GRAIN_PENDING);
+		return -1;
+	}
+	Pending *const p = g->pending + g->num_pending++;
+	p->plan = *plan;
+	p->newest_rec_idx = newest_rec_idx;
+	p->seed = seed;
+	p->published = published;
+	for(size_t i = 0; i < plan->num_clips; ++i) {
+		p->gen[i] = atomic_load_explicit(&g->recordings[clip_slot(newest_rec_idx, plan->clips+i)].gen, memory_order_acquire);
+	}
+	mtx_unlock(&g->mtx);
+	return 0;
+}
+
+void fine_grain_fade_all(Grains *const g) {
+	atomic_store_explicit(&g->fade_all, 1, memory_order_release);
+}
+
+bool fine_grain_busy(Grains *const g) {
+	mtx_lock(&g->mtx);
+	bool const busy = g->num_pending || g->num_clouds || g->num_grains;
+	mtx_unlock(&g->mtx);
+	return busy;
+}
+
+//mtx must be held
+static void start_pending(Grains *const g) {
+	for(size_t i = 0; i < g->num_pending; ++i) {
+		Pending const*const p = g->pending+i;
+		//a free one, else the oldest
+		Cloud *c = g->clouds;
+		for(size_t j = 1; j < GRAIN_MAX_CLOUDS && c->active; ++j) {
+			Cloud *const cj = g->clouds+j;
+			if(!cj->active || cj->order < c->order) c = cj;
+		}
+		//Its grains ring out, it only stops spawning new ones
+		if(c->active) fine_log(DEBUG, "%d clouds play, ending the oldest", GRAIN_MAX_CLOUDS);
+		c->plan = p->plan;
+		memcpy(c->gen, p->gen, sizeof c->gen);
+		c->newest_rec_idx = p->newest_rec_idx;
+		fine_rand_seed(&c->seed, p->seed);
+		c->order = g->next_order++;
+		c->pos = 0;
+		c->next = 0;
+		c->active = 1;
+		if(p->published) fine_prof_end(FINE_STAGE_RESPONSE, p->published);
+	}
+	g->num_pending = 0;
+}
+
+//Grain of a random clip of c, starting delay frames into the block
+static void spawn(Grains *const g, Cloud *const c, size_t const delay) {
+	p99_seed *const seed = &c->seed;
+	size_t const i = fine_rand_below(seed, c->plan.num_clips);
+	PlanClip const*const clip = c->plan.clips+i;
+	Recording const*const rec = g->recordings + clip_slot(c->newest_rec_idx, clip);
+	float const rate = exp2f((2*(float)p99_drand(seed) - 1)*GRAIN_PITCH/12.0f);
+	size_t len = (GRAIN_MIN_MS + fine_rand_below(seed, GRAIN_MAX_MS-GRAIN_MIN_MS+1))*SAMPLE_RATE/1000;
+	bool const tukey = fine_rand_below(seed, 2);
+	float const gain = (float)p99_drand(seed);
+	if(g->playing == g->max_grains) return;
+	if(!fine_gen_unchanged(&rec->gen, c->gen[i])) return;
+
+	//Everything it reads lies inside the clip, with a frame to spare for rounding: x + (len-1)*rate + 1 < num_samples-1
+	if(clip->num_samples < 4) return;
+	float const room = clip->num_samples - 3;
+	if((len-1)*rate > room) len = room/rate + 1;
+	if(len < 2) return;
+	float const ms = GRAIN_CLOUD_FADE_MS*SAMPLE_RATE/1000;
+	float const env = P99_MINOF(1.0f, P99_MINOF((c->pos+delay)/ms, (c->plan.total_samples-c->pos-delay)/ms));
+
+	Grain *const gr = g->grains + g->playing++;
+	*gr = (Grain){
+		.src = rec->data,
+		.slot_gen = &rec->gen,
+		.gen = c->gen[i],
+		.pos = clip->offs + p99_drand(seed)*(room - (len-1)*rate),
+		.rate = rate,
+		//amplified like render_recordings, see PlanClip
+		.gain = (6 + 5*clip->gain_choice)*g->norm*(0.5f + 0.5f*gain)*env,
+		.win = tukey ? g->tukey : g->hann,
+		.wstep = (float)GRAIN_WIN_LEN/len,
+		.delay = delay,
+		.left = len,
+	};
+	//drawn last, so the mono grains of a seed stay the same
+	float const pan = g->channels > 1 ? clip->pan + GRAIN_SPREAD*((float)p99_drand(seed) - 0.5f) : 0;
+	fine_mix_pan(gr->gains, g->channels, pan);
+}
+
+//Spawns the grains of c that start in the next n frames
+static void schedule(Grains *const g, Cloud *const c, size_t const n) {
+	size_t const end = P99_MINOF(c->pos + n, c->plan.total_samples);
+	double const interval = SAMPLE_RATE/(GRAIN_DENSITY*g->density);
+	while(c->next < end) {
+		spawn(g, c, (size_t)c->next - c->pos);
+		c->next += interval*(1 + GRAIN_JITTER*(2*p99_drand(&c->seed) - 1));
+	}
+	c->pos += n;
+	c->active = c->pos < c->plan.total_samples;
+}
+
+//Adds the next n <= GRAIN_BLOCK frames of gr to mixed. @return 0 once it has ended
+static bool mix_grain(Grains *const g, Grain *const gr, float *const mixed, size_t const n) {
+	size_t const first = gr->delay;
+	size_t const k = P99_MINOF(n - first, gr->left);
+	size_t const base = gr->pos;
+	memset(g->mono, 0, k*sizeof *g->mono);
+	fine_kernels->grain(g->mono, k, gr->src+base, gr->pos-base, gr->rate, gr->win, gr->wpos, gr->wstep, gr->gain);
+	//A new recording or a reload makes gen odd before it writes, then what was read is dropped with the grain
+	if(!fine_gen_unchanged(gr->slot_gen, gr->gen)) return 0;
+	fine_mix_pan_add_f(mixed+first*g->channels, g->mono, k, g->channels, gr->gains);
+	gr->delay = 0;
+	gr->pos += (double)gr->rate*k;
+	gr->wpos += gr->wstep*k;
+	gr->left -= k;
+	return gr->left;
+}
+
+void fine_grain_render(Grains *const g, i16 *const out, size_t const n) {
+	uint64_t const start = fine_prof_now();
+	mtx_lock(&g->mtx);
+	if(atomic_exchange_explicit(&g->fade_all, 0, memory_order_acquire)) {
+		g->num_pending = 0;
+		for(size_t i = 0; i < GRAIN_MAX_CLOUDS; ++i) g->clouds[i].active = 0;
+		if(g->playing) g->step = -1.0f/(GRAIN_FADE_MS*SAMPLE_RATE/1000);
+	}
+	start_pending(g);
+	mtx_unlock(&g->mtx);
+
+	size_t const ch = g->channels;
+	if(n*ch > g->mixed_sz) {
+		float *const mixed = realloc(g->mixed, n*ch*sizeof *mixed);
+		if(!mixed) fine_exit("Could not allocate the grain mix");
+		g->mixed = mixed;
+		g->mixed_sz = n*ch;
+	}
+	float *const mixed = g->mixed;
+	memset(mixed, 0, n*ch*sizeof *mixed);
+	for(size_t done = 0; done < n; done += GRAIN_BLOCK) {
+		size_t const len = P99_MINOF(n-done, GRAIN_BLOCK);
+		for(size_t i = 0; i < GRAIN_MAX_CLOUDS; ++i) {
+			if(g->clouds[i].active) schedule(g, g->clouds+i, len);
+		}
+		for(size_t i = 0; i < g->playing;) {
+			if(mix_grain(g, g->grains+i, mixed+done*ch, len)) ++i;
+			else g->grains[i] = g->grains[--g->playing];
+		}
+	}
+
+	if(g->step) {
+		size_t i = 0;
+		for(; i < n && g->gain > 0; ++i) {
+			for(size_t c = 0; c < ch; ++c) mixed[i*ch+c] *= g->gain;
+			g->gain += g->step;
+		}
+		memset(mixed+i*ch, 0, (n-i)*ch*sizeof *mixed);
+		if(g->gain <= 0) {
+			g->playing = 0;
+			g->gain = 1;
+			g->step = 0;
+		}
+	}
+	fine_mix_limit(out, mixed, n, &g->lim);
+
+	mtx_lock(&g->mtx);
+	g->num_grains = g->playing;
+	g->num_clouds = 0;
+	for(size_t i = 0; i < GRAIN_MAX_CLOUDS; ++i) g->num_clouds += g->clouds[i].active;
+	mtx_unlock(&g->mtx);
+
+	uint64_t const ns = fine_prof_end(FINE_STAGE_GRAINS, start) - start;
+	double const budget = GRAIN_CPU_BUDGET*1e9*n/SAMPLE_RATE;
+	if(ns > budget && g->density > GRAIN_MIN_DENSITY) {
+		g->density /= 2;
+		fine_log(WARN, "%zu frames of %zu grains took %.1f ms, spawning %.0f grains per second", n, g->playing, ns/1e6,
+			GRAIN_DENSITY*g->density);
+	}
+	//recovers slowly, so it doesn't swing back over the budget right away
+	else if(ns < budget/2 && g->density < 1) g->density = P99_MINOF(1.0, g->density*1.05);
+}
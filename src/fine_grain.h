@@ -0,0 +1,41 @@
+#pragma once
+#include "fine_definitions.h"
+#include "fine_plan.h"
+
+/*
+ * Granular playback: every collage becomes a cloud of short grains, windowed slices of its clips with their
+ * own pitch (playback rate), gain, window (Hann or Tukey, from tables) and, with more than one channel,
+ * pan around the pan of its clip.
+ * A cloud spawns GRAIN_DENSITY grains per second for as long as its collage would play, and every grain
+ * starts on its exact frame inside a block, so the texture doesn't depend on the block size.
+ * The recordings are read in place, nothing is copied. A grain keeps the gen of its slot and ends when it
+ * changes, so a new recording or a reload only ever cuts a grain short.
+ * The grains are mixed in float by the grain kernel (fine_kernel.h), then limited like the voices.
+ * If a block takes longer than GRAIN_CPU_BUDGET of its duration, the clouds spawn fewer grains until it fits.
+ * Everything but fine_grain_start and fine_grain_fade_all must be called from the thread that renders.
+ * */
+
+typedef struct Grains Grains;
+
+//FINE_GRAINS, the most grains that play at once. 0 (default) plays collages
+size_t fine_grain_num_from_env(void);
+
+//Grains read the clips of recordings and are panned into frames of channels
+Grains *fine_grain_create(size_t max_grains, Recording const* recordings, size_t channels);
+void fine_grain_destroy(Grains *g);
+
+/* Queues a cloud over the clips of plan, it starts with the next block.
+ * seed: the grains of the cloud are drawn from it, so a collage seed reproduces them
+ * published: when the recording it answers was published, or 0
+ * @return 0, -1 if too many clouds are waiting to start (logged)
+ * */
+int fine_grain_start(Grains *g, Plan const* plan, size_t newest_rec_idx, uint64_t seed, uint64_t published);
+
+//All grains fade out, the clouds end and waiting ones are dropped
+void fine_grain_fade_all(Grains *g);
+
+//@return whether a grain plays or a cloud plays or waits to start
+bool fine_grain_busy(Grains *g);
+
+//Mixes the next n frames of all grains into out, silence if none plays
+void fine_grain_render(Grains *g, i16 *out, size_t n);
@@ -1,5 +1,9 @@
-#include "fine_log.h"
-void fine_log(int const, char *restrict, ...);
+#include "fine_rand.h"
+uint32_t fine_rand_below(p99_seed *, uint32_t);
 
-void fine_exit(char *restrict, ...);
+#include "fine_prof.h"
+uint64_t fine_prof_now(void);
+uint64_t fine_prof_end(int, uint64_t);
 
+#include "fine_definitions.h"
+bool fine_gen_unchanged(_Atomic(uint32_t) const*, uint32_t);
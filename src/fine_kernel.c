@@ -0,0 +1,247 @@
+#include "fine_kernel.h"
+#include "fine_definitions.h"
+#include "fine_log.h"
+#include "p99/p99.h"
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#if FINE_KERNEL_NEON
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/* --- Scalar kernels, the reference for the vector ones --- */
+
+static inline i16 sat(float x) {
+	if(x >= INT16_MAX) return INT16_MAX;
+	if(x <= INT16_MIN) return INT16_MIN;
+	return roundf(x);
+}
+
+static void amplify(i16 *const data, size_t const sz, float const gain) {
+	for(size_t i = 0; i < sz; ++i) {
+		float new = data[i]*gain;
+		if(new >= INT16_MAX) new = INT16_MAX;
+		else if(new <= INT16_MIN) new = INT16_MIN;
+		data[i] = new;
+	}
+}
+
+static void fade(i16 *const data, size_t const sz, size_t in, size_t out) {
+	for(size_t i = 0; i < sz; ++i) {
+		int fadein = i<in;
+		int fadeout = i>=sz-out;
+		if(fadein || fadeout) {
+			float const gain = P99_MINOF((float)i/in, (float)(sz-1-i)/out);
+			float new = data[i]*gain;
+			data[i] = roundf(new);
+		}
+	}
+}
+
+static void ramp(i16 *const data, size_t const n, size_t const block, float const*const gains) {
+	for(size_t b = 0, start = 0; start < n; ++b, start += block) {
+		size_t const len = P99_MINOF(n - start, block);
+		float const step = (gains[b+1] - gains[b])/len;
+		for(size_t i = 0; i < len; ++i) data[start+i] = sat(data[start+i]*(gains[b] + step*(float)(i+1)));
+	}
+}
+
+static void ramp_f(i16 *const out, float const*const in, size_t const n, size_t const block, float const*const gains) {
+	for(size_t b = 0, start = 0; start < n; ++b, start += block) {
+		size_t const len = P99_MINOF(n - start, block);
+		float const step = (gains[b+1] - gains[b])/len;
+		for(size_t i = 0; i < len; ++i) out[start+i] = sat(in[start+i]*(gains[b] + step*(float)(i+1)));
+	}
+}
+
+static void block_peaks(float *const peaks, float const*const in, size_t const n, size_t const block) {
+	for(size_t b = 0, start = 0; start < n; ++b, start += block) {
+		size_t const len = P99_MINOF(n - start, block);
+		float peak = 0;
+		for(size_t i = 0; i < len; ++i) peak = P99_MAXOF(peak, fabsf(in[start+i]));
+		peaks[b] = peak;
+	}
+}
+
+static void mix_add(float *const acc, i16 const*const src, size_t const n) {
+	for(size_t i = 0; i < n; ++i) acc[i] += src[i];
+}
+
+static uint64_t abs_sum(i16 const*const data, size_t const n) {
+	uint64_t sum = 0;
+	for(size_t i = 0; i < n; ++i) sum += abs(data[i]);
+	return sum;
+}
+
+static void grain(float *const acc, size_t const n, i16 const*const src, float const x, float const rate,
+	float const*const win, float const w, float const wstep, float const gain) {
+	for(size_t i = 0; i < n; ++i) {
+		float const xs = x + rate*(float)i, ws = w + wstep*(float)i;
+		int32_t const xi = xs, wi = ws;
+		float const s = src[xi] + (src[xi+1] - src[xi])*(xs - (float)xi);
+		float const g = win[wi] + (win[wi+1] - win[wi])*(ws - (float)wi);
+		acc[i] += gain*g*s;
+	}
+}
+
+static void pan_add(float *const acc, i16 const*const src, size_t const n, size_t const channels, float const*const gains) {
+	for(size_t i = 0; i < n; ++i) {
+		for(size_t c = 0; c < channels; ++c) acc[i*channels+c] += src[i]*gains[c];
+	}
+}
+
+static void pan_add_f(float *const acc, float const*const src, size_t const n, size_t const channels, float const*const gains) {
+	for(size_t i = 0; i < n; ++i) {
+		for(size_t c = 0; c < channels; ++c) acc[i*channels+c] += src[i]*gains[c];
+	}
+}
+
+static float dot(float const*const a, float const*const b, size_t const n) {
+	float sum = 0;
+	for(size_t i = 0; i < n; ++i) sum += a[i]*b[i];
+	return sum;
+}
+
+static void fft_pass(float *const re, float *const im, size_t const n, size_t const half,
+	float const*const twr, float const*const twi) {
+	for(size_t j = 0; j < n; j += 2*half) {
+		for(size_t k = 0; k < half; ++k) {
+			size_t const a = j+k, b = j+half+k;
+			float const tr = twr[k]*re[b] - twi[k]*im[b];
+			float const ti = twr[k]*im[b] + twi[k]*re[b];
+			re[b] = re[a] - tr;
+			im[b] = im[a] - ti;
+			re[a] += tr;
+			im[a] += ti;
+		}
+	}
+}
+
+static void cmac(float *const yr, float *const yi, float const*const ar, float const*const ai,
+	float const*const br, float const*const bi, size_t const n, bool const conj) {
+	float const s = conj ? -1 : 1;
+	for(size_t i = 0; i < n; ++i) {
+		float const aim = s*ai[i];
+		yr[i] += ar[i]*br[i] - aim*bi[i];
+		yi[i] += ar[i]*bi[i] + aim*br[i];
+	}
+}
+
+static void biquad_bank(float *const energy, float *const state, float const*const coef, i16 const*const x,
+	size_t const n, size_t const bands) {
+	for(size_t b = 0; b < bands; ++b) {
+		float const b0 = coef[b], b1 = coef[bands+b], b2 = coef[2*bands+b], a1 = coef[3*bands+b], a2 = coef[4*bands+b];
+		float z1 = state[b], z2 = state[bands+b], e = 0;
+		for(size_t i = 0; i < n; ++i) {
+			float const y = b0*x[i] + z1;
+			z1 = b1*x[i] - a1*y + z2;
+			z2 = b2*x[i] - a2*y;
+			e += y*y;
+		}
+		state[b] = z1;
+		state[bands+b] = z2;
+		energy[b] += e;
+	}
+}
+
+//Zero for denormals, as undenormalise of fine_fx_reverb.h
+static inline float flush(float const x) { return fabsf(x) < FLT_MIN ? 0 : x; }
+
+static void comb_bank(float *const restrict out, float const*const in, size_t const n, float *const*const bufs,
+	int32_t const*const sizes, int32_t *const restrict idx, float *const restrict store, size_t const combs,
+	float const feedback, float const damp1, float const damp2) {
+	for(size_t i = 0; i < n; ++i) {
+		float sum = out[i];
+		for(size_t c = 0; c < combs; ++c) {
+			float const o = flush(bufs[c][idx[c]]);
+			store[c] = flush(o*damp2 + store[c]*damp1);
+			bufs[c][idx[c]] = in[i] + store[c]*feedback;
+			sum += o;
+			if(++idx[c] >= sizes[c]) idx[c] = 0;
+		}
+		out[i] = sum;
+	}
+}
+
+Kernels const fine_kernels_scalar = {
+	.name = "scalar",
+	.amplify = amplify,
+	.fade = fade,
+	.ramp = ramp,
+	.ramp_f = ramp_f,
+	.block_peaks = block_peaks,
+	.mix_add = mix_add,
+	.abs_sum = abs_sum,
+	.grain = grain,
+	.pan_add = pan_add,
+	.pan_add_f = pan_add_f,
+	.dot = dot,
+	.fft_pass = fft_pass,
+	.cmac = cmac,
+	.biquad_bank = biquad_bank,
+	.comb_bank = comb_bank,
+};
+
+/* --- Registry --- */
+
+Kernels const* fine_kernels = &fine_kernels_scalar;
+
+//best first
+static Kernels const*const all_kernels[] = {
+#if FINE_KERNEL_X86
+	&fine_kernels_avx512,
+	&fine_kernels_avx2,
+	&fine_kernels_sse2,
+#endif
+#if FINE_KERNEL_NEON
+	&fine_kernels_neon,
+#endif
+	&fine_kernels_scalar,
+};
+
+static unsigned cpu_features(void) {
+	unsigned f = 0;
+#if FINE_KERNEL_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) f |= FINE_CPU_SSE2;
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) f |= FINE_CPU_AVX2;
+	if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) f |= FINE_CPU_AVX512;
+#elif FINE_KERNEL_NEON
+	if(getauxval(AT_HWCAP) & HWCAP_ASIMD) f |= FINE_CPU_NEON;
+#endif
+	return f;
+}
+
+size_t fine_kernel_list(Kernels const** const arr, size_t const max) {
+	unsigned const have = cpu_features();
+	size_t num = 0;
+	for(size_t i = 0; i < sizeof all_kernels/sizeof *all_kernels && num < max; ++i) {
+		if((all_kernels[i]->needs & have) == all_kernels[i]->needs) arr[num++] = all_kernels[i];
+	}
+	return num;
+}
+
+Kernels const* fine_kernel_find(char const*const name) {
+	Kernels const* arr[sizeof all_kernels/sizeof *all_kernels];
+	size_t const num = fine_kernel_list(arr, sizeof arr/sizeof *arr);
+	for(size_t i = 0; i < num; ++i) {
+		if(!strcmp(arr[i]->name, name)) return arr[i];
+	}
+	return 0;
+}
+
+void fine_kernel_init(void) {
+	Kernels const* best = 0;
+	fine_kernel_list(&best, 1);
+	fine_kernels = best;
+
+	char const*const env = getenv("FINE_KERNELS");
+	if(env && *env) {
+		Kernels const*const forced = fine_kernel_find(env);
+		if(forced) fine_kernels = forced;
+		else fine_log(WARN, "FINE_KERNELS=%s is unknown or not supported by this CPU, ignoring it", env);
+	}
+	fine_log(INFO, "DSP kernels: %s", fine_kernels->name);
+}
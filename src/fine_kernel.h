@@ -0,0 +1,93 @@
+#pragma once
+#include "fine_definitions.h"
+
+/*
+ * Registry of the hot DSP loops. Every instruction set gets its own table, compiled from the same
+ * source (fine_kernel_vec.h) with a different vector width and target pragma, and the best table the
+ * CPU supports is picked at startup. So one binary runs everywhere and still uses AVX2/AVX-512.
+ *
+ * FINE_KERNELS=scalar|sse2|avx2|avx512|neon forces a table, for A/B benchmarks.
+ *
+ * NOTE: the compressor envelope is one recursive filter (every sample depends on the one before), so it
+ * stays scalar code and is not in the table. A bank of independent filters runs them side by side instead,
+ * one per lane (biquad_bank), or one after the other when their delay lines are longer than a block (comb_bank).
+ * */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FINE_KERNEL_X86 1
+#elif defined(__aarch64__)
+#define FINE_KERNEL_NEON 1
+#endif
+
+enum {
+	FINE_CPU_SSE2 = 1,
+	FINE_CPU_AVX2 = 2, //and FMA
+	FINE_CPU_AVX512 = 4, //F and BW
+	FINE_CPU_NEON = 8,
+};
+
+typedef struct Kernels Kernels;
+struct Kernels {
+	char const* name;
+	unsigned needs; //FINE_CPU_* bits
+	//data[i] *= gain, saturated and truncated
+	void (*amplify)(i16 *data, size_t n, float gain);
+	//fine_fx_fade_linear
+	void (*fade)(i16 *data, size_t n, size_t in, size_t out);
+	/* Gain ramps, gains has one entry per block plus one. Block b starts at gains[b] and ramps
+	 * linearly to gains[b+1], reached on its last sample. Rounded and saturated. */
+	void (*ramp)(i16 *data, size_t n, size_t block, float const* gains);
+	void (*ramp_f)(i16 *out, float const* in, size_t n, size_t block, float const* gains);
+	//peaks[b] = max |in| over block b
+	void (*block_peaks)(float *peaks, float const* in, size_t n, size_t block);
+	//acc[i] += src[i]
+	void (*mix_add)(float *acc, i16 const* src, size_t n);
+	//sum of |data[i]|
+	uint64_t (*abs_sum)(i16 const* data, size_t n);
+	/* acc[i] += gain * win(w + i*wstep) * src(x + i*rate), src and win read with linear interpolation.
+	 * Reads src up to index x + (n-1)*rate + 1 and win up to w + (n-1)*wstep + 1, x and w are >= 0. */
+	void (*grain)(float *acc, size_t n, i16 const* src, float x, float rate, float const* win, float w, float wstep, float gain);
+	//acc[i*channels + c] += src[i]*gains[c] for every c < channels <= MAX_CHANNELS: a mono source panned into frames
+	void (*pan_add)(float *acc, i16 const* src, size_t n, size_t channels, float const* gains);
+	void (*pan_add_f)(float *acc, float const* src, size_t n, size_t channels, float const* gains);
+	//sum of a[i]*b[i], the FIR of the resampler
+	float (*dot)(float const* a, float const* b, size_t n);
+	/* One radix 2 pass of fine_fft.h over n complex numbers in re and im: every group of 2*half gets
+	 * x[k] += t, x[k+half] = x[k] - t with t = tw[k]*x[k+half], for k < half */
+	void (*fft_pass)(float *re, float *im, size_t n, size_t half, float const* twr, float const* twi);
+	//y[i] += a[i]*b[i] on complex numbers in split arrays, with conj y[i] += conj(a[i])*b[i]. The echo canceller
+	void (*cmac)(float *yr, float *yi, float const* ar, float const* ai, float const* br, float const* bi, size_t n, bool conj);
+	/* bands biquads (transposed direct form II) over the same n samples, energy[b] += sum of the squared output
+	 * of band b. coef holds b0, b1, b2, a1, a2 of all bands one after the other, state z1 then z2. The voice activity detector */
+	void (*biquad_bank)(float *energy, float *state, float const* coef, i16 const* x, size_t n, size_t bands);
+	/* combs lowpass feedback combs (Freeverb) fed the same n samples of in, out[i] += the output of every comb.
+	 * Comb c reads and writes bufs[c] at idx[c], which wraps at sizes[c], and keeps its lowpass in store[c].
+	 * n must not exceed the shortest size, so no comb reads back what this call wrote. The reverb */
+	void (*comb_bank)(float *out, float const* in, size_t n, float *const* bufs, int32_t const* sizes, int32_t *idx,
+		float *store, size_t combs, float feedback, float damp1, float damp2);
+};
+
+extern Kernels const fine_kernels_scalar;
+#if FINE_KERNEL_X86
+extern Kernels const fine_kernels_sse2;
+extern Kernels const fine_kernels_avx2;
+extern Kernels const fine_kernels_avx512;
+#endif
+#if FINE_KERNEL_NEON
+extern Kernels const fine_kernels_neon;
+#endif
+
+//The tables in use. Scalar until fine_kernel_init runs.
+extern Kernels const* fine_kernels;
+
+//Picks the tables for this CPU (or FINE_KERNELS). Call it before starting any threads.
+void fine_kernel_init(void);
+
+//@return the table called name, 0 if there is none or the CPU can't run it
+Kernels const* fine_kernel_find(char const* name);
+
+/*
+ * Fills arr with every table the CPU can run, best first. The scalar one is always last.
+ * @return the number of tables
+ * */
+size_t fine_kernel_list(Kernels const** arr, size_t max);
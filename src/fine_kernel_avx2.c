@@ -0,0 +1,10 @@
+//8 floats, with FMA
+#include "fine_kernel.h"
+#if FINE_KERNEL_X86
+#pragma GCC target("avx2,fma")
+#define FINE_VEC 8
+#define KERNEL_TABLE fine_kernels_avx2
+#define KERNEL_NAME "avx2"
+#define KERNEL_NEEDS (FINE_CPU_SSE2|FINE_CPU_AVX2)
+#include "fine_kernel_vec.h"
+#endif
@@ -0,0 +1,10 @@
+//16 floats. BW is needed for the 16 bit lanes.
+#include "fine_kernel.h"
+#if FINE_KERNEL_X86
+#pragma GCC target("avx512f,avx512bw,avx2,fma")
+#define FINE_VEC 16
+#define KERNEL_TABLE fine_kernels_avx512
+#define KERNEL_NAME "avx512"
+#define KERNEL_NEEDS (FINE_CPU_SSE2|FINE_CPU_AVX2|FINE_CPU_AVX512)
+#include "fine_kernel_vec.h"
+#endif
@@ -0,0 +1,10 @@
+//AArch64, 4 floats. NEON is part of the baseline there, so no pragma is needed.
+//NOTE: 32 bit ARM builds only get the scalar kernels, GCC won't put float vectors on its NEON without -ffast-math
+#include "fine_kernel.h"
+#if FINE_KERNEL_NEON
+#define FINE_VEC 4
+#define KERNEL_TABLE fine_kernels_neon
+#define KERNEL_NAME "neon"
+#define KERNEL_NEEDS FINE_CPU_NEON
+#include "fine_kernel_vec.h"
+#endif
@@ -0,0 +1,10 @@
+//Baseline x86-64 vectors, 4 floats
+#include "fine_kernel.h"
+#if FINE_KERNEL_X86
+#pragma GCC target("sse2")
+#define FINE_VEC 4
+#define KERNEL_TABLE fine_kernels_sse2
+#define KERNEL_NAME "sse2"
+#define KERNEL_NEEDS FINE_CPU_SSE2
+#include "fine_kernel_vec.h"
+#endif
@@ -0,0 +1,375 @@
+/*
+ * Vector versions of the kernels in fine_kernel.c, included once per instruction set.
+ * The including file sets the target pragma and defines FINE_VEC, KERNEL_TABLE, KERNEL_NAME and KERNEL_NEEDS.
+ * Results match the scalar kernels, except that a product can round the other way where the
+ * target contracts it into an FMA (off by one at most).
+ * */
+#include "fine_kernel.h"
+#include "fine_vec.h"
+#include "p99/p99.h"
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+
+#if !defined(KERNEL_TABLE) || !defined(KERNEL_NAME) || !defined(KERNEL_NEEDS)
+#error "define KERNEL_TABLE, KERNEL_NAME and KERNEL_NEEDS before including fine_kernel_vec.h"
+#endif
+
+static inline i16 sat(float x) {
+	if(x >= INT16_MAX) return INT16_MAX;
+	if(x <= INT16_MIN) return INT16_MIN;
+	return roundf(x);
+}
+
+static void amplify(i16 *const data, size_t const n, float const gain) {
+	size_t i = 0;
+	for(; i + FINE_VEC <= n; i += FINE_VEC) store_clamp(data+i, load_h(data+i)*gain);
+	for(; i < n; ++i) {
+		float new = data[i]*gain;
+		if(new >= INT16_MAX) new = INT16_MAX;
+		else if(new <= INT16_MIN) new = INT16_MIN;
+		data[i] = new;
+	}
+}
+
+//gain = min(i/in, (n-1-i)/out) on [begin, end)
+static void fade_range(i16 *const data, size_t const n, size_t const in, size_t const out, size_t const begin, size_t const end) {
+	vf const iota = vf_iota();
+	size_t i = begin;
+	for(; i + FINE_VEC <= end; i += FINE_VEC) {
+		vf const pos = iota + (float)i;
+		vf const gain = vmin(pos/(float)in, ((float)(n-1) - pos)/(float)out);
+		store_sat(data+i, load_h(data+i)*gain);
+	}
+	for(; i < end; ++i) {
+		float const gain = P99_MINOF((float)i/in, (float)(n-1-i)/out);
+		data[i] = roundf(data[i]*gain);
+	}
+}
+
+static void fade(i16 *const data, size_t const n, size_t const in, size_t const out) {
+	size_t const in_end = P99_MINOF(in, n);
+	//like i >= n-out in the scalar version, which is never true once out > n
+	size_t const out_begin = out <= n ? P99_MAXOF(n - out, in_end) : n;
+	fade_range(data, n, in, out, 0, in_end);
+	fade_range(data, n, in, out, out_begin, n);
+}
+
+static void ramp(i16 *const data, size_t const n, size_t const block, float const*const gains) {
+	vf const iota = vf_iota() + 1.0f;
+	for(size_t b = 0, start = 0; start < n; ++b, start += block) {
+		i16 *const p = data + start;
+		size_t const len = P99_MINOF(n - start, block);
+		float const step = (gains[b+1] - gains[b])/len;
+		size_t i = 0;
+		for(; i + FINE_VEC <= len; i += FINE_VEC) store_sat(p+i, load_h(p+i)*(gains[b] + step*(iota + (float)i)));
+		for(; i < len; ++i) p[i] = sat(p[i]*(gains[b] + step*(float)(i+1)));
+	}
+}
+
+static void ramp_f(i16 *const out, float const*const in, size_t const n, size_t const block, float const*const gains) {
+	vf const iota = vf_iota() + 1.0f;
+	for(size_t b = 0, start = 0; start < n; ++b, start += block) {
+		size_t const len = P99_MINOF(n - start, block);
+		float const step = (gains[b+1] - gains[b])/len;
+		size_t i = 0;
+		for(; i + FINE_VEC <= len; i += FINE_VEC) {
+			store_sat(out+start+i, load_f(in+start+i)*(gains[b] + step*(iota + (float)i)));
+		}
+		for(; i < len; ++i) out[start+i] = sat(in[start+i]*(gains[b] + step*(float)(i+1)));
+	}
+}
+
+static void block_peaks(float *const peaks, float const*const in, size_t const n, size_t const block) {
+	for(size_t b = 0, start = 0; start < n; ++b, start += block) {
+		size_t const len = P99_MINOF(n - start, block);
+		vf m = vf_set(0);
+		size_t i = 0;
+		for(; i + FINE_VEC <= len; i += FINE_VEC) m = vmax(m, vabs(load_f(in+start+i)));
+		float peak = hmax(m);
+		for(; i < len; ++i) peak = P99_MAXOF(peak, fabsf(in[start+i]));
+		peaks[b] = peak;
+	}
+}
+
+static void mix_add(float *const acc, i16 const*const src, size_t const n) {
+	size_t i = 0;
+	for(; i + FINE_VEC <= n; i += FINE_VEC) store_f(acc+i, load_f(acc+i) + load_h(src+i));
+	for(; i < n; ++i) acc[i] += src[i];
+}
+
+static uint64_t abs_sum(i16 const*const data, size_t const n) {
+	//a lane gains at most 32768 per vector, so it can take 65535 vectors before int32 overflows
+	size_t const chunk = 65535*FINE_VEC;
+	uint64_t sum = 0;
+	size_t i = 0;
+	while(i + FINE_VEC <= n) {
+		size_t const end = P99_MINOF(n, i + chunk);
+		vi acc = {0};
+		for(; i + FINE_VEC <= end; i += FINE_VEC) {
+			vi const x = load_hi(data+i);
+			vi const sign = x >> 31;
+			acc += (x ^ sign) - sign;
+		}
+		for(int l = 0; l < FINE_VEC; ++l) sum += (uint32_t)acc[l];
+	}
+	for(; i < n; ++i) sum += abs(data[i]);
+	return sum;
+}
+
+//There is no gather for i16, so the lanes are loaded one by one and everything else is vector math
+static void grain(float *const acc, size_t const n, i16 const*const src, float const x, float const rate,
+	float const*const win, float const w, float const wstep, float const gain) {
+	vf const iota = vf_iota();
+	size_t i = 0;
+	for(; i + FINE_VEC <= n; i += FINE_VEC) {
+		vf const k = iota + (float)i;
+		vf const xs = x + rate*k, ws = w + wstep*k;
+		vi const xi = __builtin_convertvector(xs, vi), wi = __builtin_convertvector(ws, vi);
+		vf s0, s1, g0, g1;
+		for(int l = 0; l < FINE_VEC; ++l) {
+			s0[l] = src[xi[l]];
+			s1[l] = src[xi[l]+1];
+			g0[l] = win[wi[l]];
+			g1[l] = win[wi[l]+1];
+		}
+		vf const s = s0 + (s1 - s0)*(xs - __builtin_convertvector(xi, vf));
+		vf const g = g0 + (g1 - g0)*(ws - __builtin_convertvector(wi, vf));
+		store_f(acc+i, load_f(acc+i) + gain*g*s);
+	}
+	for(; i < n; ++i) {
+		float const xs = x + rate*(float)i, ws = w + wstep*(float)i;
+		int32_t const xi = xs, wi = ws;
+		float const s = src[xi] + (src[xi+1] - src[xi])*(xs - (float)xi);
+		float const g = win[wi] + (win[wi+1] - win[wi])*(ws - (float)wi);
+		acc[i] += gain*g*s;
+	}
+}
+
+/* Lane l of vector v of the output holds channel (v*FINE_VEC + l) % channels, so the pattern of gains and
+ * source samples repeats after channels/gcd(channels, FINE_VEC) vectors. Those are set up once,
+ * then every vector is one load of the source, a shuffle spreading it over the frames and one multiply-add.
+ * src16 or srcf is 0, always_inline folds the other one away.
+ * NOTE: SSE2 has no shuffle for most of these patterns, with 3 or more than 4 channels it is about as fast as scalar code */
+VINLINE void pan_add_any(float *const acc, i16 const*const src16, float const*const srcf, size_t const n,
+	size_t const channels, float const*const gains) {
+	size_t a = FINE_VEC, b = channels;
+	while(b) {
+		size_t const t = a%b;
+		a = b;
+		b = t;
+	}
+	size_t const period = channels/a; //vectors until the lanes repeat
+	size_t const frames = FINE_VEC/a; //that many vectors hold this many frames
+	vf g[MAX_CHANNELS];
+	vi spread[MAX_CHANNELS];
+	size_t first[MAX_CHANNELS]; //frame in lane 0 of vector v
+	for(size_t v = 0; v < period; ++v) {
+		first[v] = v*FINE_VEC/channels;
+		for(int l = 0; l < FINE_VEC; ++l) {
+			size_t const lane = v*FINE_VEC + l;
+			g[v][l] = gains[lane%channels];
+			spread[v][l] = lane/channels - first[v];
+		}
+	}
+	size_t i = 0;
+	for(; i + frames + FINE_VEC <= n; i += frames) {
+		float *const out = acc + i*channels;
+		#pragma GCC unroll 8
+		for(size_t v = 0; v < period; ++v) {
+			vf const s = src16 ? load_h(src16 + i + first[v]) : load_f(srcf + i + first[v]);
+			store_f(out + v*FINE_VEC, load_f(out + v*FINE_VEC) + __builtin_shuffle(s, spread[v])*g[v]);
+		}
+	}
+	for(; i < n; ++i) {
+		float const s = src16 ? src16[i] : srcf[i];
+		for(size_t c = 0; c < channels; ++c) acc[i*channels+c] += s*gains[c];
+	}
+}
+
+//One copy per channel count, so the shuffles are constants the compiler can pick instructions for
+#define PAN_CASES(src16, srcf) switch(channels) { \
+	case 1: pan_add_any(acc, src16, srcf, n, 1, gains); break; \
+	case 2: pan_add_any(acc, src16, srcf, n, 2, gains); break; \
+	case 3: pan_add_any(acc, src16, srcf, n, 3, gains); break; \
+	case 4: pan_add_any(acc, src16, srcf, n, 4, gains); break; \
+	case 5: pan_add_any(acc, src16, srcf, n, 5, gains); break; \
+	case 6: pan_add_any(acc, src16, srcf, n, 6, gains); break; \
+	case 7: pan_add_any(acc, src16, srcf, n, 7, gains); break; \
+	case 8: pan_add_any(acc, src16, srcf, n, 8, gains); break; \
+	default: pan_add_any(acc, src16, srcf, n, channels, gains); break; \
+}
+
+static void pan_add(float *const acc, i16 const*const src, size_t const n, size_t const channels, float const*const gains) {
+	PAN_CASES(src, 0)
+}
+
+static void pan_add_f(float *const acc, float const*const src, size_t const n, size_t const channels, float const*const gains) {
+	PAN_CASES(0, src)
+}
+
+//Sums in a different order than the scalar version, so the result can differ in the last bits
+static float dot(float const*const a, float const*const b, size_t const n) {
+	vf acc = vf_set(0);
+	size_t i = 0;
+	for(; i + FINE_VEC <= n; i += FINE_VEC) acc += load_f(a+i)*load_f(b+i);
+	float sum = 0;
+	for(int l = 0; l < FINE_VEC; ++l) sum += acc[l];
+	for(; i < n; ++i) sum += a[i]*b[i];
+	return sum;
+}
+
+//The first passes have fewer than FINE_VEC butterflies per group, they run like the scalar version
+static void fft_pass(float *const re, float *const im, size_t const n, size_t const half,
+	float const*const twr, float const*const twi) {
+	if(half < FINE_VEC) {
+		for(size_t j = 0; j < n; j += 2*half) {
+			for(size_t k = 0; k < half; ++k) {
+				size_t const a = j+k, b = j+half+k;
+				float const tr = twr[k]*re[b] - twi[k]*im[b];
+				float const ti = twr[k]*im[b] + twi[k]*re[b];
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+		return;
+	}
+	for(size_t j = 0; j < n; j += 2*half) {
+		for(size_t k = 0; k < half; k += FINE_VEC) {
+			size_t const a = j+k, b = j+half+k;
+			vf const wr = load_f(twr+k), wi = load_f(twi+k);
+			vf const xr = load_f(re+b), xi = load_f(im+b);
+			vf const tr = wr*xr - wi*xi;
+			vf const ti = wr*xi + wi*xr;
+			vf const ar = load_f(re+a), ai = load_f(im+a);
+			store_f(re+b, ar - tr);
+			store_f(im+b, ai - ti);
+			store_f(re+a, ar + tr);
+			store_f(im+a, ai + ti);
+		}
+	}
+}
+
+static void cmac(float *const yr, float *const yi, float const*const ar, float const*const ai,
+	float const*const br, float const*const bi, size_t const n, bool const conj) {
+	float const s = conj ? -1 : 1;
+	size_t i = 0;
+	for(; i + FINE_VEC <= n; i += FINE_VEC) {
+		vf const xr = load_f(ar+i), xi = load_f(ai+i)*s;
+		vf const wr = load_f(br+i), wi = load_f(bi+i);
+		store_f(yr+i, load_f(yr+i) + xr*wr - xi*wi);
+		store_f(yi+i, load_f(yi+i) + xr*wi + xi*wr);
+	}
+	for(; i < n; ++i) {
+		float const aim = s*ai[i];
+		yr[i] += ar[i]*br[i] - aim*bi[i];
+		yi[i] += ar[i]*bi[i] + aim*br[i];
+	}
+}
+
+//A band per lane, the bands left over one after the other
+static void biquad_bank(float *const energy, float *const state, float const*const coef, i16 const*const x,
+	size_t const n, size_t const bands) {
+	size_t b = 0;
+	for(; b + FINE_VEC <= bands; b += FINE_VEC) {
+		vf const b0 = load_f(coef+b), b1 = load_f(coef+bands+b), b2 = load_f(coef+2*bands+b);
+		vf const a1 = load_f(coef+3*bands+b), a2 = load_f(coef+4*bands+b);
+		vf z1 = load_f(state+b), z2 = load_f(state+bands+b), e = vf_set(0);
+		for(size_t i = 0; i < n; ++i) {
+			vf const in = vf_set(x[i]);
+			vf const y = b0*in + z1;
+			z1 = b1*in - a1*y + z2;
+			z2 = b2*in - a2*y;
+			e += y*y;
+		}
+		store_f(state+b, z1);
+		store_f(state+bands+b, z2);
+		store_f(energy+b, load_f(energy+b) + e);
+	}
+	for(; b < bands; ++b) {
+		float const b0 = coef[b], b1 = coef[bands+b], b2 = coef[2*bands+b], a1 = coef[3*bands+b], a2 = coef[4*bands+b];
+		float z1 = state[b], z2 = state[bands+b], e = 0;
+		for(size_t i = 0; i < n; ++i) {
+			float const y = b0*x[i] + z1;
+			z1 = b1*x[i] - a1*y + z2;
+			z2 = b2*x[i] - a2*y;
+			e += y*y;
+		}
+		state[b] = z1;
+		state[bands+b] = z2;
+		energy[b] += e;
+	}
+}
+
+//Lanes move up by s, zeros come in
+VINLINE vf shift_up(vf const x, int const s) {
+	vi m;
+	for(int l = 0; l < FINE_VEC; ++l) m[l] = l >= s ? l - s : FINE_VEC;
+	return __builtin_shuffle(x, vf_set(0), m);
+}
+
+/* Every comb over time: its reads are n samples written before this call, so only the lowpass
+ * s = o*damp2 + s*damp1 is recursive. It runs as a prefix scan within the vector, then
+ * adds damp1^(l+1) times the last s before it. */
+static void comb_bank(float *const out, float const*const in, size_t const n, float *const*const bufs,
+	int32_t const*const sizes, int32_t *const idx, float *const store, size_t const combs,
+	float const feedback, float const damp1, float const damp2) {
+	float pw[FINE_VEC];
+	pw[0] = damp1;
+	for(int l = 1; l < FINE_VEC; ++l) pw[l] = pw[l-1]*damp1;
+	vf const pow = load_f(pw);
+	for(size_t c = 0; c < combs; ++c) {
+		float *const buf = bufs[c];
+		int32_t j = idx[c];
+		float s = store[c];
+		for(size_t i = 0; i < n;) {
+			size_t const seg = P99_MINOF(n - i, (size_t)(sizes[c] - j)); //up to the wrap
+			size_t k = 0;
+			for(; k + FINE_VEC <= seg; k += FINE_VEC) {
+				vf o = load_f(buf+j+k);
+				o = (vf)((vi)o & (vabs(o) >= FLT_MIN));
+				vf x = o*damp2;
+				for(int sh = 1, p = 0; sh < FINE_VEC; sh *= 2, p = 2*p + 1) x += pw[p]*shift_up(x, sh);
+				x += pow*s;
+				store_f(buf+j+k, load_f(in+i+k) + x*feedback);
+				store_f(out+i+k, load_f(out+i+k) + o);
+				s = x[FINE_VEC-1];
+			}
+			for(; k < seg; ++k) {
+				float o = buf[j+k];
+				if(fabsf(o) < FLT_MIN) o = 0;
+				s = o*damp2 + s*damp1;
+				if(fabsf(s) < FLT_MIN) s = 0;
+				buf[j+k] = in[i+k] + s*feedback;
+				out[i+k] += o;
+			}
+			i += seg;
+			j += seg;
+			if(j >= sizes[c]) j = 0;
+		}
+		idx[c] = j;
+		store[c] = fabsf(s) < FLT_MIN ? 0 : s;
+	}
+}
+
+Kernels const KERNEL_TABLE = {
+	.name = KERNEL_NAME,
+	.needs = KERNEL_NEEDS,
+	.amplify = amplify,
+	.fade = fade,
+	.ramp = ramp,
+	.ramp_f = ramp_f,
+	.block_peaks = block_peaks,
+	.mix_add = mix_add,
+	.abs_sum = abs_sum,
+	.grain = grain,
+	.pan_add = pan_add,
+	.pan_add_f = pan_add_f,
+	.dot = dot,
+	.fft_pass = fft_pass,
+	.cmac = cmac,
+	.biquad_bank = biquad_bank,
+	.comb_bank = comb_bank,
+};
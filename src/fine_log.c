@@ -0,0 +1,182 @@
+#include "fine_log.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <threads.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define LOG_RING_SZ 256 //messages per thread, power of two
+#define LOG_MSG_SZ 256 //longer messages are cut
+#define LOG_MAX_THREADS 64 //further threads write directly
+#define LOG_POLL_MS 10
+/* --- END DEFINITIONS FOR TUNING --- */
+
+_Atomic(int) fine_log_level = INFO;
+
+typedef struct LogMsg LogMsg;
+struct LogMsg {
+	uint64_t seq; //messages of all threads are written in this order
+	int type;
+	char text[LOG_MSG_SZ];
+};
+
+//Single producer (the owning thread), single consumer (whoever holds drain_mtx)
+typedef struct LogRing LogRing;
+struct LogRing {
+	_Alignas(64) _Atomic(size_t) head; //written by the owner
+	_Alignas(64) _Atomic(size_t) tail; //written by the consumer
+	_Atomic(uint64_t) dropped;
+	LogMsg msgs[LOG_RING_SZ];
+};
+
+static LogRing *_Atomic rings[LOG_MAX_THREADS];
+static _Atomic(size_t) num_rings;
+static _Atomic(uint64_t) next_seq;
+static thread_local LogRing *my_ring;
+static thread_local bool no_ring;
+
+static _Atomic(bool) running;
+static thrd_t log_thrd;
+static mtx_t drain_mtx;
+
+static void write_direct(int const type, char const*restrict format, va_list args) {
+	FILE *stream = type>INFO? stderr : stdout;
+	vfprintf(stream, format, args);
+	if(!*format || format[strlen(format)-1] != '\n') fputc('\n', stream);
+}
+
+static LogRing *get_ring(void) {
+	if(my_ring || no_ring) return my_ring;
+	size_t const idx = atomic_fetch_add_explicit(&num_rings, 1, memory_order_relaxed);
+	if(idx >= LOG_MAX_THREADS || !(my_ring = calloc(1, sizeof *my_ring))) {
+		no_ring = 1;
+		return 0;
+	}
+	atomic_store_explicit(rings+idx, my_ring, memory_order_release);
+	return my_ring;
+}
+
+void fine_log_write(int const type, char const*restrict format, ...) {
+	va_list args;
+	va_start(args, format);
+	LogRing *const r = atomic_load_explicit(&running, memory_order_acquire) ? get_ring() : 0;
+	if(!r) {
+		write_direct(type, format, args);
+		va_end(args);
+		return;
+	}
+	size_t const head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if(head - atomic_load_explicit(&r->tail, memory_order_acquire) >= LOG_RING_SZ) {
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		va_end(args);
+		return;
+	}
+	LogMsg *const msg = r->msgs + head%LOG_RING_SZ;
+	msg->seq = atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed);
+	msg->type = type;
+	int const len = vsnprintf(msg->text, sizeof msg->text, format, args);
+	va_end(args);
+	if(len > 0 && (size_t)len < sizeof msg->text && msg->text[len-1] == '\n') msg->text[len-1] = 0;
+	atomic_store_explicit(&r->head, head+1, memory_order_release);
+}
+
+//drain_mtx must be held
+static void drain(void) {
+	size_t const n = atomic_load_explicit(&num_rings, memory_order_acquire);
+	LogRing *r[LOG_MAX_THREADS];
+	size_t head[LOG_MAX_THREADS], tail[LOG_MAX_THREADS];
+	size_t num = 0;
+	for(size_t i = 0; i < n && i < LOG_MAX_THREADS; ++i) {
+		if(!(r[num] = atomic_load_explicit(rings+i, memory_order_acquire))) continue;
+		head[num] = atomic_load_explicit(&r[num]->head, memory_order_acquire);
+		tail[num] = atomic_load_explicit(&r[num]->tail, memory_order_relaxed);
+		++num;
+	}
+
+	//merge the rings by sequence number
+	while(1) {
+		LogMsg const* msg = 0;
+		size_t from = 0;
+		for(size_t i = 0; i < num; ++i) {
+			LogMsg const*const m = r[i]->msgs + tail[i]%LOG_RING_SZ;
+			if(tail[i] != head[i] && (!msg || m->seq < msg->seq)) {
+				msg = m;
+				from = i;
+			}
+		}
+		if(!msg) break;
+		FILE *const stream = msg->type>INFO? stderr : stdout;
+		fputs(msg->text, stream);
+		fputc('\n', stream);
+		atomic_store_explicit(&r[from]->tail, ++tail[from], memory_order_release);
+	}
+
+	for(size_t i = 0; i < num; ++i) {
+		uint64_t const dropped = atomic_exchange_explicit(&r[i]->dropped, 0, memory_order_relaxed);
+		if(dropped) fprintf(stderr, "%llu log messages dropped\n", (unsigned long long)dropped);
+	}
+	fflush(stdout);
+}
+
+void fine_log_flush(void) {
+	if(!atomic_load_explicit(&running, memory_order_acquire)) return;
+	mtx_lock(&drain_mtx);
+	drain();
+	mtx_unlock(&drain_mtx);
+}
+
+static int log_thread(void *ptr) {
+	(void)ptr;
+	struct timespec const delay = {.tv_nsec = LOG_POLL_MS*1000000L};
+	while(atomic_load_explicit(&running, memory_order_acquire)) {
+		fine_log_flush();
+		thrd_sleep(&delay, 0);
+	}
+	return 0;
+}
+
+static int parse_level(char const*const s) {
+	static char const*const names[] = {[DEBUG] = "debug", [INFO] = "info", [WARN] = "warn", [ERROR] = "error"};
+	for(int i = DEBUG; i <= ERROR; ++i) {
+		if(!strcmp(s, names[i])) return i;
+	}
+	if(s[0] >= '0' && s[0] <= '3' && !s[1]) return s[0]-'0';
+	return -1;
+}
+
+void fine_log_init(void) {
+	char const*const env = getenv("FINE_LOG_LEVEL");
+	if(env && *env) {
+		int const level = parse_level(env);
+		if(level >= 0) atomic_store(&fine_log_level, level);
+		else fine_log(WARN, "FINE_LOG_LEVEL=%s is not one of debug, info, warn, error, ignoring it", env);
+	}
+	if(atomic_load(&running)) return;
+	mtx_init(&drain_mtx, mtx_plain);
+	atomic_store(&running, 1);
+	if(thrd_create(&log_thrd, log_thread, 0) != thrd_success) {
+		atomic_store(&running, 0);
+		fine_log(WARN, "Could not start the log thread, logging directly");
+		return;
+	}
+	//exit() from any thread still gets the queued messages out
+	atexit(fine_log_flush);
+}
+
+void fine_log_shutdown(void) {
+	if(!atomic_load(&running)) return;
+	atomic_store(&running, 0);
+	thrd_join(log_thrd, 0);
+	//messages queued while stopping
+	mtx_lock(&drain_mtx);
+	drain();
+	mtx_unlock(&drain_mtx);
+}
+
+_Noreturn void fine_exit(char const*restrict format, ...) {
+	fine_log_flush();
+	va_list args;
+	va_start(args, format);
+	write_direct(ERROR, format, args);
+	va_end(args);
+	exit(EXIT_FAILURE);
+}
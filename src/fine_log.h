@@ -1,25 +1,41 @@
-
 #pragma once
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdatomic.h>
+
+/*
+ * Logging that is safe in the audio threads.
+ * Messages below FINE_LOG_MIN are compiled out (build with -DFINE_LOG_MIN=INFO to drop all DEBUG calls),
+ * messages below fine_log_level (FINE_LOG_LEVEL=debug|info|warn|error, default info) cost one atomic load.
+ * The rest is formatted into a ring owned by the calling thread and written out by the log thread,
+ * so no thread ever waits for stdio. If the ring is full the message is dropped and counted.
+ * Before fine_log_init and after fine_log_shutdown messages are written directly.
+ * */
 
 enum {DEBUG=0, INFO, WARN, ERROR};
-inline void fine_log(int const type, char *restrict format, ...) {
-	va_list args;
-	va_start(args, format);
-	FILE *stream = type>INFO? stderr : stdout;
-	vfprintf(stream, format, args);
-	if(format[strlen(format)-1] != '\n') fputc('\n', stream);
-	va_end(args);
-}
-
-inline void fine_exit(char *restrict format, ...) {
-	va_list args;
-	va_start(args, format);
-	vfprintf(stderr, format, args);
-	if(format[strlen(format)-1] != '\n') fputc('\n', stderr);
-	va_end(args);
-	exit(EXIT_FAILURE);
-}
+
+#ifndef FINE_LOG_MIN
+#define FINE_LOG_MIN DEBUG
+#endif
+
+extern _Atomic(int) fine_log_level;
+
+#define fine_log(LEVEL, ...) \
+	((LEVEL) >= FINE_LOG_MIN && (LEVEL) >= atomic_load_explicit(&fine_log_level, memory_order_relaxed) \
+		? fine_log_write((LEVEL), __VA_ARGS__) : (void)0)
+
+void fine_log_write(int type, char const*restrict format, ...);
+
+//Reads FINE_LOG_LEVEL and starts the log thread
+void fine_log_init(void);
+
+//Writes out everything queued so far
+void fine_log_flush(void);
+
+//Flushes and stops the log thread
+void fine_log_shutdown(void);
+
+//Flushes the log, prints the message to stderr and exits with EXIT_FAILURE
+_Noreturn void fine_exit(char const*restrict format, ...);
@@ -0,0 +1,97 @@
+#include "fine_mix.h"
+#include "fine_definitions.h"
+#include "fine_log.h"
+#include "fine_kernel.h"
+#include "p99/p99.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+void fine_mix_limiter_init(Limiter *const lim, float const release_ms, size_t const lookahead_ms, unsigned const sample_rate,
+	size_t const channels) {
+	float const blocks_per_tau = release_ms*0.001f*sample_rate/MIX_BLOCK;
+	*lim = (Limiter){
+		.ceiling = INT16_MAX,
+		.max_gain = 1.0f,
+		.release = blocks_per_tau > 0 ? expf(-1.0f/blocks_per_tau) : 0,
+		.lookahead = (lookahead_ms*sample_rate/1000 + MIX_BLOCK-1)/MIX_BLOCK,
+		.gain = 1.0f,
+		.channels = channels,
+	};
+}
+
+size_t fine_mix_channels_from_env(void) {
+	char const*const env = getenv("FINE_CHANNELS");
+	if(!env || !*env) return 1;
+	char *end;
+	unsigned long const num = strtoul(env, &end, 10);
+	if(*end || num < 1 || num > MAX_CHANNELS) {
+		fine_log(WARN, "FINE_CHANNELS=%s is not a number of channels from 1 to %d, using 1", env, MAX_CHANNELS);
+		return 1;
+	}
+	return num;
+}
+
+void fine_mix_pan(float *const gains, size_t const channels, float const pos) {
+	for(size_t c = 0; c < channels; ++c) gains[c] = 0;
+	if(channels == 1) {
+		gains[0] = 1;
+		return;
+	}
+	//the speakers a and b enclose the clip, spread radians apart, the clip is x past a
+	size_t a;
+	float spread, x;
+	if(channels == 2) {
+		a = 0;
+		spread = M_PI/2;
+		x = P99_MINOF(1.0f, P99_MAXOF(0.0f, pos))*spread;
+	} else {
+		float const p = (pos - floorf(pos))*channels;
+		a = (size_t)p % channels;
+		spread = 2*M_PI/channels;
+		x = (p - floorf(p))*spread;
+	}
+	//the gains that sum the speaker directions to the clip direction, their 1/sin(spread) cancels out
+	float const ga = sinf(spread - x), gb = sinf(x);
+	float const norm = 1/hypotf(ga, gb);
+	gains[a] = ga*norm;
+	gains[(a+1) % channels] = gb*norm;
+}
+
+void fine_mix_add(float *const acc, i16 const*const src, size_t const n) {
+	fine_kernels->mix_add(acc, src, n);
+}
+
+void fine_mix_pan_add(float *const acc, i16 const*const src, size_t const n, size_t const channels, float const*const gains) {
+	fine_kernels->pan_add(acc, src, n, channels, gains);
+}
+
+void fine_mix_pan_add_f(float *const acc, float const*const src, size_t const n, size_t const channels, float const*const gains) {
+	fine_kernels->pan_add_f(acc, src, n, channels, gains);
+}
+
+void fine_mix_limit(i16 *const out, float const*const in, size_t const frames, Limiter *const lim) {
+	//the gain steps once per MIX_BLOCK frames, the same for all their channels
+	size_t const n = frames*lim->channels, block = MIX_BLOCK*lim->channels;
+	size_t const num_blocks = (n + block-1)/block;
+	if(!num_blocks) return;
+	//gains[b] is the gain at the start of block b
+	float *const peaks = malloc((2*num_blocks+1)*sizeof *peaks);
+	if(!peaks) fine_exit("Could not allocate limiter peaks");
+	float *const gains = peaks + num_blocks;
+
+	fine_kernels->block_peaks(peaks, in, n, block);
+
+	gains[0] = lim->gain;
+	for(size_t b = 0; b < num_blocks; ++b) {
+		float window_peak = 0;
+		for(size_t j = b; j <= b + lim->lookahead && j < num_blocks; ++j) window_peak = P99_MAXOF(window_peak, peaks[j]);
+
+		float const target = window_peak*lim->max_gain > lim->ceiling ? lim->ceiling/window_peak : lim->max_gain;
+		//attack within this block, the look-ahead makes up for it. Release never goes past the target.
+		gains[b+1] = target < gains[b] ? target : target + (gains[b] - target)*lim->release;
+	}
+	fine_kernels->ramp_f(out, in, n, block, gains);
+	lim->gain = gains[num_blocks];
+	free(peaks);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "fine_definitions.h"
+
+/*
+ * Mixing stage at the end of a collage.
+ * Clips are accumulated in float, then a look-ahead limiter converts the mix back to i16.
+ * The limiter finds the peak of every MIX_BLOCK frames, takes the smallest gain that keeps the next
+ * lookahead blocks under the ceiling, and ramps the gain linearly across each block.
+ * So the gain is already down when a peak arrives and no sample has to branch.
+ * Both loops are in the kernel tables (fine_kernel.h).
+ *
+ * The output has 1 to MAX_CHANNELS channels, interleaved. Two are left and right, more stand evenly around
+ * the room in channel order, starting in front. A clip is panned to a position in [0, 1): left to right,
+ * or once around the room. It plays from the two speakers next to it, with vector base amplitude
+ * panning (VBAP) normalized to constant power, so it is as loud everywhere.
+ * */
+#define MIX_BLOCK 64 //frames per gain step
+
+typedef struct Limiter Limiter;
+struct Limiter {
+	float ceiling; //largest output magnitude
+	float max_gain;
+	float release; //per block: how much of the distance to a higher target gain remains after a block
+	size_t lookahead; //in blocks
+	float gain; //current gain, carried over between calls
+	size_t channels; //of the frames, one gain for all of them
+};
+
+void fine_mix_limiter_init(Limiter *lim, float release_ms, size_t lookahead_ms, unsigned sample_rate, size_t channels);
+
+//FINE_CHANNELS, the output channels. Default 1
+size_t fine_mix_channels_from_env(void);
+
+//Fills gains[channels] for a clip at pos in [0, 1). Beyond that it wraps around the room, with two channels it is clamped
+void fine_mix_pan(float *gains, size_t channels, float pos);
+
+//acc[i] += src[i]
+void fine_mix_add(float *acc, i16 const* src, size_t n);
+
+//Adds n mono samples of src to n frames of acc, channel c scaled by gains[c]
+void fine_mix_pan_add(float *acc, i16 const* src, size_t n, size_t channels, float const* gains);
+void fine_mix_pan_add_f(float *acc, float const* src, size_t n, size_t channels, float const* gains);
+
+//Applies the limiter to n frames of in and packs them to out with saturation
+void fine_mix_limit(i16 *out, float const* in, size_t n, Limiter *lim);
@@ -0,0 +1,118 @@
+#include "fine_plan.h"
+#include "fine_definitions.h"
+#include "fine_log.h"
+#include "p99/p99.h"
+
+PlanCost const fine_plan_cost_default = {
+	.clip = 10,
+	.reverb = 30,
+	.mix = 5,
+};
+
+void gen_samples(p99_seed *const seed,
+	TimeFrame *const smpl_arr, Recording const*const recordings, size_t const newest_rec_idx,
+	size_t const*const indices, size_t const end_idx, size_t const max_num_samples) {
+
+	assert(end_idx <= OPT_NUM_RECORDINGS);
+
+	size_t const step = RECORDING_SIZE/(8*3); //allow thirds and eights
+	assert(step>0);
+	size_t left = max_num_samples;
+	for(size_t i = 0; i < end_idx; ++i) {
+		size_t const recsz = recordings[((size_t)MAX_NUM_REC + newest_rec_idx-indices[i])%MAX_NUM_REC].sz;
+		if(!recsz ){
+			fine_log(WARN, "Warning: Recording of size zero");
+			smpl_arr[i] = (TimeFrame){0,0};
+			continue;
+		}
+		size_t const requestedsz = step*(fine_rand_below(seed, recsz)/step);
+		size_t const finalsz = P99_MINOF(requestedsz == 0 ? recsz : requestedsz, left);
+		smpl_arr[i].num_samples=finalsz;
+		size_t const reqoffs = step*(fine_rand_below(seed, recsz-finalsz+1)/step);
+		smpl_arr[i].offs = fine_rand_below(seed, 3)? 0 : reqoffs;
+		left -= finalsz;
+
+		assert(smpl_arr[i].num_samples+smpl_arr[i].offs <= RECORDING_SIZE);
+	}
+}
+
+//Lays the clips out one after the other, each overlapping the one before it
+static void place_clips(Plan *const plan) {
+	size_t pos = 0;
+	plan->total_samples = 0;
+	for(size_t i = 0; i < plan->num_clips; ++i) {
+		PlanClip *const c = plan->clips+i;
+		c->write_pos = pos;
+		if(c->num_samples)
+			plan->total_samples = P99_MAXOF(plan->total_samples, pos + c->num_samples + plan->num_tail_samples);
+		pos += c->num_samples;
+		if(i < plan->num_clips-1) pos -= c->overlap;
+	}
+}
+
+double fine_plan_estimate_ns(Plan const*const plan, PlanCost const*const cost) {
+	//panning and limiting are per channel, everything before is mono
+	double const mix = (double)cost->mix*plan->channels;
+	double ns = plan->total_samples*mix;
+	for(size_t i = 0; i < plan->num_clips; ++i) {
+		size_t const n = plan->clips[i].num_samples;
+		if(!n) continue;
+		ns += (double)n*cost->clip + (double)(n + plan->num_tail_samples)*(cost->reverb + mix);
+	}
+	return ns;
+}
+
+int fine_plan_build(Plan *const plan, p99_seed *const seed, Recording const*const recordings, size_t const newest_rec_idx,
+	size_t const*const indices, size_t const num_indices, PlanBudget const*const budget) {
+
+	assert(num_indices <= OPT_NUM_RECORDINGS);
+	assert(budget->min_tail_samples <= budget->num_tail_samples);
+	assert(budget->num_tail_samples < budget->max_samples);
+
+	//Overlaps only make the collage shorter, so capping the sum of the clips bounds the length
+	TimeFrame timeframes[OPT_NUM_RECORDINGS] = {0};
+	gen_samples(seed, timeframes, recordings, newest_rec_idx, indices, num_indices, budget->max_samples - budget->num_tail_samples);
+
+	*plan = (Plan){.num_clips = num_indices, .num_tail_samples = budget->num_tail_samples, .channels = budget->channels};
+	for(size_t i = 0; i < num_indices; ++i) {
+		unsigned const gain_choice = fine_rand_below(seed, 3);
+		float const r1 = (float)fine_rand_below(seed, 4)/3;
+		float const r2 = (float)fine_rand_below(seed, 3)/2;
+		float const r3 = (float)fine_rand_below(seed, 3)/2;
+		size_t const num_fade = timeframes[i].num_samples/8;
+		plan->clips[i] = (PlanClip){
+			.index = indices[i],
+			.offs = timeframes[i].offs,
+			.num_samples = timeframes[i].num_samples,
+			.num_fade = num_fade,
+			//"blend" the clips together
+			.overlap = (4*(1-r2)+2)*num_fade,
+			.gain_choice = gain_choice,
+			.room = r1,
+			.damp = r1,
+			.wet = r3,
+			.dry = 1-r3,
+		};
+	}
+	//drawn last and only when it matters, so a seed still gives the same mono collage
+	for(size_t i = 0; i < num_indices && plan->channels > 1; ++i) plan->clips[i].pan = (float)fine_rand_below(seed, 1 << 16)/(1 << 16);
+	place_clips(plan);
+	plan->est_render_ns = fine_plan_estimate_ns(plan, &budget->cost);
+
+	while(budget->max_render_ns > 0 && plan->est_render_ns > budget->max_render_ns) {
+		if(plan->num_clips > 1) {
+			--plan->num_clips;
+		}
+		else if(plan->num_tail_samples > budget->min_tail_samples) {
+			plan->num_tail_samples = P99_MAXOF(plan->num_tail_samples/2, budget->min_tail_samples);
+		}
+		else {
+			fine_log(WARN, "plan: %.0f ms estimated render time is over the %.0f ms budget",
+				plan->est_render_ns/1e6, budget->max_render_ns/1e6);
+			return -1;
+		}
+		place_clips(plan);
+		plan->est_render_ns = fine_plan_estimate_ns(plan, &budget->cost);
+	}
+	return 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "fine_definitions.h"
+#include "fine_rand.h"
+
+/*
+ * Collage planner. Every random choice of a collage is made here, before any DSP runs:
+ * which slice of each recording is used, where it lands in the collage, and the FX parameters.
+ * render_recordings only executes the plan, so its length and cost are known up front.
+ * */
+
+typedef struct TimeFrame TimeFrame;
+struct TimeFrame {
+	size_t offs;
+	size_t num_samples;
+};
+
+typedef struct PlanClip PlanClip;
+struct PlanClip {
+	size_t index; //0 means the newest recording, like gen_indices
+	size_t offs;
+	size_t num_samples;
+	size_t write_pos; //first sample of the clip in the collage
+	size_t num_fade; //fade in and fade out length
+	size_t overlap; //how many samples before the end of this clip the next one starts
+	unsigned gain_choice; //amplify by 6 + 5*gain_choice
+	float room;
+	float damp;
+	float wet;
+	float dry;
+	float pan; //where it plays from, see fine_mix_pan. Only drawn with more than one channel
+};
+
+typedef struct Plan Plan;
+struct Plan {
+	size_t num_clips;
+	PlanClip clips[OPT_NUM_RECORDINGS];
+	size_t num_tail_samples; //reverb tail rendered after each clip
+	size_t total_samples; //length of the rendered collage, in frames
+	size_t channels; //of the output, 1 to MAX_CHANNELS
+	double est_render_ns;
+};
+
+/* Cost model of render_recordings, in ns per sample.
+ * Defaults are measured with the build.sh flags on an x86 desktop. Scale them for slower machines.
+ * */
+typedef struct PlanCost PlanCost;
+struct PlanCost {
+	float clip; //amplify + compress + fade, per clip sample
+	float reverb; //per clip sample and per tail sample
+	float mix; //mixing and limiting, per collage sample and channel
+};
+extern PlanCost const fine_plan_cost_default;
+
+typedef struct PlanBudget PlanBudget;
+struct PlanBudget {
+	size_t max_samples; //length of the output buffer, in frames
+	size_t channels; //of the output frames
+	size_t num_tail_samples;
+	size_t min_tail_samples; //the tail is shortened down to this before giving up on the CPU budget
+	double max_render_ns; //0 means no limit
+	PlanCost cost;
+};
+
+/*
+ * @param arr should be zeroed
+ * The size of the array is always OPT_NUM_RECORDINGS
+ * The clips are cut so that their lengths sum to at most max_num_samples.
+ * */
+void gen_samples(p99_seed *seed, TimeFrame *smpl_arr, Recording const* recordings, size_t newest_rec_idx,
+	size_t const* indices, size_t end_idx, size_t max_num_samples);
+
+/*
+ * Builds the plan for the recordings in indices (from gen_indices).
+ * Clips are dropped from the end, then the tail is shortened, until the estimated cost fits the budget.
+ * @return 0 if the plan fits the budget, -1 if it still does not with one clip and the shortest tail
+ * */
+int fine_plan_build(Plan *plan, p99_seed *seed, Recording const* recordings, size_t newest_rec_idx,
+	size_t const* indices, size_t num_indices, PlanBudget const* budget);
+
+double fine_plan_estimate_ns(Plan const* plan, PlanCost const* cost);
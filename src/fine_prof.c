@@ -0,0 +1,307 @@
+#include "fine_prof.h"
+#include "fine_log.h"
+#include "p99/p99.h"
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define PROF_RING_SZ 16384 //spans per thread between two collects, power of two
+#define PROF_MAX_THREADS 64 //spans of further threads are dropped
+#define PROF_SUB_BITS 4 //16 buckets per octave
+#define TRACE_RING_SZ 16384 //latest events per thread in a trace, power of two
+/* --- END DEFINITIONS FOR TUNING --- */
+
+#define PROF_SUB (1u << PROF_SUB_BITS)
+#define PROF_NUM_BUCKETS (64*PROF_SUB)
+#define PROF_NS_MASK ((UINT64_C(1) << 56) - 1) //a span is packed as stage << 56 | ns
+
+static char const*const stage_names[FINE_NUM_STAGES] = {
+	[FINE_STAGE_CAPTURE] = "capture",
+	[FINE_STAGE_ENVELOPE] = "envelope",
+	[FINE_STAGE_ECHO] = "echo",
+	[FINE_STAGE_TRIGGER] = "trigger",
+	[FINE_STAGE_RECORD] = "record",
+	[FINE_STAGE_PUBLISH] = "publish",
+	[FINE_STAGE_LOCK] = "lock",
+	[FINE_STAGE_GEN] = "gen",
+	[FINE_STAGE_PLAN] = "plan",
+	[FINE_STAGE_PER_CLIP] = "per clip",
+	[FINE_STAGE_CLIP] = "clip",
+	[FINE_STAGE_COMPRESS] = "compress",
+	[FINE_STAGE_FADE] = "fade",
+	[FINE_STAGE_REVERB] = "reverb",
+	[FINE_STAGE_MIX] = "mix",
+	[FINE_STAGE_LIMIT] = "limit",
+	[FINE_STAGE_RENDER] = "render",
+	[FINE_STAGE_VOICES] = "voices",
+	[FINE_STAGE_GRAINS] = "grains",
+	[FINE_STAGE_PLAYBACK] = "playback",
+	[FINE_STAGE_RESPONSE] = "response",
+};
+
+//Relaxed atomics, so a dump while the owner writes is not a data race
+typedef struct TraceEvent TraceEvent;
+struct TraceEvent {
+	_Atomic(size_t) seq; //its position in the ring +1, 0 while it is written. The dump drops it if that changes
+	_Atomic(uint64_t) start;
+	_Atomic(uint64_t) span; //packed like in ProfRing
+};
+
+//Single producer (the owning thread), single consumer (fine_prof_collect, under hist_mtx)
+typedef struct ProfRing ProfRing;
+struct ProfRing {
+	_Alignas(64) _Atomic(size_t) head; //written by the owner
+	_Alignas(64) _Atomic(size_t) tail; //written by the collector
+	_Atomic(uint64_t) dropped;
+	uint64_t spans[PROF_RING_SZ];
+
+	char name[16];
+	_Atomic(size_t) trace_head; //events are overwritten, nobody consumes them
+	TraceEvent *trace; //0 if tracing is off
+};
+
+typedef struct ProfHist ProfHist;
+struct ProfHist {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[PROF_NUM_BUCKETS];
+};
+
+static ProfRing *_Atomic rings[PROF_MAX_THREADS];
+static _Atomic(size_t) num_rings;
+static _Atomic(uint64_t) dropped_threads; //spans of threads beyond PROF_MAX_THREADS
+static thread_local ProfRing *my_ring;
+static thread_local bool no_ring;
+
+static bool trace_on; //set before the other threads start
+static char const* trace_path;
+static mtx_t trace_mtx; //one dump at a time, the signal thread and the exit path can both write it
+
+static ProfHist hists[FINE_NUM_STAGES];
+static uint64_t num_dropped;
+static mtx_t hist_mtx;
+static once_flag hist_once = ONCE_FLAG_INIT;
+
+static void hist_init(void) { mtx_init(&hist_mtx, mtx_plain); }
+
+static ProfRing *get_ring(void) {
+	if(my_ring || no_ring) return my_ring;
+	size_t const idx = atomic_fetch_add_explicit(&num_rings, 1, memory_order_relaxed);
+	if(idx >= PROF_MAX_THREADS || !(my_ring = calloc(1, sizeof *my_ring))
+		|| (trace_on && !(my_ring->trace = calloc(TRACE_RING_SZ, sizeof *my_ring->trace)))) {
+		fine_log(WARN, "No timing ring for this thread, its spans are dropped");
+		if(my_ring) free(my_ring);
+		my_ring = 0;
+		no_ring = 1;
+		return 0;
+	}
+	snprintf(my_ring->name, sizeof my_ring->name, "thread %zu", idx);
+	atomic_store_explicit(rings+idx, my_ring, memory_order_release);
+	return my_ring;
+}
+
+static void trace_push(ProfRing *const r, uint64_t const start, uint64_t const span) {
+	size_t const head = atomic_load_explicit(&r->trace_head, memory_order_relaxed);
+	TraceEvent *const ev = r->trace + head%TRACE_RING_SZ;
+	atomic_store_explicit(&ev->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&ev->start, start, memory_order_relaxed);
+	atomic_store_explicit(&ev->span, span, memory_order_relaxed);
+	atomic_store_explicit(&ev->seq, head+1, memory_order_release);
+	atomic_store_explicit(&r->trace_head, head+1, memory_order_release);
+}
+
+void fine_prof_span(int const stage, uint64_t const start, uint64_t const end) {
+	ProfRing *const r = get_ring();
+	if(!r) {
+		atomic_fetch_add_explicit(&dropped_threads, 1, memory_order_relaxed);
+		return;
+	}
+	uint64_t const span = (uint64_t)stage << 56 | (end > start ? P99_MINOF(end - start, PROF_NS_MASK) : 0);
+	if(r->trace) trace_push(r, start, span);
+
+	size_t const head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if(head - atomic_load_explicit(&r->tail, memory_order_acquire) >= PROF_RING_SZ) {
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	r->spans[head % PROF_RING_SZ] = span;
+	atomic_store_explicit(&r->head, head+1, memory_order_release);
+}
+
+void fine_prof_thread(char const*const name) {
+	ProfRing *const r = get_ring();
+	if(r) snprintf(r->name, sizeof r->name, "%s", name);
+}
+
+static size_t bucket_of(uint64_t const ns) {
+	if(ns < PROF_SUB) return ns;
+	unsigned const e = 63 - __builtin_clzll(ns); //>= PROF_SUB_BITS
+	return (e - PROF_SUB_BITS + 1)*PROF_SUB + ((ns >> (e - PROF_SUB_BITS)) & (PROF_SUB-1));
+}
+
+//@return the middle of bucket b
+static uint64_t bucket_value(size_t const b) {
+	if(b < PROF_SUB) return b;
+	unsigned const e = b/PROF_SUB + PROF_SUB_BITS - 1;
+	uint64_t const width = UINT64_C(1) << (e - PROF_SUB_BITS);
+	return (PROF_SUB + b%PROF_SUB)*width + width/2;
+}
+
+static void hist_add(ProfHist *const h, uint64_t const ns) {
+	++h->count;
+	h->total_ns += ns;
+	h->max_ns = P99_MAXOF(h->max_ns, ns);
+	++h->buckets[bucket_of(ns)];
+}
+
+static uint64_t hist_percentile(ProfHist const*const h, double const p) {
+	uint64_t const rank = p*h->count + 0.5;
+	uint64_t seen = 0;
+	for(size_t b = 0; b < PROF_NUM_BUCKETS; ++b) {
+		seen += h->buckets[b];
+		if(seen && seen >= rank) return P99_MINOF(bucket_value(b), h->max_ns);
+	}
+	return h->max_ns;
+}
+
+//hist_mtx must be held
+static void collect(void) {
+	size_t const n = P99_MINOF(atomic_load_explicit(&num_rings, memory_order_acquire), PROF_MAX_THREADS);
+	for(size_t i = 0; i < n; ++i) {
+		ProfRing *const r = atomic_load_explicit(rings+i, memory_order_acquire);
+		if(!r) continue;
+		size_t const head = atomic_load_explicit(&r->head, memory_order_acquire);
+		size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		for(; tail != head; ++tail) {
+			uint64_t const span = r->spans[tail % PROF_RING_SZ];
+			hist_add(hists + (span >> 56), span & PROF_NS_MASK);
+		}
+		atomic_store_explicit(&r->tail, tail, memory_order_release);
+		num_dropped += atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+	}
+	num_dropped += atomic_exchange_explicit(&dropped_threads, 0, memory_order_relaxed);
+}
+
+void fine_prof_collect(void) {
+	call_once(&hist_once, hist_init);
+	mtx_lock(&hist_mtx);
+	collect();
+	mtx_unlock(&hist_mtx);
+}
+
+static void stats_of(ProfHist const*const h, ProfStats *const stats) {
+	*stats = (ProfStats){
+		.count = h->count,
+		.total_ns = h->total_ns,
+		.p50_ns = hist_percentile(h, 0.5),
+		.p99_ns = hist_percentile(h, 0.99),
+		.max_ns = h->max_ns,
+	};
+}
+
+void fine_prof_stats(int const stage, ProfStats *const stats) {
+	call_once(&hist_once, hist_init);
+	mtx_lock(&hist_mtx);
+	collect();
+	stats_of(hists+stage, stats);
+	mtx_unlock(&hist_mtx);
+}
+
+char const* fine_prof_stage_name(int const stage) {
+	return stage >= 0 && stage < FINE_NUM_STAGES ? stage_names[stage] : "?";
+}
+
+void fine_prof_report(int const level) {
+	call_once(&hist_once, hist_init);
+	mtx_lock(&hist_mtx);
+	collect();
+	fine_log(level, "%-9s %8s %10s %10s %10s %10s", "stage", "count", "p50 ms", "p99 ms", "max ms", "total ms");
+	for(int s = 0; s < FINE_NUM_STAGES; ++s) {
+		if(!hists[s].count) continue;
+		ProfStats st;
+		stats_of(hists+s, &st);
+		fine_log(level, "%-9s %8" PRIu64 " %10.3f %10.3f %10.3f %10.1f", stage_names[s], st.count,
+			st.p50_ns/1e6, st.p99_ns/1e6, st.max_ns/1e6, st.total_ns/1e6);
+	}
+	if(num_dropped) fine_log(level, "%" PRIu64 " spans dropped", num_dropped);
+	mtx_unlock(&hist_mtx);
+}
+
+long fine_trace_dump(void) {
+	if(!trace_on) return -1;
+	mtx_lock(&trace_mtx);
+	FILE *const file = fopen(trace_path, "w");
+	if(!file) {
+		fine_log(WARN, "Could not open trace file %s", trace_path);
+		mtx_unlock(&trace_mtx);
+		return -1;
+	}
+	int const pid = getpid();
+	long num = 0;
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	size_t const n = P99_MINOF(atomic_load_explicit(&num_rings, memory_order_acquire), PROF_MAX_THREADS);
+	for(size_t i = 0; i < n; ++i) {
+		ProfRing *const r = atomic_load_explicit(rings+i, memory_order_acquire);
+		if(!r) continue;
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}",
+			num++ ? ",\n" : "", pid, i, r->name);
+		size_t const head = atomic_load_explicit(&r->trace_head, memory_order_acquire);
+		size_t const first = head > TRACE_RING_SZ ? head - TRACE_RING_SZ : 0;
+		for(size_t e = first; e < head; ++e) {
+			TraceEvent *const ev = r->trace + e%TRACE_RING_SZ;
+			//the owner goes on writing, an event it overwrote meanwhile is left out
+			if(atomic_load_explicit(&ev->seq, memory_order_acquire) != e+1) continue;
+			uint64_t const start = atomic_load_explicit(&ev->start, memory_order_relaxed);
+			uint64_t const span = atomic_load_explicit(&ev->span, memory_order_relaxed);
+			atomic_thread_fence(memory_order_acquire);
+			if(atomic_load_explicit(&ev->seq, memory_order_relaxed) != e+1) continue;
+			//Chrome traces count in microseconds
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+				fine_prof_stage_name(span >> 56), pid, i, start/1e3, (span & PROF_NS_MASK)/1e3);
+			++num;
+		}
+	}
+	fprintf(file, "\n]}\n");
+	int const closed = fclose(file);
+	mtx_unlock(&trace_mtx);
+	if(closed) {
+		fine_log(WARN, "Could not write trace file %s", trace_path);
+		return -1;
+	}
+	fine_log(INFO, "trace with %ld events written to %s", num, trace_path);
+	return num;
+}
+
+static int trace_signal_thread(void *ptr) {
+	sigset_t *const set = ptr;
+	int sig;
+	while(!sigwait(set, &sig)) fine_trace_dump();
+	return 0;
+}
+
+void fine_trace_init(void) {
+	char const*const env = getenv("FINE_TRACE");
+	if(!env || !*env) return;
+	trace_path = env;
+	mtx_init(&trace_mtx, mtx_plain);
+	trace_on = 1;
+
+	static sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	//threads started from now on inherit the mask, only the signal thread takes SIGUSR1
+	thrd_t thrd;
+	if(pthread_sigmask(SIG_BLOCK, &set, 0) || thrd_create(&thrd, trace_signal_thread, &set) != thrd_success) {
+		fine_log(WARN, "No trace on SIGUSR1, only on exit");
+		return;
+	}
+	thrd_detach(thrd);
+	fine_log(INFO, "tracing to %s, send SIGUSR1 to write it", trace_path);
+}
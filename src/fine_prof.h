@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Stage timing for the hot paths, cheap enough to stay on.
+ * A thread records a span with two fine_prof_now() calls and fine_prof_end/fine_prof_span, which push
+ * (stage, ns) into a ring owned by that thread: no locks and no shared cache lines on the audio path.
+ * fine_prof_collect drains all rings into one histogram per stage (buckets 6% wide),
+ * fine_prof_stats and fine_prof_report read p50/p99/max from them.
+ *
+ * With FINE_TRACE=file.json every span is also kept with its timestamps in a second ring per thread,
+ * which keeps the latest events. The file is written on SIGUSR1 and on exit, and opens in
+ * chrome://tracing or ui.perfetto.dev. Without FINE_TRACE this costs one branch per span.
+ * */
+
+enum FineStage {
+	FINE_STAGE_CAPTURE, //one read from the input device
+	FINE_STAGE_ENVELOPE, //envelope of one captured period
+	FINE_STAGE_ECHO, //one block of the echo canceller, see fine_aec.h
+	FINE_STAGE_TRIGGER, //threshold crossed until the pre-roll is copied
+	FINE_STAGE_RECORD, //pre-roll copied until the recording ends
+	FINE_STAGE_PUBLISH, //recording done until it can be drawn
+	FINE_STAGE_LOCK, //waiting for playback_mtx
+	FINE_STAGE_GEN, //drawing the recordings of a collage
+	FINE_STAGE_PLAN,
+	FINE_STAGE_PER_CLIP, //everything for one clip, the next five stages are part of it
+	FINE_STAGE_CLIP, //copy + amplify of one clip
+	FINE_STAGE_COMPRESS,
+	FINE_STAGE_FADE,
+	FINE_STAGE_REVERB,
+	FINE_STAGE_MIX,
+	FINE_STAGE_LIMIT,
+	FINE_STAGE_RENDER, //a whole collage
+	FINE_STAGE_VOICES, //one block of all voices, see fine_voice.h
+	FINE_STAGE_GRAINS, //one block of all grains, see fine_grain.h
+	FINE_STAGE_PLAYBACK, //one write to the output device, long ones are stalls
+	FINE_STAGE_RESPONSE, //recording published until its collage starts playing
+	FINE_NUM_STAGES
+};
+
+typedef struct ProfStats ProfStats;
+struct ProfStats {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	uint64_t max_ns;
+};
+
+inline uint64_t fine_prof_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec*1000000000u + t.tv_nsec;
+}
+
+//Records end-start for stage in the ring of the calling thread. Dropped if the ring is full.
+void fine_prof_span(int stage, uint64_t start, uint64_t end);
+
+//Records the span from start until now. @return now, the start of the next span
+inline uint64_t fine_prof_end(int const stage, uint64_t const start) {
+	uint64_t const now = fine_prof_now();
+	fine_prof_span(stage, start, now);
+	return now;
+}
+
+//Drains the rings of all threads into the histograms. Any thread may call it.
+void fine_prof_collect(void);
+
+//Collects, then fills stats for one stage
+void fine_prof_stats(int stage, ProfStats *stats);
+
+char const* fine_prof_stage_name(int stage);
+
+//Collects, then logs a table of all stages with spans at level
+void fine_prof_report(int level);
+
+//Names the calling thread in traces
+void fine_prof_thread(char const* name);
+
+/*
+ * Reads FINE_TRACE and, if it is set, starts tracing and a thread that dumps the trace on SIGUSR1.
+ * Must be called before any other thread is started: SIGUSR1 gets blocked in all threads but that one.
+ * */
+void fine_trace_init(void);
+
+/*
+ * Writes the events in the trace rings as Chrome trace JSON to the FINE_TRACE file, one call at a time
+ * @return the number of events written, -1 on error or if tracing is off
+ * */
+long fine_trace_dump(void);
@@ -0,0 +1,34 @@
+#include "fine_rand.h"
+#include "fine_log.h"
+#include <stdlib.h>
+#include <time.h>
+
+static uint64_t splitmix64(uint64_t *const x) {
+	uint64_t z = (*x += 0x9E3779B97F4A7C15u);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+	return z ^ (z >> 31);
+}
+
+void fine_rand_seed(p99_seed *const seed, uint64_t value) {
+	//splitmix never gives long runs of zero bits, which xorshift can't recover from
+	for(size_t j = 0; j < 2; ++j) {
+		for(size_t i = 0; i < p00_seed160_len; ++i) {
+			(*seed)[j][i] = splitmix64(&value);
+		}
+	}
+}
+
+uint64_t fine_rand_seed_from_env(void) {
+	char const*const env = getenv("FINE_SEED");
+	if(env && *env) {
+		char *end = 0;
+		uint64_t const value = strtoull(env, &end, 0);
+		if(!*end) return value;
+		fine_log(WARN, "FINE_SEED=%s is not a number, ignoring it", env);
+	}
+	struct timespec now = {0};
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint64_t x = (uint64_t)now.tv_sec*1000000000u + now.tv_nsec;
+	return splitmix64(&x);
+}
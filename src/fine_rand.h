@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+#include <threads.h>
+#include "p99/p99_rand.h"
+
+/*
+ * Seeded random numbers for collage generation, built on the xorshift generator of p99_rand.h.
+ * Every thread uses its own state (p99_seed_get()), so render threads never contend.
+ * Seeding a state with fine_rand_seed makes everything drawn from it reproducible.
+ * */
+
+void fine_rand_seed(p99_seed *seed, uint64_t value);
+
+/* @return the value of the FINE_SEED environment variable, or a seed from the clock if it is not set */
+uint64_t fine_rand_seed_from_env(void);
+
+/* Unbiased draw in [0, n) (Lemire's multiply and reject). Returns 0 if n is 0. */
+inline uint32_t fine_rand_below(p99_seed *const seed, uint32_t const n) {
+	uint64_t m = (uint64_t)(uint32_t)p99_rand(seed) * n;
+	if((uint32_t)m < n) {
+		uint32_t const t = -n % n;
+		while((uint32_t)m < t) m = (uint64_t)(uint32_t)p99_rand(seed) * n;
+	}
+	return m >> 32;
+}
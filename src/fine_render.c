@@ -0,0 +1,176 @@
+#include "fine_render.h"
+#include "fine_definitions.h"
+#include "fine_log.h"
+#include "fine_fx.h"
+#include "fine_mix.h"
+#include "fine_prof.h"
+#include "fine_select.h"
+#include "p99/p99.h"
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+PlanBudget fine_render_budget(size_t const channels) {
+	/* --- BEGIN DEFINITIONS FOR TUNING --- */
+	size_t const NUM_TAIL_SAMPLES = SAMPLE_RATE*8; //8 seconds
+	size_t const MIN_TAIL_SAMPLES = SAMPLE_RATE*2;
+	size_t const DATA_SZ = NUM_TAIL_SAMPLES + RECORDING_SIZE*OPT_NUM_RECORDINGS; //longest collage
+	double const MAX_RENDER_MS = STREAM_AHEAD_MS*3/4; //the rest covers planning, writing and the error of the estimate
+	/* --- END DEFINITIONS FOR TUNING --- */
+
+	return (PlanBudget){
+		.max_samples = DATA_SZ,
+		.channels = channels,
+		.num_tail_samples = NUM_TAIL_SAMPLES,
+		.min_tail_samples = MIN_TAIL_SAMPLES,
+		.max_render_ns = MAX_RENDER_MS*1e6,
+		.cost = fine_plan_cost_default,
+	};
+}
+
+size_t fine_render_load_recordings(Recording *const rec_arr, Selector *const sel, char const*const dir) {
+	//16 LE
+	FILE *curfile;
+	size_t file_num = 0;
+	while(file_num < MAX_NUM_REC){
+		char fname[256] = {0};
+		snprintf(fname, sizeof fname, "%s/%zu.raw", dir, file_num);
+		curfile = fopen(fname, "rb");
+		if(!curfile) break;
+
+		fseek(curfile, 0, SEEK_END);
+		long const num_samples = ftell(curfile)/sizeof(i16);
+		if(ftell(curfile)%sizeof(i16))
+			fine_log(WARN, "Flie %zu is not divisible into 16 bit segments. Ignoring tail.", file_num);
+
+		rewind(curfile);
+
+		rec_arr[file_num].sz = fread(
+			rec_arr[file_num].data, sizeof(i16), P99_MINOF(num_samples, RECORDING_SIZE), curfile
+		);
+		fclose(curfile);
+
+		fine_select_publish(sel, file_num, fine_select_loudness(rec_arr[file_num].data, rec_arr[file_num].sz));
+		++file_num;
+	}
+	return file_num;
+}
+
+/* 
+ * 
+ * The size of the array is always OPT_NUM_RECORDINGS
+ * 0 means the newest recording, 1 means the second newest, etc.
+ * In the audio system it must be called with playback_mtx held.
+ * @return the number of recordings generated, OPT_NUM_RECORDINGS unless fewer are stored
+ * */
+size_t gen_indices(Selector *const sel, p99_seed *const seed, size_t *const arr, size_t const newest_rec_idx) {
+	//NOTE: the selector never draws the slot the input thread is writing to (the very back recording)
+
+	size_t slots[OPT_NUM_RECORDINGS];
+	size_t const num = fine_select_sample(sel, seed, slots, OPT_NUM_RECORDINGS);
+	for(size_t i = 0; i < num; ++i) {
+		arr[i] = ((size_t)MAX_NUM_REC + newest_rec_idx - slots[i])%MAX_NUM_REC;
+	}
+	return num;
+}
+
+bool fine_render_clip(i16 *const dst, ClipCache *const cache, Recording const*const recordings, size_t const slot, uint32_t const gen, PlanClip const*const clip) {
+	//Everything before the reverb only depends on the key, so it can be reused from earlier collages
+	ClipKey const key = {
+		.slot = slot,
+		.gen = gen,
+		.offs = clip->offs,
+		.num_samples = clip->num_samples,
+		.gain_choice = clip->gain_choice
+	};
+	uint64_t t = fine_prof_now();
+	i16 const*const cached = fine_clip_cache_get(cache, &key);
+	if(cached) {
+		memcpy(dst, cached, sizeof(i16)*clip->num_samples);
+		fine_prof_end(FINE_STAGE_CLIP, t);
+		return 1;
+	}
+	memcpy(dst, recordings[slot].data+clip->offs, sizeof(i16)*clip->num_samples);
+	if(!fine_gen_unchanged(&recordings[slot].gen, gen)) return 0;
+
+	fine_fx_amplify(dst, clip->num_samples, 6.0f + 5*clip->gain_choice);
+	t = fine_prof_end(FINE_STAGE_CLIP, t);
+	fine_fx_compress(dst, clip->num_samples, SAMPLE_RATE, 4000.0f, 10.0f, 3.0f, 80.0f, 1.0f);
+
+	//   fine_fx_compress(samples, n_samples, sample_rate,
+	//                    8000.0f,   // threshold (linear, same scale as int16 samples, e.g. 32767 max)
+	//                    4.0f,      // ratio (>=1.0)
+	//                    5.0f,      // attack_ms
+	//                    80.0f,     // release_ms
+	//                    1.0f);     // makeup gain (linear multiplier)
+	t = fine_prof_end(FINE_STAGE_COMPRESS, t);
+
+	fine_fx_fade_linear(dst, clip->num_samples, clip->num_fade, clip->num_fade);
+	fine_clip_cache_put(cache, &key, dst);
+	fine_prof_end(FINE_STAGE_FADE, t);
+	return 1;
+}
+
+/* Executes a plan from fine_plan_build. Clips with num_samples 0 are skipped.
+ * Every clip is rendered mono and panned while it is mixed, so the clip work doesn't grow with the channels.
+ * cancel (may be 0) is checked before every clip, so a render gives up within one clip once it is set.
+ * @return the size of the rendered sound, plan->total_samples frames, 0 if it was cancelled
+ * 
+ * */
+int render_recordings(i16 *const data, size_t data_sz, ClipCache *const cache, fine_reverb_model *const reverb, Recording const*const recordings, size_t const newest_rec_idx, Plan const*const plan, _Atomic(bool) const*const cancel) {
+	size_t const num_tail_samples = plan->num_tail_samples;
+	size_t const channels = plan->channels;
+	assert(plan->total_samples <= data_sz);
+
+	i16 *cur_render = calloc(RECORDING_SIZE+num_tail_samples,sizeof(i16));
+
+	float *mixed = calloc(data_sz*channels, sizeof *mixed);
+	for(size_t i =0 ; i < plan->num_clips; ++i) {
+		PlanClip const*const clip = plan->clips+i;
+		if(!clip->num_samples) continue;
+		if(cancel && atomic_load_explicit(cancel, memory_order_acquire)) {
+			free(cur_render);
+			free(mixed);
+			return 0;
+		}
+
+		uint64_t const clip_start = fine_prof_now();
+		//prevent reverb feedback. NOTE: if later samples affect earlier ones, this is not enough.
+		memset(cur_render+clip->num_samples, 0, num_tail_samples * sizeof(i16));
+
+		//-1 because index points to the currently working index
+		size_t const slot = ((size_t)MAX_NUM_REC + newest_rec_idx-clip->index)%MAX_NUM_REC;
+		//the input overwrites the oldest recordings, a clip of one that changed is left out
+		if(!fine_render_clip(cur_render, cache, recordings, slot, atomic_load_explicit(&recordings[slot].gen, memory_order_acquire), clip)) continue;
+
+		uint64_t t = fine_prof_now();
+		reverb_set_params(reverb, clip->room, clip->damp, clip->wet, clip->dry);
+		reverb_reset(reverb); //must be called to destroy prev. samples
+		fine_fx_reverb(cur_render, clip->num_samples+num_tail_samples, reverb);
+		t = fine_prof_end(FINE_STAGE_REVERB, t);
+
+		float gains[MAX_CHANNELS];
+		fine_mix_pan(gains, channels, clip->pan);
+		fine_mix_pan_add(mixed+clip->write_pos*channels, cur_render, clip->num_samples+num_tail_samples, channels, gains);
+		fine_prof_end(FINE_STAGE_MIX, t);
+		fine_prof_end(FINE_STAGE_PER_CLIP, clip_start);
+	}
+
+
+	free(cur_render);
+
+	size_t const total_num_samples = plan->total_samples;
+
+
+
+	//Limiter to prevent clipping. 5 ms look-ahead, 50 ms release
+	uint64_t const t = fine_prof_now();
+	Limiter lim;
+	fine_mix_limiter_init(&lim, 50.0f, 5, SAMPLE_RATE, channels);
+	fine_mix_limit(data, mixed, total_num_samples, &lim);
+	fine_prof_end(FINE_STAGE_LIMIT, t);
+	free(mixed);
+	return total_num_samples;
+}
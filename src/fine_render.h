@@ -0,0 +1,33 @@
+#pragma once
+#include "fine_definitions.h"
+#include "fine_clip_cache.h"
+#include "fine_fx_reverb.h"
+#include "fine_plan.h"
+#include "fine_rand.h"
+
+/*
+ * Collage rendering, shared by the output thread and the offline renderer (fine_batch.c).
+ * Nothing in here is global: a thread that renders needs its own ClipCache and reverb.
+ * */
+
+//The budget every collage is planned with for channels, its max_samples is the size of the output buffer in frames
+PlanBudget fine_render_budget(size_t channels);
+
+/*
+ * Loads dir/0.raw, dir/1.raw, ... (16 bit LE) into rec_arr[0], rec_arr[1], ... and publishes them in sel
+ * @return the number of files loaded
+ * */
+size_t fine_render_load_recordings(Recording *rec_arr, Selector *sel, char const* dir);
+
+size_t gen_indices(Selector *sel, p99_seed *seed, size_t *arr, size_t newest_rec_idx);
+
+/* Everything of a clip before the reverb: copy from recordings[slot], amplify, compress, fade.
+ * Taken from the cache if it was done before for the same slot, gen and clip. dst holds clip->num_samples
+ * @return 0 if the recording was overwritten while it was read, dst is then neither usable nor cached
+ * */
+bool fine_render_clip(i16 *dst, ClipCache *cache, Recording const* recordings, size_t slot, uint32_t gen, PlanClip const* clip);
+
+/* data holds data_sz frames of plan->channels
+ * @return the number of frames rendered into data, 0 if cancel (may be 0) was set before it finished */
+int render_recordings(i16 *data, size_t data_sz, ClipCache *cache, fine_reverb_model *reverb,
+	Recording const* recordings, size_t newest_rec_idx, Plan const* plan, _Atomic(bool) const* cancel);
@@ -0,0 +1,194 @@
+#include "fine_select.h"
+#include "fine_definitions.h"
+#include "fine_log.h"
+#include "fine_kernel.h"
+#include "p99/p99.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Mean absolute value at which a recording counts as fully loud. The trigger threshold is 500.
+#define SELECT_LOUDNESS_REF 1000.0f
+//Rebase the recency exponents before exp2 gets anywhere near overflowing
+#define SELECT_MAX_EXPONENT 512.0
+
+/* Recency is stored as exp2(age_exponent) relative to base_seq: publishing only has to touch the new slot,
+ * because every older recording is implicitly smaller by the time the new one is heavier. */
+struct Selector {
+	size_t n;
+	size_t count;
+	size_t msb; //highest power of two <= n, for the tree search
+	size_t num_collages;
+	uint64_t next_seq;
+	uint64_t base_seq;
+	double *tree; //1 based Fenwick tree over weight
+	double *weight;
+	float *loudness;
+	float *novelty;
+	uint64_t *seq;
+	bool *live;
+};
+
+static void tree_add(Selector *const sel, size_t const slot, double const delta) {
+	for(size_t i = slot+1; i <= sel->n; i += i & -i) sel->tree[i] += delta;
+}
+
+static double tree_total(Selector const*const sel) {
+	double sum = 0;
+	for(size_t i = sel->n; i > 0; i -= i & -i) sum += sel->tree[i];
+	return sum;
+}
+
+//@return the slot where the prefix sum of the weights first exceeds u
+static size_t tree_find(Selector const*const sel, double u) {
+	size_t pos = 0;
+	for(size_t step = sel->msb; step; step >>= 1) {
+		if(pos+step <= sel->n && sel->tree[pos+step] <= u) {
+			pos += step;
+			u -= sel->tree[pos];
+		}
+	}
+	return P99_MINOF(pos, sel->n-1);
+}
+
+static double compute_weight(Selector const*const sel, size_t const slot) {
+	if(!sel->live[slot]) return 0;
+	double const recency = exp2((double)(int64_t)(sel->seq[slot] - sel->base_seq)/SELECT_RECENCY_HALF_LIFE);
+	float const loud = 0.25f + 0.75f*P99_MINOF(sel->loudness[slot]/SELECT_LOUDNESS_REF, 1.0f);
+	return recency * loud * sel->novelty[slot];
+}
+
+static void set_weight(Selector *const sel, size_t const slot, double const w) {
+	tree_add(sel, slot, w - sel->weight[slot]);
+	sel->weight[slot] = w;
+}
+
+//O(n). Also gets rid of the rounding error the tree accumulates from repeated updates.
+static void rebuild(Selector *const sel) {
+	for(size_t i = 0; i < sel->n; ++i) sel->weight[i] = compute_weight(sel, i);
+	for(size_t i = 1; i <= sel->n; ++i) sel->tree[i] = sel->weight[i-1];
+	for(size_t i = 1; i <= sel->n; ++i) {
+		size_t const parent = i + (i & -i);
+		if(parent <= sel->n) sel->tree[parent] += sel->tree[i];
+	}
+}
+
+Selector *fine_select_create(size_t const num_slots) {
+	assert(num_slots > 0);
+	Selector *const sel = calloc(1, sizeof *sel);
+	if(!sel) fine_exit("Could not allocate selector");
+	sel->n = num_slots;
+	sel->msb = 1;
+	while(sel->msb*2 <= num_slots) sel->msb *= 2;
+	sel->tree = calloc(num_slots+1, sizeof *sel->tree);
+	sel->weight = calloc(num_slots, sizeof *sel->weight);
+	sel->loudness = calloc(num_slots, sizeof *sel->loudness);
+	sel->novelty = calloc(num_slots, sizeof *sel->novelty);
+	sel->seq = calloc(num_slots, sizeof *sel->seq);
+	sel->live = calloc(num_slots, sizeof *sel->live);
+	if(!(sel->tree && sel->weight && sel->loudness && sel->novelty && sel->seq && sel->live))
+		fine_exit("Could not allocate selector");
+	return sel;
+}
+
+Selector *fine_select_clone(Selector const*const src) {
+	Selector *const sel = fine_select_create(src->n);
+	double *const tree = sel->tree, *const weight = sel->weight;
+	float *const loudness = sel->loudness, *const novelty = sel->novelty;
+	uint64_t *const seq = sel->seq;
+	bool *const live = sel->live;
+	*sel = *src;
+	sel->tree = memcpy(tree, src->tree, (src->n+1)*sizeof *tree);
+	sel->weight = memcpy(weight, src->weight, src->n*sizeof *weight);
+	sel->loudness = memcpy(loudness, src->loudness, src->n*sizeof *loudness);
+	sel->novelty = memcpy(novelty, src->novelty, src->n*sizeof *novelty);
+	sel->seq = memcpy(seq, src->seq, src->n*sizeof *seq);
+	sel->live = memcpy(live, src->live, src->n*sizeof *live);
+	return sel;
+}
+
+void fine_select_destroy(Selector *const sel) {
+	if(!sel) return;
+	free(sel->tree);
+	free(sel->weight);
+	free(sel->loudness);
+	free(sel->novelty);
+	free(sel->seq);
+	free(sel->live);
+	free(sel);
+}
+
+float fine_select_loudness(i16 const*const data, size_t const sz) {
+	if(!sz) return 0;
+	return (float)fine_kernels->abs_sum(data, sz)/sz;
+}
+
+void fine_select_publish(Selector *const sel, size_t const slot, float const loudness) {
+	assert(slot < sel->n);
+	if(!sel->live[slot]) ++sel->count;
+	sel->live[slot] = 1;
+	sel->loudness[slot] = loudness;
+	sel->novelty[slot] = 1;
+	sel->seq[slot] = sel->next_seq++;
+	if((double)(sel->seq[slot] - sel->base_seq) > SELECT_MAX_EXPONENT*SELECT_RECENCY_HALF_LIFE) {
+		//Older recordings get negative exponents, relative weights stay the same
+		sel->base_seq = sel->seq[slot];
+		rebuild(sel);
+		return;
+	}
+	set_weight(sel, slot, compute_weight(sel, slot));
+}
+
+void fine_select_remove(Selector *const sel, size_t const slot) {
+	assert(slot < sel->n);
+	if(!sel->live[slot]) return;
+	sel->live[slot] = 0;
+	--sel->count;
+	set_weight(sel, slot, 0);
+}
+
+size_t fine_select_count(Selector const*const sel) {
+	return sel->count;
+}
+
+size_t fine_select_sample(Selector *const sel, p99_seed *const seed, size_t *const slots, size_t const k) {
+	size_t const want = P99_MINOF(k, sel->count);
+	size_t got = 0;
+	//Take every drawn slot out of the tree so the next draw can't repeat it
+	while(got < want) {
+		double const total = tree_total(sel);
+		size_t slot = sel->n;
+		if(total > 0) slot = tree_find(sel, p99_drand(seed)*total);
+		if(slot == sel->n || sel->weight[slot] <= 0) {
+			//rounding put us on an empty slot (or the weights underflowed): take the next live one
+			size_t const start = slot == sel->n ? 0 : slot;
+			slot = sel->n;
+			for(size_t i = 0; i < sel->n; ++i) {
+				size_t const j = (start+i)%sel->n;
+				if(sel->live[j] && sel->weight[j] > 0) { slot = j; break; }
+			}
+			if(slot == sel->n) {
+				for(size_t i = 0; i < sel->n; ++i) {
+					size_t const j = (start+i)%sel->n;
+					bool taken = 0;
+					for(size_t t = 0; t < got; ++t) taken |= slots[t] == j;
+					if(sel->live[j] && !taken) { slot = j; break; }
+				}
+			}
+			if(slot == sel->n) break;
+		}
+		set_weight(sel, slot, 0);
+		slots[got++] = slot;
+	}
+
+	for(size_t i = 0; i < got; ++i) {
+		sel->novelty[slots[i]] = P99_MAXOF(sel->novelty[slots[i]]*SELECT_NOVELTY_PENALTY, SELECT_NOVELTY_MIN);
+		set_weight(sel, slots[i], compute_weight(sel, slots[i]));
+	}
+
+	if(++sel->num_collages % SELECT_RELAX_EVERY == 0) {
+		for(size_t i = 0; i < sel->n; ++i) sel->novelty[i] = sqrtf(sel->novelty[i]);
+		rebuild(sel);
+	}
+	return got;
+}
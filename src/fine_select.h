@@ -0,0 +1,41 @@
+#pragma once
+#include "fine_definitions.h"
+#include "fine_rand.h"
+
+/*
+ * Weighted choice of the recordings that go into a collage.
+ * A Fenwick tree over the weight of every slot of rec_arr makes publishing and drawing a recording
+ * O(log n), so k distinct recordings cost O(k log n) no matter how many recordings are stored.
+ * weight = recency * loudness * novelty
+ *  - recency halves every SELECT_RECENCY_HALF_LIFE published recordings
+ *  - loudness keeps nearly silent recordings from being picked as often
+ *  - novelty drops every time a recording is picked and recovers over the next collages
+ * NOTE: not thread safe. In the audio system every call is made with playback_mtx held.
+ * */
+#define SELECT_RECENCY_HALF_LIFE 128.0 //in recordings
+#define SELECT_NOVELTY_PENALTY 0.5f
+#define SELECT_NOVELTY_MIN (1.0f/16)
+#define SELECT_RELAX_EVERY 16 //in collages
+
+typedef struct Selector Selector;
+
+Selector *fine_select_create(size_t num_slots);
+void fine_select_destroy(Selector *sel);
+//Independent copy, for drawing from the same state more than once
+Selector *fine_select_clone(Selector const* sel);
+
+//Cheap loudness measure of a recording, to be passed to fine_select_publish
+float fine_select_loudness(i16 const* data, size_t sz);
+
+//Makes slot the newest recording. Its novelty starts at 1.
+void fine_select_publish(Selector *sel, size_t slot, float loudness);
+//The slot will not be drawn until it is published again
+void fine_select_remove(Selector *sel, size_t slot);
+//@return the number of slots that can be drawn
+size_t fine_select_count(Selector const* sel);
+
+/*
+ * Draws min(k, fine_select_count(sel)) distinct slots into slots, weighted as described above.
+ * @return the number of slots drawn
+ * */
+size_t fine_select_sample(Selector *sel, p99_seed *seed, size_t *slots, size_t k);
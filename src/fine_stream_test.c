@@ -0,0 +1,114 @@
+/*
+ * Crossfades of the playback stream. Build with the fourth line of build.sh, run ./stream_test
+ * Every case plays a collage of constant samples, queues the next one while the first is still playing and
+ * checks what the device got: the first one up to the crossfade, a rising crossfade that ends on the value
+ * of the next one, then the rest of the next one and nothing of the first.
+ * @return 1 if any case fails
+ * */
+#include "fine_definitions.h"
+#include "fine_audio_io.h"
+#include "fine_log.h"
+#include "p99/p99.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define TEST_FIRST_SZ (SAMPLE_RATE/2) //shorter than the stream asks ahead, so the next one is asked for right away
+#define TEST_MAX_SZ (SAMPLE_RATE*2)
+#define TEST_FIRST 10000 //the samples of the first collage...
+#define TEST_NEXT 20000 //...and of the next one
+/* --- END DEFINITIONS FOR TUNING --- */
+
+typedef struct TestDev TestDev;
+struct TestDev {
+	AudioDev dev; //first, so an AudioDev* is a TestDev*
+	mtx_t mtx;
+	cnd_t cnd;
+	bool open; //the first write waits for it, so the next collage is queued before the first one gets far
+	i16 *out;
+	size_t sz;
+};
+
+static size_t test_write(AudioDev *const dev, i16 const*const data, size_t const n) {
+	TestDev *const t = (TestDev *)dev;
+	mtx_lock(&t->mtx);
+	while(!t->open) cnd_wait(&t->cnd, &t->mtx);
+	mtx_unlock(&t->mtx);
+	size_t const k = P99_MINOF(n, 2*TEST_MAX_SZ - t->sz);
+	memcpy(t->out + t->sz, data, k*sizeof *data);
+	t->sz += k;
+	return n;
+}
+
+static void test_nothing(AudioDev *const dev) { (void)dev; }
+
+static void put(Stream *const s, size_t const sz, i16 const value) {
+	i16 *const data = fine_stream_next(s);
+	for(size_t i = 0; i < sz; ++i) data[i] = value;
+	fine_stream_put(s, data, sz, 0);
+}
+
+//@return whether the device got the first collage, then the crossfade into the next one and the rest of it
+static bool check(TestDev const*const t, size_t const next_sz) {
+	size_t first = 0;
+	while(first < t->sz && t->out[first] == TEST_FIRST) ++first;
+	size_t const xfade = P99_MINOF(TEST_FIRST_SZ - first, next_sz);
+	if(!first || t->sz != first + next_sz) {
+		fine_log(ERROR, "%zu frames of the first collage, %zu in all, expected %zu", first, t->sz, first + next_sz);
+		return 0;
+	}
+	for(size_t i = first; i < t->sz; ++i) {
+		i16 const v = t->out[i];
+		bool const ok = i < first + xfade ? v > TEST_FIRST && v <= TEST_NEXT && v >= t->out[i-1] : v == TEST_NEXT;
+		if(!ok || (i == first + xfade - 1 && v != TEST_NEXT)) {
+			fine_log(ERROR, "frame %zu is %d, %zu into a crossfade of %zu", i, v, i - first, xfade);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static bool run(char const*const name, size_t const next_sz) {
+	TestDev t = {
+		.dev = {
+			.kind = "test",
+			.channels = 1,
+			.period = 1024,
+			.write = test_write,
+			.start = test_nothing,
+			.stop = test_nothing,
+		},
+		.out = calloc(2*TEST_MAX_SZ, sizeof *t.out),
+	};
+	if(!t.out) fine_exit("Could not allocate the output");
+	mtx_init(&t.mtx, mtx_plain);
+	cnd_init(&t.cnd);
+	_Atomic(bool) fade_out = 0;
+	Stream *const s = fine_stream_start(&t.dev, &fade_out, TEST_MAX_SZ, 0, 0);
+	put(s, TEST_FIRST_SZ, TEST_FIRST);
+	put(s, next_sz, TEST_NEXT);
+	mtx_lock(&t.mtx);
+	t.open = 1;
+	cnd_broadcast(&t.cnd);
+	mtx_unlock(&t.mtx);
+	fine_stream_stop(s);
+
+	bool const ok = check(&t, next_sz);
+	printf("%-40s %s\n", name, ok ? "ok" : "FAIL");
+	mtx_destroy(&t.mtx);
+	cnd_destroy(&t.cnd);
+	free(t.out);
+	return ok;
+}
+
+int main(void) {
+	fine_log_init();
+	bool failed = 0;
+	failed |= !run("next longer than the crossfade", TEST_MAX_SZ);
+	failed |= !run("next shorter than the crossfade", SAMPLE_RATE/40);
+	failed |= !run("next of one frame", 1);
+	fine_log_shutdown();
+	return failed;
+}
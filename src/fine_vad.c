@@ -0,0 +1,137 @@
+#include "fine_vad.h"
+#include "fine_kernel.h"
+#include "fine_log.h"
+#include "fine_prof.h"
+#include "p99/p99.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define VAD_BANDS 16 //a multiple of the widest vector (AVX-512)
+#define VAD_LOW_HZ 300.0 //center of the lowest band, the others are spaced logarithmically...
+#define VAD_HIGH_HZ 8000.0 //...up to this one
+#define VAD_FRAME 480 //samples, 10 ms
+#define VAD_MIN_DB 20.0f //a band quieter than this (power in LSB^2) never counts, so dither isn't activity
+#define VAD_ON_DB 12.0f //a frame above its floor by this, a band counts for the start...
+#define VAD_ON_BANDS 3 //...when at least this many do
+#define VAD_ATTACK 5 //frames in a row before activity starts, a click rings out sooner even in the lowest band
+#define VAD_SMOOTH 0.7f //of the level per frame, for the floor and for the activity to go on
+#define VAD_OFF_DB 6.0f //the smoothed level above the floor by this, a band counts for the activity to go on...
+#define VAD_OFF_BANDS 2 //...when at least this many do
+#define VAD_HANGOVER 30 //frames without them before it ends
+#define VAD_FLOOR_WINDOW 50 //frames, the floor is the quietest smoothed level in the last VAD_FLOOR_WINDOWS of them
+#define VAD_FLOOR_WINDOWS 4
+#define VAD_CPU_BUDGET 0.05 //of the duration of the samples checked
+/* --- END DEFINITIONS FOR TUNING --- */
+
+struct Vad {
+	float coef[5*VAD_BANDS]; //see biquad_bank
+	float state[2*VAD_BANDS];
+	float energy[VAD_BANDS]; //of the frame so far
+	float smooth[VAD_BANDS]; //dB
+	float floor[VAD_BANDS]; //dB
+	float mins[VAD_FLOOR_WINDOWS][VAD_BANDS]; //dB, of the last windows, mins[win] is the current one
+	size_t win;
+	size_t win_frames;
+	size_t filled; //samples of the frame
+	bool have_floor;
+	bool active;
+	bool warned;
+	double ns; //taken over the last samples checked
+	size_t samples;
+	unsigned attack;
+	unsigned hangover;
+};
+
+bool fine_vad_from_env(void) {
+	char const*const env = getenv("FINE_VAD");
+	if(!env || !*env) return 0;
+	char *end = 0;
+	unsigned long const value = strtoul(env, &end, 0);
+	if(!*end && value <= 1) return value;
+	fine_log(WARN, "FINE_VAD=%s is not 0 or 1, ignoring it", env);
+	return 0;
+}
+
+Vad *fine_vad_create(void) {
+	Vad *const v = calloc(1, sizeof *v);
+	if(!v) fine_exit("Could not allocate the activity detector");
+	//band pass with 0 dB peak gain (Audio EQ Cookbook), a band wide
+	double const ratio = pow(VAD_HIGH_HZ/VAD_LOW_HZ, 1.0/(VAD_BANDS-1));
+	double const q = sqrt(ratio)/(ratio-1);
+	for(size_t b = 0; b < VAD_BANDS; ++b) {
+		double const w = 2*M_PI*VAD_LOW_HZ*pow(ratio, b)/SAMPLE_RATE;
+		double const alpha = sin(w)/(2*q), a0 = 1 + alpha;
+		v->coef[b] = alpha/a0;
+		v->coef[VAD_BANDS+b] = 0;
+		v->coef[2*VAD_BANDS+b] = -alpha/a0;
+		v->coef[3*VAD_BANDS+b] = -2*cos(w)/a0;
+		v->coef[4*VAD_BANDS+b] = (1 - alpha)/a0;
+	}
+	return v;
+}
+
+void fine_vad_destroy(Vad *const v) {
+	free(v);
+}
+
+static void frame(Vad *const v) {
+	//minimum statistics: noise that doesn't go away becomes the floor within a few windows, activity has gaps
+	bool const new_win = !v->have_floor || v->win_frames == VAD_FLOOR_WINDOW;
+	if(new_win) {
+		v->win = (v->win + 1) % VAD_FLOOR_WINDOWS;
+		v->win_frames = 0;
+	}
+	++v->win_frames;
+	unsigned on = 0, off = 0;
+	for(size_t b = 0; b < VAD_BANDS; ++b) {
+		float const level = 10*log10f(v->energy[b]/VAD_FRAME + 1);
+		float *const smooth = v->smooth+b;
+		*smooth = v->have_floor ? VAD_SMOOTH*(*smooth) + (1-VAD_SMOOTH)*level : level;
+		if(!v->have_floor) for(size_t w = 0; w < VAD_FLOOR_WINDOWS; ++w) v->mins[w][b] = *smooth;
+		if(new_win || *smooth < v->mins[v->win][b]) v->mins[v->win][b] = *smooth;
+		float floor = v->mins[0][b];
+		for(size_t w = 1; w < VAD_FLOOR_WINDOWS; ++w) floor = P99_MINOF(floor, v->mins[w][b]);
+		v->floor[b] = floor;
+		on += level >= VAD_MIN_DB && level - floor >= VAD_ON_DB;
+		off += *smooth >= VAD_MIN_DB && *smooth - floor >= VAD_OFF_DB;
+	}
+	v->have_floor = 1;
+	memset(v->energy, 0, sizeof v->energy);
+	//silence would leave the filters with denormals
+	for(size_t i = 0; i < 2*VAD_BANDS; ++i) if(fabsf(v->state[i]) < 1e-15f) v->state[i] = 0;
+
+	v->attack = on >= VAD_ON_BANDS ? v->attack+1 : 0;
+	if(v->attack >= VAD_ATTACK) v->active = 1;
+	if(!v->active) return;
+	if(off >= VAD_OFF_BANDS) v->hangover = VAD_HANGOVER;
+	else if(!v->hangover || !--v->hangover) v->active = 0;
+}
+
+bool fine_vad_process(Vad *const v, i16 const*const data, size_t const n) {
+	uint64_t const start = fine_prof_now();
+	for(size_t i = 0; i < n;) {
+		size_t const len = P99_MINOF(n - i, VAD_FRAME - v->filled);
+		fine_kernels->biquad_bank(v->energy, v->state, v->coef, data+i, len, VAD_BANDS);
+		i += len;
+		v->filled += len;
+		if(v->filled == VAD_FRAME) {
+			frame(v);
+			v->filled = 0;
+		}
+	}
+	//over a second at least, one period can be late for reasons of its own
+	v->ns += fine_prof_now() - start;
+	v->samples += n;
+	if(v->samples >= SAMPLE_RATE) {
+		double const share = v->ns*SAMPLE_RATE/(v->samples*1e9);
+		if(!v->warned && share > VAD_CPU_BUDGET) {
+			fine_log(WARN, "the activity detector takes %.1f%% of the time it checks", 100*share);
+			v->warned = 1;
+		}
+		v->ns = 0;
+		v->samples = 0;
+	}
+	return v->active;
+}
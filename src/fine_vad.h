@@ -0,0 +1,25 @@
+#pragma once
+#include "fine_definitions.h"
+
+/*
+ * Spectral activity detector, the trigger of an input instead of its envelope and thresholds.
+ * A bank of VAD_BANDS band pass biquads from VAD_LOW_HZ up (fine_kernel.h, a band per vector lane) measures
+ * the level of every band over frames of VAD_FRAME samples. The noise floor of a band is the minimum of its
+ * smoothed level over the last VAD_FLOOR_WINDOWS windows of VAD_FLOOR_WINDOW frames (minimum statistics):
+ * down right away, up in a jump once the quieter window drops out, after about 2 s. So steady noise like HVAC
+ * rumble becomes the floor. Below VAD_LOW_HZ nothing is measured, where rumble and handling noise are loudest.
+ * Activity starts when VAD_ON_BANDS bands are well above their floor for VAD_ATTACK frames in a row, so a knock
+ * on the stand doesn't start a recording. It ends VAD_HANGOVER frames after fewer than VAD_OFF_BANDS smoothed
+ * bands are above it.
+ * */
+
+typedef struct Vad Vad;
+
+//FINE_VAD=1: the inputs trigger on the spectral detector. 0 (default): on the envelope, see FINE_THRESHOLDS
+bool fine_vad_from_env(void);
+
+Vad *fine_vad_create(void);
+void fine_vad_destroy(Vad *v);
+
+//Runs the detector over the next n samples. @return whether there is activity after them
+bool fine_vad_process(Vad *v, i16 const* data, size_t n);
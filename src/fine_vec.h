@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include "fine_definitions.h"
+
+/*
+ * Portable SIMD on GCC generic vectors. They compile to SSE2 on x86-64 and to NEON on ARM,
+ * even in builds without -O (hence always_inline).
+ * Define FINE_VEC (and a target pragma) before including it to get wider vectors, see fine_kernel_avx2.c.
+ * */
+#ifndef FINE_VEC
+#define FINE_VEC 4 //floats per vector
+#endif
+
+typedef float vf __attribute__((vector_size(FINE_VEC*sizeof(float))));
+typedef int32_t vi __attribute__((vector_size(FINE_VEC*sizeof(int32_t))));
+typedef i16 vh __attribute__((vector_size(FINE_VEC*sizeof(i16))));
+//aligned(1) versions for unaligned loads and stores
+typedef float vf_u __attribute__((vector_size(FINE_VEC*sizeof(float)), aligned(1)));
+typedef i16 vh_u __attribute__((vector_size(FINE_VEC*sizeof(i16)), aligned(1)));
+
+#define VINLINE static inline __attribute__((always_inline))
+
+VINLINE vf vf_set(float const x) { return (vf){} + x; }
+VINLINE vf vf_iota(void) { vf v; for(int i = 0; i < FINE_VEC; ++i) v[i] = i; return v; }
+
+VINLINE vf load_f(float const*const p) { return *(vf_u const*)p; }
+VINLINE void store_f(float *const p, vf const v) { *(vf_u *)p = v; }
+VINLINE vf load_h(i16 const*const p) { return __builtin_convertvector(*(vh_u const*)p, vf); }
+VINLINE vi load_hi(i16 const*const p) { return __builtin_convertvector(*(vh_u const*)p, vi); }
+
+VINLINE vf vabs(vf const x) { return (vf)((vi)x & INT32_MAX); }
+VINLINE vf vmax(vf const a, vf const b) { vi const m = a > b; return (vf)((m & (vi)a) | (~m & (vi)b)); }
+VINLINE vf vmin(vf const a, vf const b) { vi const m = a < b; return (vf)((m & (vi)a) | (~m & (vi)b)); }
+
+VINLINE float hmax(vf const v) {
+	float m = v[0];
+	for(int i = 1; i < FINE_VEC; ++i) m = m < v[i] ? v[i] : m;
+	return m;
+}
+
+//Truncate and saturate, like clamping followed by a cast
+VINLINE void store_clamp(i16 *const p, vf x) {
+	x = vmin(vmax(x, vf_set(-32768.0f)), vf_set(32767.0f));
+	*(vh_u *)p = __builtin_convertvector(__builtin_convertvector(x, vi), vh);
+}
+
+//Round half away from zero and saturate, like roundf followed by clamping
+VINLINE void store_sat(i16 *const p, vf x) {
+	x = vmin(vmax(x, vf_set(-32768.0f)), vf_set(32767.0f));
+	vf const half = (vf)(((vi)x & INT32_MIN) | (vi)vf_set(0.5f));
+	*(vh_u *)p = __builtin_convertvector(__builtin_convertvector(x + half, vi), vh);
+}
@@ -0,0 +1,390 @@
+#include "fine_voice.h"
+#include "fine_clip_cache.h"
+#include "fine_fx_reverb.h"
+#include "fine_log.h"
+#include "fine_mix.h"
+#include "fine_prof.h"
+#include "fine_render.h"
+#include "p99/p99.h"
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+
+/* --- BEGIN DEFINITIONS FOR TUNING --- */
+#define VOICE_BLOCK 256 //frames mixed at once
+#define VOICE_STEAL_MS 20 //fade out of a stolen voice
+#define VOICE_CPU_BUDGET 0.5 //of the duration of the frames fine_voice_render makes
+#define VOICE_PENDING 4 //voices waiting to start
+#define VOICE_MAX_THREADS 4 //the voices are split over at most this many threads, one per core
+/* --- END DEFINITIONS FOR TUNING --- */
+
+typedef struct Event Event;
+//A clip of a voice, from its first sample until its reverb tail has rung out
+struct Event {
+	i16 *buf; //RECORDING_SIZE samples, allocated with the voices so the render thread never does
+	i16 *src; //the clip from fine_render_clip in buf, 0 while it doesn't play
+	size_t pos; //samples played: first the clip, then num_tail_samples of silence into the reverb
+	float gains[MAX_CHANNELS]; //of its pan
+	fine_reverb_model reverb;
+};
+
+typedef struct Voice Voice;
+struct Voice {
+	Plan plan;
+	uint32_t gen[OPT_NUM_RECORDINGS]; //of the recording of each clip when the voice was queued
+	size_t newest_rec_idx;
+	uint64_t order; //the voice with the lowest is stolen first
+	size_t pos; //frames since the voice started
+	size_t next_clip;
+	size_t num_on; //events that play
+	float gain;
+	float step; //per frame, negative while it fades out
+	bool active;
+	Event events[OPT_NUM_RECORDINGS]; //event i plays plan.clips[i]
+};
+
+typedef struct Pending Pending;
+struct Pending {
+	Plan plan;
+	uint32_t gen[OPT_NUM_RECORDINGS];
+	size_t newest_rec_idx;
+	uint64_t published;
+};
+
+typedef struct Worker Worker;
+//Renders voice i if i%num_workers is its idx. Worker 0 is the thread that calls fine_voice_render
+struct Worker {
+	Voices *v;
+	size_t idx;
+	thrd_t thrd;
+	ClipCache *cache; //a cache isn't shared between threads, and the voices of a worker stay with it. Fixed, a miss must not allocate
+	float *mixed; //frames, grows to the largest n of fine_voice_render
+	size_t mixed_sz;
+	float voice_mixed[VOICE_BLOCK*MAX_CHANNELS]; //of a voice that fades out
+	i16 block[VOICE_BLOCK];
+};
+
+struct Voices {
+	size_t max_voices;
+	i16 *bufs; //of all events
+	Recording const* recordings;
+	size_t channels; //of the frames it renders
+	Limiter lim;
+	uint64_t next_order;
+	size_t num_active;
+	_Atomic(bool) fade_all;
+
+	mtx_t mtx; //protects the pending voices
+	Pending pending[VOICE_PENDING];
+	size_t num_pending;
+
+	//fine_voice_render starts a round, every worker renders its voices for n frames
+	size_t num_workers;
+	Worker *workers;
+	mtx_t work_mtx;
+	cnd_t work_cnd;
+	cnd_t done_cnd;
+	uint64_t round;
+	size_t num_done;
+	size_t n;
+	bool quit;
+
+	Voice voices[]; //max_voices
+};
+
+//The same slot render_recordings reads for the clip
+static size_t clip_slot(size_t const newest_rec_idx, PlanClip const*const clip) {
+	return ((size_t)MAX_NUM_REC + newest_rec_idx-clip->index)%MAX_NUM_REC;
+}
+
+size_t fine_voice_num_from_env(void) {
+	char const*const env = getenv("FINE_VOICES");
+	if(!env || !*env) return 0;
+	char *end = 0;
+	size_t const value = strtoull(env, &end, 0);
+	if(!*end) return value;
+	fine_log(WARN, "FINE_VOICES=%s is not a number, ignoring it", env);
+	return 0;
+}
+
+static void end_voice(Voice *const voice) {
+	for(size_t i = 0; i < voice->plan.num_clips; ++i) voice->events[i].src = 0;
+	voice->active = 0;
+}
+
+static void render_share(Worker *w, size_t n);
+
+static int worker_thread(void *ptr) {
+	Worker *const w = ptr;
+	Voices *const v = w->v;
+	fine_prof_thread("voices");
+	uint64_t round = 0;
+	while(1) {
+		mtx_lock(&v->work_mtx);
+		while(v->round == round && !v->quit) cnd_wait(&v->work_cnd, &v->work_mtx);
+		if(v->quit) {
+			mtx_unlock(&v->work_mtx);
+			return 0;
+		}
+		round = v->round;
+		size_t const n = v->n;
+		mtx_unlock(&v->work_mtx);
+
+		render_share(w, n);
+
+		mtx_lock(&v->work_mtx);
+		if(++v->num_done == v->num_workers-1) cnd_signal(&v->done_cnd);
+		mtx_unlock(&v->work_mtx);
+	}
+}
+
+Voices *fine_voice_create(size_t const max_voices, Recording const*const recordings, size_t const channels) {
+	Voices *const v = calloc(1, sizeof *v + max_voices*sizeof *v->voices);
+	if(!v) fine_exit("Could not allocate %zu voices", max_voices);
+	v->max_voices = max_voices;
+	v->recordings = recordings;
+	v->channels = channels;
+	fine_mix_limiter_init(&v->lim, 50.0f, 5, SAMPLE_RATE, channels);
+	mtx_init(&v->mtx, mtx_plain);
+	size_t const num_bufs = max_voices*OPT_NUM_RECORDINGS;
+	v->bufs = malloc(num_bufs*RECORDING_SIZE*sizeof *v->bufs);
+	if(!v->bufs) fine_exit("Could not allocate the clips of %zu voices", max_voices);
+	//touched now, so no page faults in while the voices play
+	memset(v->bufs, 0, num_bufs*RECORDING_SIZE*sizeof *v->bufs);
+	for(size_t i = 0; i < max_voices; ++i) {
+		for(size_t j = 0; j < OPT_NUM_RECORDINGS; ++j) {
+			Event *const e = v->voices[i].events+j;
+			e->buf = v->bufs + (i*OPT_NUM_RECORDINGS + j)*RECORDING_SIZE;
+			reverb_init(&e->reverb);
+		}
+	}
+
+	long const num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	v->num_workers = P99_MAXOF(1, P99_MINOF(P99_MINOF(num_cpus, VOICE_MAX_THREADS), (long)max_voices));
+	v->workers = calloc(v->num_workers, sizeof *v->workers);
+	if(!v->workers) fine_exit("Could not allocate the voice threads");
+	mtx_init(&v->work_mtx, mtx_plain);
+	cnd_init(&v->work_cnd);
+	cnd_init(&v->done_cnd);
+	for(size_t i = 0; i < v->num_workers; ++i) {
+		Worker *const w = v->workers+i;
+		w->v = v;
+		w->idx = i;
+		w->cache = fine_clip_cache_create_fixed(CLIP_CACHE_BYTES/v->num_workers);
+		if(i && thrd_create(&w->thrd, worker_thread, w) != thrd_success) fine_exit("Could not start a voice thread");
+	}
+	return v;
+}
+
+void fine_voice_destroy(Voices *const v) {
+	mtx_lock(&v->work_mtx);
+	v->quit = 1;
+	cnd_broadcast(&v->work_cnd);
+	mtx_unlock(&v->work_mtx);
+	for(size_t i = 0; i < v->num_workers; ++i) {
+		if(i) thrd_join(v->workers[i].thrd, 0);
+		fine_clip_cache_destroy(v->workers[i].cache);
+		free(v->workers[i].mixed);
+	}
+	for(size_t i = 0; i < v->max_voices; ++i) {
+		if(v->voices[i].active) end_voice(v->voices+i);
+	}
+	mtx_destroy(&v->work_mtx);
+	cnd_destroy(&v->work_cnd);
+	cnd_destroy(&v->done_cnd);
+	mtx_destroy(&v->mtx);
+	free(v->workers);
+	free(v->bufs);
+	free(v);
+}
+
+int fine_voice_start(Voices *const v, Plan const*const plan, size_t const newest_rec_idx, uint64_t const published) {
+	mtx_lock(&v->mtx);
+	if(v->num_pending == VOICE_PENDING) {
+		mtx_unlock(&v->mtx);
+		fine_log(WARN, "%d voices are waiting to start, dropping a new one", VOICE_PENDING);
+		return -1;
+	}
+	Pending *const p = v->pending + v->num_pending++;
+	p->plan = *plan;
+	p->newest_rec_idx = newest_rec_idx;
+	p->published = published;
+	for(size_t i = 0; i < plan->num_clips; ++i) {
+		p->gen[i] = atomic_load_explicit(&v->recordings[clip_slot(newest_rec_idx, plan->clips+i)].gen, memory_order_acquire);
+	}
+	mtx_unlock(&v->mtx);
+	return 0;
+}
+
+void fine_voice_fade_all(Voices *const v) {
+	atomic_store_explicit(&v->fade_all, 1, memory_order_release);
+}
+
+bool fine_voice_busy(Voices *const v) {
+	mtx_lock(&v->mtx);
+	bool const busy = v->num_pending || v->num_active;
+	mtx_unlock(&v->mtx);
+	return busy;
+}
+
+static void fade_out(Voice *const voice) {
+	voice->step = -1.0f/(VOICE_STEAL_MS*SAMPLE_RATE/1000);
+}
+
+//The oldest voice that doesn't fade out yet starts to. @return 0 if all of them already do
+static bool steal(Voices *const v) {
+	Voice *oldest = 0;
+	for(size_t i = 0; i < v->max_voices; ++i) {
+		Voice *const voice = v->voices+i;
+		if(voice->active && !voice->step && (!oldest || voice->order < oldest->order)) oldest = voice;
+	}
+	if(oldest) fade_out(oldest);
+	return oldest;
+}
+
+//mtx must be held
+static void start_pending(Voices *const v) {
+	while(v->num_pending) {
+		Voice *voice = 0;
+		for(size_t i = 0; i < v->max_voices && !voice; ++i) {
+			if(!v->voices[i].active) voice = v->voices+i;
+		}
+		//It starts once the stolen one has faded out
+		if(!voice) {
+			if(steal(v)) fine_log(DEBUG, "all %zu voices play, stealing the oldest", v->max_voices);
+			return;
+		}
+		Pending const*const p = v->pending;
+		voice->plan = p->plan;
+		memcpy(voice->gen, p->gen, sizeof voice->gen);
+		voice->newest_rec_idx = p->newest_rec_idx;
+		voice->order = v->next_order++;
+		voice->pos = voice->next_clip = voice->num_on = 0;
+		voice->gain = 1;
+		voice->step = 0;
+		voice->active = 1;
+		++v->num_active;
+		if(p->published) fine_prof_end(FINE_STAGE_RESPONSE, p->published);
+		memmove(v->pending, v->pending+1, --v->num_pending*sizeof *v->pending);
+	}
+}
+
+static void start_event(Worker *const w, Voice *const voice, size_t const i) {
+	Voices *const v = w->v;
+	PlanClip const*const clip = voice->plan.clips+i;
+	if(!clip->num_samples) return;
+	size_t const slot = clip_slot(voice->newest_rec_idx, clip);
+	_Atomic(uint32_t) const*const gen = &v->recordings[slot].gen;
+	//The recording was replaced since the voice was queued, or is being written. Checked again after the copy
+	if(!fine_gen_unchanged(gen, voice->gen[i])) return;
+	//a clip is cut from one recording
+	assert(clip->num_samples <= RECORDING_SIZE);
+	Event *const e = voice->events+i;
+	if(!fine_render_clip(e->buf, w->cache, v->recordings, slot, voice->gen[i], clip)) return;
+	reverb_set_params(&e->reverb, clip->room, clip->damp, clip->wet, clip->dry);
+	reverb_reset(&e->reverb);
+	fine_mix_pan(e->gains, v->channels, clip->pan);
+	e->src = e->buf;
+	e->pos = 0;
+	++voice->num_on;
+}
+
+//Adds the next n <= VOICE_BLOCK frames of voice to mixed
+static void render_voice(Worker *const w, Voice *const voice, float *const mixed, size_t const n) {
+	Plan const*const plan = &voice->plan;
+	size_t const ch = w->v->channels;
+	float *const acc = voice->step ? w->voice_mixed : mixed;
+	if(voice->step) memset(acc, 0, n*ch*sizeof *acc);
+	while(voice->next_clip < plan->num_clips && plan->clips[voice->next_clip].write_pos < voice->pos + n) {
+		start_event(w, voice, voice->next_clip++);
+	}
+	for(size_t i = 0; i < plan->num_clips; ++i) {
+		Event *const e = voice->events+i;
+		if(!e->src) continue;
+		PlanClip const*const clip = plan->clips+i;
+		size_t const first = e->pos ? 0 : clip->write_pos - voice->pos;
+		size_t const total = clip->num_samples + plan->num_tail_samples;
+		size_t const k = P99_MINOF(n-first, total-e->pos);
+		size_t const from_clip = e->pos < clip->num_samples ? P99_MINOF(k, clip->num_samples-e->pos) : 0;
+		memcpy(w->block, e->src+e->pos, from_clip*sizeof(i16));
+		memset(w->block+from_clip, 0, (k-from_clip)*sizeof(i16));
+		fine_fx_reverb(w->block, k, &e->reverb);
+		fine_mix_pan_add(acc+first*ch, w->block, k, ch, e->gains);
+		e->pos += k;
+		if(e->pos == total) {
+			e->src = 0;
+			--voice->num_on;
+		}
+	}
+	voice->pos += n;
+
+	if(voice->step) {
+		for(size_t i = 0; i < n && voice->gain > 0; ++i) {
+			for(size_t c = 0; c < ch; ++c) mixed[i*ch+c] += acc[i*ch+c]*voice->gain;
+			voice->gain += voice->step;
+		}
+		if(voice->gain <= 0) end_voice(voice);
+	}
+	else if(voice->next_clip == plan->num_clips && !voice->num_on) end_voice(voice);
+}
+
+//The voices of w for the next n frames into w->mixed
+static void render_share(Worker *const w, size_t const n) {
+	Voices *const v = w->v;
+	size_t const sz = n*v->channels;
+	if(sz > w->mixed_sz) {
+		float *const mixed = realloc(w->mixed, sz*sizeof *mixed);
+		if(!mixed) fine_exit("Could not allocate the voice mix");
+		w->mixed = mixed;
+		w->mixed_sz = sz;
+	}
+	memset(w->mixed, 0, sz*sizeof *w->mixed);
+	for(size_t done = 0; done < n; done += VOICE_BLOCK) {
+		size_t const len = P99_MINOF(n-done, VOICE_BLOCK);
+		for(size_t i = w->idx; i < v->max_voices; i += v->num_workers) {
+			if(v->voices[i].active) render_voice(w, v->voices+i, w->mixed+done*v->channels, len);
+		}
+	}
+}
+
+void fine_voice_render(Voices *const v, i16 *const out, size_t const n) {
+	uint64_t const start = fine_prof_now();
+	mtx_lock(&v->mtx);
+	if(atomic_exchange_explicit(&v->fade_all, 0, memory_order_acquire)) {
+		v->num_pending = 0;
+		while(steal(v));
+	}
+	start_pending(v);
+	mtx_unlock(&v->mtx);
+
+	mtx_lock(&v->work_mtx);
+	v->n = n;
+	v->num_done = 0;
+	++v->round;
+	cnd_broadcast(&v->work_cnd);
+	mtx_unlock(&v->work_mtx);
+	render_share(v->workers, n);
+	mtx_lock(&v->work_mtx);
+	while(v->num_done < v->num_workers-1) cnd_wait(&v->done_cnd, &v->work_mtx);
+	mtx_unlock(&v->work_mtx);
+
+	float *const mixed = v->workers[0].mixed;
+	for(size_t i = 1; i < v->num_workers; ++i) {
+		float const*const m = v->workers[i].mixed;
+		for(size_t j = 0; j < n*v->channels; ++j) mixed[j] += m[j];
+	}
+	fine_mix_limit(out, mixed, n, &v->lim);
+
+	mtx_lock(&v->mtx);
+	v->num_active = 0;
+	for(size_t i = 0; i < v->max_voices; ++i) v->num_active += v->voices[i].active;
+	mtx_unlock(&v->mtx);
+
+	uint64_t const ns = fine_prof_end(FINE_STAGE_VOICES, start) - start;
+	if(ns > VOICE_CPU_BUDGET*1e9*n/SAMPLE_RATE && v->num_active > 1 && steal(v)) {
+		fine_log(WARN, "%zu frames of %zu voices took %.1f ms, stealing the oldest", n, v->num_active, ns/1e6);
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "fine_definitions.h"
+#include "fine_plan.h"
+
+/*
+ * Polyphonic playback: every collage is a voice that plays its Plan clip by clip, in real time, and several
+ * voices overlap instead of a new one fading out the one before.
+ * fine_voice_render mixes block by block. A clip is prepared (fine_render_clip) when the voice reaches it,
+ * into a buffer of RECORDING_SIZE samples that fine_voice_create allocated for it, and its reverb runs block
+ * by block until its tail has rung out, so a voice costs nothing up front and about as much per second as
+ * render_recordings while it plays. Most of that is reverb, so the voices are split
+ * over one thread per core (at most VOICE_MAX_THREADS), the calling thread is one of them.
+ * When max_voices play, the oldest one is stolen: it fades out within VOICE_STEAL_MS, then the new one starts.
+ * If a block takes longer than VOICE_CPU_BUDGET of its duration, the oldest voice is stolen as well.
+ * Everything but fine_voice_start and fine_voice_fade_all must be called from the thread that renders.
+ * */
+
+typedef struct Voices Voices;
+
+//FINE_VOICES, the number of voices. 0 (default) plays one collage at a time
+size_t fine_voice_num_from_env(void);
+
+//Voices play clips of recordings, like render_recordings, panned into frames of channels
+Voices *fine_voice_create(size_t max_voices, Recording const* recordings, size_t channels);
+void fine_voice_destroy(Voices *v);
+
+/* Queues a voice playing plan, it starts with the next block.
+ * published: when the recording it answers was published, or 0
+ * @return 0, -1 if too many voices are waiting to start (logged)
+ * */
+int fine_voice_start(Voices *v, Plan const* plan, size_t newest_rec_idx, uint64_t published);
+
+//All voices fade out, waiting ones are dropped
+void fine_voice_fade_all(Voices *v);
+
+//@return whether a voice plays or waits to start
+bool fine_voice_busy(Voices *v);
+
+//Mixes the next n frames of all voices into out, silence if none plays
+void fine_voice_render(Voices *v, i16 *out, size_t n);
@@ -0,0 +1,100 @@
+#include "fine_wav.h"
+#include "fine_log.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define WAV_HEADER_SZ 44
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+static uint32_t get_le(unsigned char const*const p, size_t const n) {
+	uint32_t x = 0;
+	for(size_t i = 0; i < n; ++i) x |= (uint32_t)p[i] << 8*i;
+	return x;
+}
+
+static void put_le(unsigned char *const p, uint32_t x, size_t const n) {
+	for(size_t i = 0; i < n; ++i, x >>= 8) p[i] = x & 0xff;
+}
+
+int fine_wav_read_header(FILE *const file, WavInfo *const info) {
+	unsigned char riff[12];
+	if(fread(riff, 1, sizeof riff, file) != sizeof riff || memcmp(riff, "RIFF", 4) || memcmp(riff+8, "WAVE", 4)) {
+		fine_log(WARN, "wav: not a RIFF/WAVE file");
+		return -1;
+	}
+	bool have_fmt = 0;
+	*info = (WavInfo){0};
+	//Chunks can come in any order, skip everything that is not fmt or data
+	while(1) {
+		unsigned char chunk[8];
+		if(fread(chunk, 1, sizeof chunk, file) != sizeof chunk) {
+			fine_log(WARN, "wav: no data chunk");
+			return -1;
+		}
+		uint32_t const sz = get_le(chunk+4, 4);
+		if(!memcmp(chunk, "fmt ", 4)) {
+			unsigned char fmt[16];
+			if(sz < sizeof fmt || fread(fmt, 1, sizeof fmt, file) != sizeof fmt) {
+				fine_log(WARN, "wav: fmt chunk too short");
+				return -1;
+			}
+			unsigned const format = get_le(fmt, 2);
+			if(format != WAV_FORMAT_PCM && format != WAV_FORMAT_EXTENSIBLE) {
+				fine_log(WARN, "wav: format %u is not PCM", format);
+				return -1;
+			}
+			info->channels = get_le(fmt+2, 2);
+			info->sample_rate = get_le(fmt+4, 4);
+			info->bits = get_le(fmt+14, 2);
+			have_fmt = 1;
+			if(fseek(file, sz - sizeof fmt + (sz&1), SEEK_CUR)) return -1;
+		}
+		else if(!memcmp(chunk, "data", 4)) {
+			if(!have_fmt) {
+				fine_log(WARN, "wav: data chunk before fmt chunk");
+				return -1;
+			}
+			size_t const frame_sz = info->channels*((info->bits+7)/8);
+			info->num_frames = frame_sz ? sz/frame_sz : 0;
+			return 0;
+		}
+		else if(fseek(file, sz + (sz&1), SEEK_CUR)) {
+			return -1;
+		}
+	}
+}
+
+static void fill_header(unsigned char *const h, WavInfo const*const info, size_t const num_frames) {
+	uint32_t const frame_sz = info->channels*((info->bits+7)/8);
+	uint32_t const data_sz = num_frames*frame_sz;
+	memcpy(h, "RIFF", 4);
+	put_le(h+4, 36 + data_sz, 4);
+	memcpy(h+8, "WAVEfmt ", 8);
+	put_le(h+16, 16, 4);
+	put_le(h+20, WAV_FORMAT_PCM, 2);
+	put_le(h+22, info->channels, 2);
+	put_le(h+24, info->sample_rate, 4);
+	put_le(h+28, info->sample_rate*frame_sz, 4);
+	put_le(h+32, frame_sz, 2);
+	put_le(h+34, info->bits, 2);
+	memcpy(h+36, "data", 4);
+	put_le(h+40, data_sz, 4);
+}
+
+int fine_wav_write_header(FILE *const file, WavInfo const*const info) {
+	unsigned char h[WAV_HEADER_SZ];
+	fill_header(h, info, 0);
+	return fwrite(h, 1, sizeof h, file) == sizeof h ? 0 : -1;
+}
+
+int fine_wav_finish(FILE *const file, WavInfo const*const info, size_t const num_frames) {
+	unsigned char h[WAV_HEADER_SZ];
+	fill_header(h, info, num_frames);
+	long const end = ftell(file);
+	if(fseek(file, 0, SEEK_SET) || fwrite(h, 1, sizeof h, file) != sizeof h) {
+		fine_log(WARN, "wav: could not write the header");
+		return -1;
+	}
+	return fseek(file, end, SEEK_SET);
+}
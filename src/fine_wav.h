@@ -0,0 +1,29 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal RIFF/WAVE support for the file backend: PCM only, samples are read and written as they are
+ * (little endian, like the rest of FINE).
+ * */
+
+typedef struct WavInfo WavInfo;
+struct WavInfo {
+	unsigned sample_rate;
+	unsigned channels;
+	unsigned bits;
+	size_t num_frames; //from the data chunk, 0 if the writer never finished the file
+};
+
+/*
+ * Parses the header and leaves file at the first sample.
+ * @return 0, -1 if this is not a PCM wav file
+ * */
+int fine_wav_read_header(FILE *file, WavInfo *info);
+
+//Writes a header for a file whose length is not known yet, see fine_wav_finish
+int fine_wav_write_header(FILE *file, WavInfo const* info);
+
+//Fills in the chunk sizes once num_frames frames have been written after the header
+int fine_wav_finish(FILE *file, WavInfo const* info, size_t num_frames);
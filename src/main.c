@@ -1,77 +1,119 @@
-#include <alsa/asoundlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdatomic.h>
 #include <time.h>
+#include <alloca.h>
 #include "fine_definitions.h"
 #include "fine_log.h"
 #include "fine_audio_io.h"
 #include "fine_fx.h"
-
-
-int debugthread(void *ptr) {
-
-	ASys *const sys = ptr;
-	while(1) {
-		char c = getchar();
-		if(c == 'p')  {
-			cnd_signal(&sys->playback);
-			atomic_store(&sys->play, 1);
-		}
-		else if(c == 'q') exit(0);
+#include "fine_kernel.h"
+#include "fine_mix.h"
+#include "fine_prof.h"
+#include "fine_control.h"
+
+//@return 0, -1 if one of them could not be opened, the others stay open
+static int open_devices(AudioDev **const devs, char const (*const names)[256], size_t const num, int const dir, unsigned const channels) {
+	for(size_t i = 0; i < num; ++i) {
+		if(!(devs[i] = fine_audio_dev_open(names[i], dir, channels))) return -1;
 	}
+	return 0;
 }
 
-
-
+//After the first output and input: "in:<spec>" is one more input, any other spec one more output
+static void add_name(char const*const name, char (*const name_out)[256], size_t *const num_zones,
+	char (*const name_in)[256], size_t *const num_mics) {
+	if(!strncmp(name, "in:", 3)) {
+		if(*num_mics == MAX_INPUTS) fine_exit("At most %d inputs", MAX_INPUTS);
+		strncpy(name_in[(*num_mics)++], name+3, sizeof *name_in - 1);
+	}
+	else {
+		if(*num_zones == MAX_ZONES) fine_exit("At most %d outputs", MAX_ZONES);
+		strncpy(name_out[(*num_zones)++], name, sizeof *name_out - 1);
+	}
+}
 
 int main(int argc, char *argv[argc+1]) {
 
-	char name_out[32] = {0};
-	char name_in[32] = {0};
-	if(argc != 3) {
+	//first, they block signals for the threads started later
+	fine_control_init();
+	fine_trace_init();
+	fine_log_init();
+	fine_kernel_init();
+
+	//ALSA names or other device specs, see fine_audio_io.h
+	//Every output is a zone, every input records into the recordings all of them play from
+	char name_out[MAX_ZONES][256] = {0};
+	char name_in[MAX_INPUTS][256] = {0};
+	size_t num_zones = 1;
+	size_t num_mics = 1;
+	if(argc < 3) {
 		FILE *const namefile = fopen("names", "r");
-		if(!namefile) fine_exit("Expected a newline separated file or arguments: [output name] [input name]");
-		if(fgets(name_out, 32, namefile)<0 || !name_out[0])
+		if(!namefile) fine_exit("Expected a newline separated file or arguments: [output name] [input name] [more output names] [in:more input names]");
+		if(!fgets(name_out[0], sizeof name_out[0], namefile) || !name_out[0][0])
 			fine_exit("read from names file failed");
-		if(fgets(name_in, 32, namefile)<0 || !name_in[0])
+		if(!fgets(name_in[0], sizeof name_in[0], namefile) || !name_in[0][0])
 			fine_exit("read from names file failed");
-
-		name_out[strcspn(name_out, "\n")]=0;
-		name_in[strcspn(name_in, "\n")]=0;
+		name_out[0][strcspn(name_out[0], "\n")]=0;
+		name_in[0][strcspn(name_in[0], "\n")]=0;
+		//the lines after them are more devices
+		char line[256];
+		while(fgets(line, sizeof line, namefile)) {
+			line[strcspn(line, "\n")]=0;
+			if(line[0]) add_name(line, name_out, &num_zones, name_in, &num_mics);
+		}
 		fclose(namefile);
 	}
 	else {
-		memcpy(name_out, argv[1], 31);
-		memcpy(name_in, argv[2], 31);
+		strncpy(name_out[0], argv[1], sizeof name_out[0] - 1);
+		strncpy(name_in[0], argv[2], sizeof name_in[0] - 1);
+		for(int i = 3; i < argc; ++i) add_name(argv[i], name_out, &num_zones, name_in, &num_mics);
 	}
 
-	snd_pcm_t *pcm_out = 0;
-	snd_pcm_t *pcm_in = 0;
-	snd_pcm_hw_params_t *params_out = 0;
-	snd_pcm_hw_params_t *params_in = 0;
-	snd_pcm_hw_params_alloca(&params_out);
-	snd_pcm_hw_params_alloca(&params_in);
-
-	while(fine_init_devices(name_out, name_in, &pcm_out, &pcm_in, params_out, params_in)<0) {
+	AudioDev *out[MAX_ZONES] = {0};
+	AudioDev *in[MAX_INPUTS] = {0};
+	unsigned const channels = fine_mix_channels_from_env();
+	while(open_devices(out, name_out, num_zones, FINE_PLAYBACK, channels) < 0
+		|| open_devices(in, name_in, num_mics, FINE_CAPTURE, 1) < 0) {
+		for(size_t z = 0; z < num_zones; ++z) {
+			fine_audio_dev_close(out[z]);
+			out[z] = 0;
+		}
+		for(size_t m = 0; m < num_mics; ++m) {
+			fine_audio_dev_close(in[m]);
+			in[m] = 0;
+		}
 		fine_log(INFO, "Configuration failed. Retrying...");
-		struct timespec delay = {.tv_sec=3};
-		thrd_sleep(&delay, 0);
+		//nothing else takes the signals yet
+		if(fine_control_wait(&(struct timespec){.tv_sec=3})) {
+			fine_log_shutdown();
+			return 0;
+		}
 	}
 
 	ASys *const sys = alloca(sizeof(ASys));
-	fine_thread_init_everything(sys, params_out, params_in, pcm_out, pcm_in);
-
-
-	thrd_t thrd[3];
-	thrd_create(thrd+0, fine_thread_input_idle, sys);
-	thrd_create(thrd+1, fine_thread_output, sys);
-	thrd_create(thrd+2, debugthread, sys);
-
-	thrd_join(thrd[0], 0);
-	thrd_join(thrd[1], 0);
-	thrd_join(thrd[2], 0);
+	fine_thread_init_everything(sys, out, num_zones, in, num_mics);
+
+
+	Control *const ctrl = fine_control_start(sys);
+
+	//All of them end once sys->stopped is set: at the end of the inputs, by a signal or the control socket
+	thrd_t thrd[1+MAX_INPUTS+MAX_ZONES];
+	thrd_create(thrd+0, fine_thread_monitor, sys);
+	for(size_t m = 0; m < num_mics; ++m) thrd_create(thrd+1+m, fine_thread_input_idle, sys->mics+m);
+	for(size_t z = 0; z < num_zones; ++z) thrd_create(thrd+1+num_mics+z, fine_thread_output, sys->zones+z);
+	for(size_t i = 0; i < 1+num_mics+num_zones; ++i) thrd_join(thrd[i], 0);
+	fine_control_stop(ctrl);
+
+	for(size_t m = 0; m < num_mics; ++m) fine_audio_dev_report(in[m], sys->mics[m].what, INFO);
+	for(size_t z = 0; z < num_zones; ++z) fine_audio_dev_report(out[z], sys->zones[z].what, INFO);
+	fine_thread_free_everything(sys);
+	for(size_t z = 0; z < num_zones; ++z) fine_audio_dev_close(out[z]);
+	for(size_t m = 0; m < num_mics; ++m) fine_audio_dev_close(in[m]);
+	fine_trace_dump();
+	fine_prof_report(INFO);
+	fine_log_shutdown();
 
 
 	printf("hi");